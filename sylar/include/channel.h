@@ -0,0 +1,327 @@
+#ifndef __SHIOSYLAR_CHANNEL_H__
+#define __SHIOSYLAR_CHANNEL_H__
+
+// 协程间传递数据的有界通道
+
+/*
+Channel<T>是多生产者多消费者的有界队列，只能在调度器的任务协程中阻塞收发
+1. send在通道满时挂起当前协程，recv在通道空时挂起当前协程，不阻塞所在线程
+2. 有协程在等待接收时，send直接把数据交给它，不经过缓冲区；容量为0时每次发送都要等到接收方
+3. close后不能再发送，等待中的发送方返回false，接收方取完缓冲区中剩余的数据后返回false
+4. trySend/tryRecv不挂起，任何线程都可以调用
+5. Select同时等待多个通道的收发，任一个可以完成时执行它并返回其序号
+6. 被唤醒的协程与唤醒者在同一个工作线程时，投递到本线程的收件箱，不产生系统调用和线程唤醒
+7. 共享栈协程挂起后栈会被换出，对方不能再写它的栈，等待项和收发的数据改放在堆上
+*/
+
+#include <atomic>
+#include <memory>
+#include <list>
+#include <vector>
+#include <utility>
+#include "fiber.h"
+#include "mutex.h"
+#include "noncopyable.h"
+
+namespace shiosylar
+{
+
+class Scheduler;
+
+// 多个通道的选择状态，多个等待项共享，第一个完成的等待项记录自己的序号
+struct ChannelSelectState
+{
+	std::atomic<int> fired = {-1};  // 完成的等待项序号，-1为还没有完成
+};
+
+// 挂起在通道上的收发方，存放在挂起协程的栈上，共享栈协程的放在堆上
+struct ChannelWaiter
+{
+	Scheduler* scheduler = nullptr;         // 挂起协程所属的调度器
+	Fiber::ptr fiber;                       // 挂起的协程
+	int thread = -1;                        // 挂起时所在的线程
+	void* slot = nullptr;                   // 发送方为待发送的数据，接收方为存放数据的位置
+	bool ok = false;                        // 是否完成了收发，通道关闭时为false
+	ChannelSelectState* select = nullptr;   // Select的共享状态，单个通道收发时为空
+	int index = 0;                          // 在Select中的序号
+
+	// 完成等待项前先认领，同一个Select只有一个等待项能被认领
+	bool claim();
+};
+
+// 唤醒的目标，在通道锁外唤醒
+struct ChannelWakeup
+{
+	Scheduler* scheduler = nullptr;
+	Fiber::ptr fiber;
+	int thread = -1;
+
+	// 记录要唤醒的等待项
+	void set(ChannelWaiter* waiter);
+
+	// 放回所属的调度器，与当前协程在同一个工作线程时投递到本线程收件箱
+	void wake();
+};
+
+// 通道的公共部分，与数据类型无关
+class ChannelBase : noncopyable
+{
+friend class Select;
+public:
+	typedef Spinlock MutexType;
+
+	ChannelBase(size_t capacity) :m_capacity(capacity) {}
+
+	virtual ~ChannelBase() {}
+
+	// 关闭通道，唤醒所有等待的收发方
+	void close();
+
+	// 通道是否已经关闭
+	bool isClosed();
+
+	// 缓冲区容量
+	size_t capacity() const { return m_capacity; }
+
+protected:
+	// 以下在持有m_mutex时调用，返回true表示收发已经完成或通道已关闭，ok为是否收发成功
+	// 需要唤醒的对方记录在wakeup中，由调用者释放锁后唤醒
+	virtual bool trySendLocked(void* slot, bool& ok, ChannelWakeup& wakeup) = 0;
+
+	virtual bool tryRecvLocked(void* slot, bool& ok, ChannelWakeup& wakeup) = 0;
+
+	// 发送或接收，不能立即完成时挂起当前协程，返回是否成功
+	bool sendOrRecv(bool send, void* slot);
+
+	// 从等待队列中取出第一个能认领的等待项，没有时返回空
+	static ChannelWaiter* PopWaiter(std::list<ChannelWaiter*>& waiters);
+
+	// 用当前协程填充等待项
+	static void InitWaiter(ChannelWaiter& waiter);
+
+protected:
+	MutexType m_mutex;                              // 通道锁，保护缓冲区和等待队列
+	std::list<ChannelWaiter*> m_senders;            // 等待发送的协程
+	std::list<ChannelWaiter*> m_receivers;          // 等待接收的协程
+	size_t m_capacity;                              // 缓冲区容量
+	bool m_closed = false;                          // 是否已关闭
+
+}; // class ChannelBase end
+
+// 有界通道
+template<class T>
+class Channel : public ChannelBase
+{
+public:
+	typedef std::shared_ptr<Channel> ptr;
+
+	// capacity为缓冲区容量，0表示发送方和接收方直接交接
+	Channel(size_t capacity)
+		:ChannelBase(capacity)
+		,m_buffer(capacity)
+	{
+	}
+
+	// 发送，通道满时挂起，通道已关闭时返回false
+	bool send(T value)
+	{
+		if(!Fiber::OnSharedStack())
+			return sendOrRecv(true, &value);
+		std::unique_ptr<T> slot(new T(std::move(value)));
+		return sendOrRecv(true, slot.get());
+	}
+
+	// 接收，通道空时挂起，通道已关闭且没有剩余数据时返回false
+	bool recv(T& value)
+	{
+		if(!Fiber::OnSharedStack())
+			return sendOrRecv(false, &value);
+		std::unique_ptr<T> slot(new T());
+		bool ok = sendOrRecv(false, slot.get());
+		if(ok)
+			value = std::move(*slot);
+		return ok;
+	}
+
+	// 不挂起的发送，成功时value被移走
+	bool trySend(T& value)
+	{
+		ChannelWakeup wakeup;
+		bool ok = false;
+		{
+			MutexType::Lock lock(m_mutex);
+			if(!trySendLocked(&value, ok, wakeup))
+				return false;
+		}
+		wakeup.wake();
+		return ok;
+	}
+
+	// 不挂起的接收
+	bool tryRecv(T& value)
+	{
+		ChannelWakeup wakeup;
+		bool ok = false;
+		{
+			MutexType::Lock lock(m_mutex);
+			if(!tryRecvLocked(&value, ok, wakeup))
+				return false;
+		}
+		wakeup.wake();
+		return ok;
+	}
+
+	// 缓冲区中的数据个数
+	size_t size()
+	{
+		MutexType::Lock lock(m_mutex);
+		return m_size;
+	}
+
+protected:
+	// 有等待的接收方时直接交给它，否则放入缓冲区
+	bool trySendLocked(void* slot, bool& ok, ChannelWakeup& wakeup) override
+	{
+		T* value = static_cast<T*>(slot);
+		ok = false;
+		if(m_closed)
+			return true;
+
+		ChannelWaiter* receiver = PopWaiter(m_receivers);
+		if(receiver)
+		{
+			*static_cast<T*>(receiver->slot) = std::move(*value);
+			receiver->ok = true;
+			wakeup.set(receiver);
+			ok = true;
+			return true;
+		}
+
+		if(m_size < m_capacity)
+		{
+			m_buffer[(m_head + m_size) % m_capacity] = std::move(*value);
+			++m_size;
+			ok = true;
+			return true;
+		}
+		return false;
+	}
+
+	// 先取缓冲区，空出的位置由等待的发送方补上，缓冲区为空时直接从发送方取
+	bool tryRecvLocked(void* slot, bool& ok, ChannelWakeup& wakeup) override
+	{
+		T* value = static_cast<T*>(slot);
+		ok = false;
+		if(m_size > 0)
+		{
+			*value = std::move(m_buffer[m_head]);
+			m_head = (m_head + 1) % m_capacity;
+			--m_size;
+
+			ChannelWaiter* sender = PopWaiter(m_senders);
+			if(sender)
+			{
+				m_buffer[(m_head + m_size) % m_capacity] = std::move(*static_cast<T*>(sender->slot));
+				++m_size;
+				sender->ok = true;
+				wakeup.set(sender);
+			}
+			ok = true;
+			return true;
+		}
+
+		ChannelWaiter* sender = PopWaiter(m_senders);
+		if(sender)
+		{
+			*value = std::move(*static_cast<T*>(sender->slot));
+			sender->ok = true;
+			wakeup.set(sender);
+			ok = true;
+			return true;
+		}
+		return m_closed;
+	}
+
+private:
+	std::vector<T> m_buffer;        // 环形缓冲区
+	size_t m_head = 0;              // 队首下标
+	size_t m_size = 0;              // 缓冲区中的数据个数
+
+}; // class Channel end
+
+// 同时等待多个通道的收发
+class Select : noncopyable
+{
+public:
+	// 添加一个接收项，完成后数据存放在value中
+	template<class T>
+	Select& recv(Channel<T>& channel, T& value)
+	{
+		m_cases.push_back(Case{&channel, false, &value, &HeapSlot<T>});
+		return *this;
+	}
+
+	// 添加一个发送项，完成后value被移走
+	template<class T>
+	Select& send(Channel<T>& channel, T& value)
+	{
+		m_cases.push_back(Case{&channel, true, &value, &HeapSlot<T>});
+		return *this;
+	}
+
+	// 等待任一项完成，返回其序号，没有项时返回-1
+	int wait()
+	{
+		return select(true);
+	}
+
+	// 不挂起，有可以立即完成的项时执行并返回其序号，否则返回-1
+	int tryWait()
+	{
+		return select(false);
+	}
+
+	// 最近完成的一项是否收发成功，通道已关闭时为false
+	bool ok() const { return m_ok; }
+
+private:
+	// 共享栈协程挂起时收发项的数据放在堆上，op为0时创建(发送项移入待发送的数据)
+	// 为1时移回数据后释放，commit表示该项是否完成(发送项未完成时数据移回原处)
+	enum HeapSlotOp { HEAP_SLOT_NEW, HEAP_SLOT_FREE };
+
+	template<class T>
+	static void* HeapSlot(HeapSlotOp op, bool send, void* value, void* heap, bool commit)
+	{
+		if(op == HEAP_SLOT_NEW)
+			return send ? new T(std::move(*static_cast<T*>(value))) : new T();
+		if(send != commit)
+			*static_cast<T*>(value) = std::move(*static_cast<T*>(heap));
+		delete static_cast<T*>(heap);
+		return nullptr;
+	}
+
+	// 一个收发项
+	struct Case
+	{
+		ChannelBase* channel;
+		bool send;
+		void* slot;
+		void* (*heapSlot)(HeapSlotOp op, bool send, void* value, void* heap, bool commit);
+	};
+
+	int select(bool block);
+
+	// 按地址顺序给所有通道加锁，避免与其他Select死锁，channels为空时由收发项生成
+	void lockAll(std::vector<ChannelBase*>& channels);
+
+	void unlockAll(std::vector<ChannelBase*>& channels);
+
+private:
+	std::vector<Case> m_cases;      // 收发项
+	bool m_ok = false;              // 最近完成的一项是否成功
+
+}; // class Select end
+
+} // namespace shiosylar end
+
+#endif
@@ -0,0 +1,58 @@
+#ifndef __SHIOSYLAR_FCONTEXT_H__
+#define __SHIOSYLAR_FCONTEXT_H__
+
+// 协程上下文切换
+
+/*
+协作式切换只需保存被调用者保存的寄存器，不需要像swapcontext那样保存信号掩码(每次一个rt_sigprocmask系统调用)和全部寄存器
+1. x86-64保存rbx、rbp、r12-r15和mxcsr、x87控制字，aarch64保存x19-x30和d8-d15，上下文就是切出时的栈顶指针
+2. 编译时定义SHIOSYLAR_FIBER_UCONTEXT(cmake -DFIBER_CONTEXT=ucontext)或在其他架构上，使用ucontext实现
+3. 库和使用者必须用相同的定义编译，Fiber对象的布局与之相关
+*/
+
+#include <stddef.h>
+
+#if !defined(SHIOSYLAR_FIBER_UCONTEXT) && !defined(__x86_64__) && !defined(__aarch64__)
+#define SHIOSYLAR_FIBER_UCONTEXT
+#endif
+
+#ifdef SHIOSYLAR_FIBER_UCONTEXT
+#include <ucontext.h>
+#endif
+
+namespace shiosylar
+{
+
+#ifdef SHIOSYLAR_FIBER_UCONTEXT
+
+// ucontext实现的上下文
+struct FiberContext
+{
+    ucontext_t ctx;
+};
+
+#else
+
+// 汇编实现的上下文，切出时寄存器压在自己的栈上，只记录栈顶
+struct FiberContext
+{
+    void* sp = nullptr;
+};
+
+#endif
+
+// 实现的名称，asm或ucontext
+const char* FiberContextName();
+
+// 在[stack, stack + size)上准备新的上下文，第一次切入时执行fn，fn不能返回
+void MakeFiberContext(FiberContext& ctx, void* stack, size_t size, void (*fn)());
+
+// 保存当前上下文到from，切换到to，从to切回时返回
+void SwapFiberContext(FiberContext& from, FiberContext& to);
+
+// 切出后上下文的栈顶指针，之上到栈底是恢复时需要的全部内容，无法获取时返回nullptr
+void* FiberContextStackPointer(const FiberContext& ctx);
+
+} // namespace shiosylar end
+
+#endif
@@ -3,9 +3,36 @@
 
 // 协程
 
-#include <memory>
+/*
+共享栈模式(构造时shared_stack为true，或调度器配置了scheduler.shared_stack)
+1. 每个线程有fiber.shared_stack_count个大小为fiber.shared_stack_size的共享栈，协程第一次切入时轮流绑定其中一个，之后只能在该线程上运行
+2. 切入时如果共享栈被其他协程占用，把占用者用到的部分(栈顶到栈底)拷贝到它自己的堆缓冲区，再把自己保存的内容拷回原地址
+3. 挂起的协程只占用与实际栈深相当的堆内存，而不是一整个栈，代价是切换时的两次拷贝
+   省下的主要是地址空间，私有栈的物理页本来就按需提交，常驻内存只省去按页提交时每个协程不满一页的零头
+   bench_shared_stack在挂起时栈深512、4K、16K下，每个空闲协程的映射内存少69、25、7倍，常驻内存只少2.3、1.5、1.1倍
+   在地址空间或vm.max_map_count受限、需要大量空闲协程时才有明显收益，不能指望常驻内存成倍下降
+4. 协程挂起期间栈上的对象可能被换出，不能让其他协程或线程访问，如在栈上的WaitGroup、按引用捕获局部变量的
+   parallel_for和offload，这类代码应当在私有栈协程中运行，Channel和Select在共享栈上会把等待项放在堆上
+   offload、parallel_for系列和在共享栈上的WaitGroup::wait会断言失败，而不是悄悄地破坏内存
+*/
+
+/*
+栈深采样和自适应栈大小
+1. fiber.stack_paint_sample为N(大于0)时，每个线程每N次新建或重置私有栈协程，抽一次在运行前把整个栈涂上固定的图案
+   协程运行函数返回时从栈的最低地址向上找第一个被改写的字，得到这次运行的最大栈深(高水位)
+2. 高水位按运行函数的类型汇总，即创建处的lambda或函数对象的类型，函数指针和std::function各自只算一类
+3. fiber.stack_adaptive为true时，未指定栈大小的协程按该类型的最大高水位加上fiber.stack_margin(百分比)的余量
+   向上取2的幂，在[fiber.stack_min_size, fiber.stack_size]之间选择栈大小，采样数不到fiber.stack_adapt_samples时用默认大小
+4. 涂色会提交整个栈的物理页，只应抽样；栈变小后，采样中没有出现过的更深的调用路径会触及保护页而段错误，余量要留足
+*/
+
+#include <atomic>
 #include <functional>
-#include <ucontext.h>
+#include <string>
+#include <vector>
+#include <boost/smart_ptr/intrusive_ptr.hpp>
+#include "fcontext.h"
+#include "task.h"
 
 namespace shiosylar
 {
@@ -13,12 +40,63 @@ namespace shiosylar
 // 协程调度器类
 class Scheduler;
 
-// 协程类
-class Fiber : public std::enable_shared_from_this<Fiber>
+// 线程的共享栈
+struct SharedStack;
+
+// 协程局部变量
+template<class T>
+class FiberLocal;
+
+// 每个协程的局部变量槽数，编译时可以调大，不超过64
+#ifndef SHIOSYLAR_FIBER_LOCAL_SLOTS
+#define SHIOSYLAR_FIBER_LOCAL_SLOTS 16
+#endif
+
+/*
+协程类
+1. 引用计数嵌在对象内，Fiber::ptr是侵入式指针，与分开分配控制块的shared_ptr相比少一次分配
+2. 切换和让出的路径上只用裸指针，调度器在队列之间移动协程指针，不产生引用计数的原子操作
+   只有把协程交给其他线程或其他对象持有(如登记到等待队列)时才增加计数
+   引用的归属: 运行中和YieldToReady挂起的协程由切入者(调度器或call的调用者)持有，切回后由它重新入队或释放
+   YieldToHold挂起的协程在挂起的栈帧中自己持有一个引用，等待项被丢弃而没有唤醒时协程泄漏，不会在挂起状态下析构
+3. 协程对象的内存由线程的空闲链表回收复用，创建和销毁只是链表的出入，栈由栈分配器缓存
+*/
+class Fiber
 {
 friend class Scheduler;
+template<class T> friend class FiberLocal;
 public:
-    typedef std::shared_ptr<Fiber> ptr;
+    typedef boost::intrusive_ptr<Fiber> ptr;
+
+    // 协程局部变量的槽数
+    static const size_t LOCAL_SLOTS = SHIOSYLAR_FIBER_LOCAL_SLOTS;
+    static_assert(LOCAL_SLOTS <= 64, "fiber local slots are tracked in a 64-bit mask");
+
+    // 协程栈分配的统计
+    struct StackStats
+    {
+        uint64_t allocs = 0;        // 分配次数
+        uint64_t threadHits = 0;    // 命中本线程缓存的次数
+        uint64_t poolHits = 0;      // 命中全局池的次数
+        uint64_t threadCached = 0;  // 各线程缓存中的空闲栈数
+        uint64_t poolCached = 0;    // 全局池中的空闲栈数
+        uint64_t mapped = 0;        // 当前映射的栈数，含使用中和空闲的，含共享栈
+        uint64_t sharedFibers = 0;  // 绑定了共享栈的协程数
+        uint64_t sharedStacks = 0;  // 各线程的共享栈数
+        uint64_t savedBytes = 0;    // 共享栈协程保存栈内容的堆内存字节数
+        uint64_t saves = 0;         // 共享栈协程被换出的次数
+        uint64_t restores = 0;      // 共享栈协程被换入的次数
+        uint64_t copiedBytes = 0;   // 换出和换入累计拷贝的字节数
+        uint64_t objectAllocs = 0;  // 协程对象的分配次数
+        uint64_t objectHits = 0;    // 其中命中本线程空闲链表的次数
+        uint64_t objectCached = 0;  // 各线程空闲链表中的协程对象数
+
+        // 不需要新映射的分配占比
+        double hitRate() const
+        {
+            return allocs ? (double)(threadHits + poolHits) / allocs : 0;
+        }
+    };
 
     // 协程的运行状态
     enum State
@@ -31,18 +109,34 @@ public:
         EXCEPT  // 异常状态
     };
 
+    // 一类运行函数的栈深统计
+    struct StackProfile
+    {
+        std::string name;           // 运行函数的类型名
+        uint64_t samples = 0;       // 采样的运行次数
+        uint32_t maxHighWater = 0;  // 采样到的最大栈深(字节)
+        uint32_t stackSize = 0;     // 自适应选择的栈大小，0为还没有选择，使用默认大小
+    };
+
 private:
     // 私有无参构造，静态调用创建单例主协程，主协程没有运行函数，主协程保存的是当前线程的上下文
     Fiber();
 
 public:
     // 公有构造，传入一个执行函数，创建一个协程并运行函数，use_caller表示任务完成后切回主协程
-    Fiber(std::function<void()> cb, size_t stacksize = 0, bool use_caller = false);
+    // shared_stack为true时在线程的共享栈上运行，忽略stacksize
+    Fiber(Task cb, size_t stacksize = 0, bool use_caller = false, bool shared_stack = false);
 
     ~Fiber();
 
+    // 协程对象从本线程的空闲链表分配，释放时放回
+    static void* operator new(size_t size);
+
+    static void operator delete(void* p);
+
     //重置协程，并重置状态
-    void reset(std::function<void()> cb);
+    // cb为空时只释放上一个任务的运行函数和协程局部变量，栈保持不变，要再用非空的cb重置后才能切入
+    void reset(Task cb);
 
     //切换到当前协程执行
     void swapIn();
@@ -62,13 +156,28 @@ public:
     // 获取当前协程对象的运行状态
     State getState() const { return m_state; }
 
+    // 是否在共享栈上运行
+    bool isSharedStack() const { return m_shared; }
+
+    // 共享栈协程绑定的线程id，只能在该线程上切入，还没有绑定或不是共享栈协程时为-1
+    int getStackThread() const { return m_stackThread; }
+
+    // 私有栈的大小，共享栈协程为0
+    uint32_t getStackSize() const { return m_stacksize; }
+
+    // 最近一次涂色采样到的栈深(字节)，没有采样过时为0
+    uint32_t getStackHighWater() const { return m_highWater; }
+
 public:
     //设置当前协程为正在运行的协程
     static void SetThis(Fiber* f);
 
-    // 获取当前正在运行的协程
+    // 获取当前正在运行的协程，没有时创建主协程
     static Fiber::ptr GetThis();
 
+    // 获取当前正在运行的协程的裸指针，不增加引用计数，没有时返回nullptr
+    static Fiber* GetCurrent();
+
     //协程切换到后台，并且设置为Ready状态
     static void YieldToReady();
 
@@ -78,6 +187,9 @@ public:
     // 获取总协程数
     static uint64_t TotalFibers();
 
+    // 获取协程栈分配的统计
+    static StackStats GetStackStats();
+
     // 协程运行的主函数
     static void MainFunc();
 
@@ -87,13 +199,78 @@ public:
     // 获取当前正在运行的协程ID
     static uint64_t GetFiberId();
 
+    // 当前协程是否在共享栈上运行
+    static bool OnSharedStack();
+
+    // p是否在当前协程绑定的共享栈上，这样的地址在协程挂起后可能被其他协程的栈内容覆盖
+    static bool OnSharedStack(const void* p);
+
+    // 绑定到当前线程共享栈的协程数，不为0时线程不能退出
+    static uint64_t SharedStackFibers();
+
+    // 获取各类运行函数的栈深统计
+    static std::vector<StackProfile> GetStackProfiles();
+
+    // 登记一个协程局部变量槽，返回槽号，destroy为空表示值存放在槽内不需要析构
+    static size_t RegisterLocal(void (*destroy)(void*));
+
 private:
+    // 切入共享栈协程前换出共享栈的占用者，换入自己
+    void loadSharedStack();
+
+    // 把用到的栈内容拷贝到堆缓冲区
+    void saveSharedStack();
+
+    // 协程结束时放弃共享栈，栈上的内容不再需要保存
+    void releaseSharedStack();
+
+    // 按运行函数类型的栈深统计选择私有栈的大小
+    uint32_t chooseStackSize() const;
+
+    // 在私有栈上创建上下文，抽中采样时先把栈涂色
+    void prepareStack(void (*fn)());
+
+    // 运行函数返回时计算涂色采样的栈深，记入该类运行函数的统计
+    void sampleStack();
+
+    // 析构已经赋值的协程局部变量
+    void clearLocals();
+
+private:
+    std::atomic<uint32_t> m_refs {0};   // 引用计数
     uint64_t m_id = 0;              // 协程id
     uint32_t m_stacksize = 0;       // 协程运行栈大小
     State m_state = INIT;           // 协程状态
-    ucontext_t m_ctx;               // 协程上下文
+    FiberContext m_ctx;             // 协程上下文
     void* m_stack = nullptr;        // 协程运行栈指针
-    std::function<void()> m_cb;     // 协程运行函数
+    Task m_cb;                      // 协程运行函数
+    bool m_shared = false;          // 是否在共享栈上运行
+    int m_stackThread = -1;         // 共享栈所属的线程id
+    SharedStack* m_sharedStack = nullptr;   // 绑定的共享栈，第一次切入时绑定
+    void (*m_entry)() = nullptr;    // 共享栈协程的入口函数，不为空时切入时才在共享栈上创建上下文
+    char* m_saved = nullptr;        // 换出时保存的栈内容
+    uint32_t m_savedSize = 0;       // 保存的字节数
+    uint32_t m_savedCap = 0;        // 缓冲区大小
+    bool m_fixedStack = false;      // 是否指定了栈大小，指定的不自适应
+    bool m_painted = false;         // 本次运行是否涂色采样
+    uint32_t m_highWater = 0;       // 最近一次采样到的栈深
+    const void* m_stackKey = nullptr;       // 采样时运行函数的类型标识
+    const char* m_stackName = nullptr;      // 采样时运行函数的类型名
+    uint64_t m_localMask = 0;       // 已经赋值的协程局部变量槽
+    void* m_locals[LOCAL_SLOTS] = {};   // 协程局部变量的槽，值或指向堆上的值
+
+    // 侵入式指针的计数操作，由Fiber::ptr通过参数依赖查找调用
+    friend void intrusive_ptr_add_ref(Fiber* f)
+    {
+        f->m_refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    // 计数减到0时析构，对象内存回到当前线程的空闲链表
+    friend void intrusive_ptr_release(Fiber* f)
+    {
+        if(f->m_refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete f;
+    }
 
 }; // class Fiber end
 
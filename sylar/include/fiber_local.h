@@ -0,0 +1,96 @@
+#ifndef __SHIOSYLAR_FIBER_LOCAL_H__
+#define __SHIOSYLAR_FIBER_LOCAL_H__
+
+// 协程局部变量
+
+/*
+FiberLocal<T>是每个协程一份的变量，跟着协程走，协程被调度到其他线程后仍然能读到自己的值
+1. 构造时登记一个槽号，槽直接放在Fiber对象内，访问是当前协程指针加槽号的一次取址，不查表不加锁
+2. 不大于一个指针、可平凡析构的类型(如trace id、截止时间、arena指针)的值直接存放在槽内，其他类型第一次访问时在堆上创建
+3. 每个协程第一次访问时值初始化，协程被重置或销毁时才析构，不在协程结束的路径上做
+4. 槽号不回收，整个进程最多SHIOSYLAR_FIBER_LOCAL_SLOTS个，应当定义为静态变量
+5. 不在协程中(线程的主协程)访问时，值属于线程的主协程，线程退出时析构
+6. 值的析构可能在其他协程中进行，析构函数里不要访问协程局部变量
+*/
+
+#include <new>
+#include <type_traits>
+#include <utility>
+#include "fiber.h"
+#include "noncopyable.h"
+
+namespace shiosylar
+{
+
+template<class T>
+class FiberLocal : noncopyable
+{
+public:
+    FiberLocal()
+        : m_slot(Fiber::RegisterLocal(IsInline::value ? nullptr : &FiberLocal::Destroy))
+    {
+    }
+
+    // 当前协程的值，第一次访问时值初始化
+    T& get()
+    {
+        Fiber* fiber = Current();
+        void*& slot = fiber->m_locals[m_slot];
+        uint64_t bit = 1ull << m_slot;
+        if(!(fiber->m_localMask & bit))
+        {
+            Construct(slot, IsInline());
+            fiber->m_localMask |= bit;
+        }
+        return Ref(slot, IsInline());
+    }
+
+    // 设置当前协程的值
+    void set(T value)
+    {
+        get() = std::move(value);
+    }
+
+    // 当前协程是否已经有值
+    bool has() const
+    {
+        Fiber* fiber = Fiber::GetCurrent();
+        return fiber && (fiber->m_localMask & (1ull << m_slot));
+    }
+
+    T& operator*() { return get(); }
+
+    T* operator->() { return &get(); }
+
+private:
+    // 能否直接存放在槽内
+    typedef std::integral_constant<bool, sizeof(T) <= sizeof(void*)
+                                         && alignof(T) <= alignof(void*)
+                                         && std::is_trivially_destructible<T>::value> IsInline;
+
+    // 当前协程，不在协程中时为线程的主协程
+    static Fiber* Current()
+    {
+        Fiber* fiber = Fiber::GetCurrent();
+        return fiber ? fiber : Fiber::GetThis().get();
+    }
+
+    static void Construct(void*& slot, std::true_type) { new (&slot) T(); }
+
+    static void Construct(void*& slot, std::false_type) { slot = new T(); }
+
+    static T& Ref(void*& slot, std::true_type) { return *reinterpret_cast<T*>(&slot); }
+
+    static T& Ref(void*& slot, std::false_type) { return *static_cast<T*>(slot); }
+
+    // 协程重置或销毁时析构堆上的值
+    static void Destroy(void* p) { delete static_cast<T*>(p); }
+
+private:
+    size_t m_slot;  // 槽号
+
+}; // class FiberLocal end
+
+} // namespace shiosylar end
+
+#endif
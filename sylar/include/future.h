@@ -0,0 +1,474 @@
+#ifndef __SHIOSYLAR_FUTURE_H__
+#define __SHIOSYLAR_FUTURE_H__
+
+// 异步结果、WaitGroup与组合器
+
+/*
+把N个后端调用分发出去再汇总结果，等待时不阻塞工作线程
+1. Promise<T>设置结果，Future<T>读取结果，二者共享同一个状态，都可以拷贝
+2. 在调度器的任务协程中等待时挂起当前协程，在普通线程中等待时阻塞当前线程
+3. then注册后续操作，结果就绪时投递到注册时所在的调度器执行，不在调度器中注册时由设置结果的线程直接执行
+4. 结果为异常时then跳过后续操作，异常传给返回的Future
+5. when_all等待全部完成，when_any等待任一个完成，WaitGroup等待一组任务结束
+6. Promise必须设置一次结果或异常，否则等待者永远不会被唤醒，重复设置抛出std::logic_error
+*/
+
+#include <atomic>
+#include <exception>
+#include <list>
+#include <memory>
+#include <stdexcept>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "macro.h"
+#include "mutex.h"
+#include "noncopyable.h"
+#include "scheduler.h"
+#include "task.h"
+
+namespace shiosylar
+{
+
+// 等待同一个条件的协程和线程，由条件的持有者在自己的锁内登记和取出
+struct FutureWaiters
+{
+	std::list<FiberWaiter> fibers;      // 挂起的协程
+	std::list<Semaphore*> threads;      // 阻塞的普通线程，信号量在线程栈上
+
+	// 登记当前协程或线程，释放lock后挂起，被notify唤醒后返回
+	void park(Spinlock::Lock& lock);
+
+	// 唤醒全部等待者，调用前已经在锁内取出
+	void notify();
+
+	void swap(FutureWaiters& other)
+	{
+		fibers.swap(other.fibers);
+		threads.swap(other.threads);
+	}
+};
+
+// 共享状态中与结果类型无关的部分
+class FutureStateBase : noncopyable
+{
+public:
+	typedef Spinlock MutexType;
+
+	virtual ~FutureStateBase() {}
+
+	// 结果是否已经就绪
+	bool isReady();
+
+	// 等待结果就绪
+	void wait();
+
+	// 结果就绪后执行cb，已经就绪时立即在当前线程执行
+	void onReady(Task cb);
+
+	// 设置异常作为结果
+	void setException(std::exception_ptr error);
+
+	// 结果就绪后调用，结果为异常时返回该异常
+	std::exception_ptr getException() const { return m_error; }
+
+protected:
+	// 持有m_mutex时调用，已经设置过结果时抛出std::logic_error
+	void checkNotReadyLocked();
+
+	// 持有lock时标记就绪，释放锁后唤醒等待者、执行回调
+	void setReady(MutexType::Lock& lock);
+
+	// 结果就绪后调用，结果为异常时重新抛出
+	void rethrowIfError();
+
+protected:
+	MutexType m_mutex;                  // 保护以下成员
+	bool m_ready = false;               // 结果是否已经就绪
+	std::exception_ptr m_error;         // 异常结果
+	FutureWaiters m_waiters;            // 等待结果的协程和线程
+	std::vector<Task> m_callbacks;      // 结果就绪后执行的回调
+
+}; // class FutureStateBase end
+
+// 带结果值的共享状态
+template<class T>
+class FutureState : public FutureStateBase
+{
+public:
+	typedef std::shared_ptr<FutureState> ptr;
+	typedef const T& Result;
+
+	void setValue(T value)
+	{
+		MutexType::Lock lock(m_mutex);
+		checkNotReadyLocked();
+		m_value.reset(new T(std::move(value)));
+		setReady(lock);
+	}
+
+	// 等待结果，返回结果值的引用或重新抛出异常
+	const T& get()
+	{
+		wait();
+		rethrowIfError();
+		return *m_value;
+	}
+
+private:
+	std::unique_ptr<T> m_value;         // 结果值，就绪后不再修改
+
+}; // class FutureState end
+
+// 无结果值的共享状态
+template<>
+class FutureState<void> : public FutureStateBase
+{
+public:
+	typedef std::shared_ptr<FutureState> ptr;
+	typedef void Result;
+
+	void setValue()
+	{
+		MutexType::Lock lock(m_mutex);
+		checkNotReadyLocked();
+		setReady(lock);
+	}
+
+	void get()
+	{
+		wait();
+		rethrowIfError();
+	}
+
+}; // class FutureState<void> end
+
+template<class T>
+class Future;
+
+template<class T>
+class Promise;
+
+// then中后续操作的返回类型，以结果值为参数，无结果值时不带参数
+template<class T, class F>
+struct FutureThenResult
+{
+	typedef typename std::result_of<F&(const T&)>::type type;
+};
+
+template<class F>
+struct FutureThenResult<void, F>
+{
+	typedef typename std::result_of<F&()>::type type;
+};
+
+// 设置结果
+template<class T>
+class Promise
+{
+public:
+	Promise() :m_state(std::make_shared<FutureState<T>>()) {}
+
+	// 获取与之关联的Future，可以多次获取
+	Future<T> getFuture() const { return Future<T>(m_state); }
+
+	// 设置结果值，无结果值时不带参数
+	template<class... Args>
+	void setValue(Args&&... args)
+	{
+		m_state->setValue(std::forward<Args>(args)...);
+	}
+
+	// 设置异常
+	void setException(std::exception_ptr error)
+	{
+		m_state->setException(std::move(error));
+	}
+
+	// 执行fn，把返回值或抛出的异常设置为结果
+	template<class F>
+	void setWith(F& fn);
+
+private:
+	typename FutureState<T>::ptr m_state;
+
+}; // class Promise end
+
+// 以结果值调用后续操作，把它的返回值或异常设置到promise
+template<class T, class R>
+struct FutureThenInvoker
+{
+	template<class F>
+	static void Run(F& fn, FutureState<T>& state, Promise<R>& promise)
+	{
+		promise.setValue(fn(state.get()));
+	}
+};
+
+template<class T>
+struct FutureThenInvoker<T, void>
+{
+	template<class F>
+	static void Run(F& fn, FutureState<T>& state, Promise<void>& promise)
+	{
+		fn(state.get());
+		promise.setValue();
+	}
+};
+
+template<class R>
+struct FutureThenInvoker<void, R>
+{
+	template<class F>
+	static void Run(F& fn, FutureState<void>& state, Promise<R>& promise)
+	{
+		state.get();
+		promise.setValue(fn());
+	}
+};
+
+template<>
+struct FutureThenInvoker<void, void>
+{
+	template<class F>
+	static void Run(F& fn, FutureState<void>& state, Promise<void>& promise)
+	{
+		state.get();
+		fn();
+		promise.setValue();
+	}
+};
+
+// 读取结果
+template<class T>
+class Future
+{
+public:
+	Future() {}
+
+	explicit Future(typename FutureState<T>::ptr state) :m_state(std::move(state)) {}
+
+	// 是否关联了共享状态
+	bool valid() const { return m_state != nullptr; }
+
+	// 结果是否已经就绪
+	bool isReady() const { return m_state->isReady(); }
+
+	// 等待结果就绪，不抛出异常
+	void wait() const { m_state->wait(); }
+
+	// 等待结果，返回结果值或重新抛出异常
+	typename FutureState<T>::Result get() const { return m_state->get(); }
+
+	// 结果就绪后调用fn(结果值)，返回fn结果的Future
+	// fn在注册时所在的调度器中执行，不在调度器中注册时由设置结果的线程直接执行
+	template<class F>
+	Future<typename FutureThenResult<T, typename std::decay<F>::type>::type> then(F&& fn) const
+	{
+		typedef typename std::decay<F>::type Fn;
+		typedef typename FutureThenResult<T, Fn>::type R;
+		Promise<R> promise;
+		Future<R> future = promise.getFuture();
+		m_state->onReady(Then<Fn, R>(m_state, std::move(promise), std::forward<F>(fn),
+									Scheduler::GetThis()));
+		return future;
+	}
+
+	// 结果就绪后在当前线程执行cb，cb不应阻塞
+	void onReady(Task cb) const { m_state->onReady(std::move(cb)); }
+
+	// 结果就绪后调用，结果为异常时返回该异常
+	std::exception_ptr getException() const { return m_state->getException(); }
+
+private:
+	// then注册的回调，结果就绪时投递到调度器或直接执行后续操作
+	template<class Fn, class R>
+	struct Then
+	{
+		typename FutureState<T>::ptr state;
+		Promise<R> promise;
+		Fn fn;
+		Scheduler* scheduler;
+
+		template<class F>
+		Then(typename FutureState<T>::ptr s, Promise<R> p, F&& f, Scheduler* sc)
+			:state(std::move(s)), promise(std::move(p)), fn(std::forward<F>(f)), scheduler(sc)
+		{
+		}
+
+		void operator()()
+		{
+			if(scheduler)
+			{
+				Scheduler* target = scheduler;
+				scheduler = nullptr;
+				target->schedule(Task(std::move(*this)));
+				return;
+			}
+			if(state->getException())
+			{
+				promise.setException(state->getException());
+				return;
+			}
+			try
+			{
+				FutureThenInvoker<T, R>::Run(fn, *state, promise);
+			}
+			catch(...)
+			{
+				promise.setException(std::current_exception());
+			}
+		}
+	};
+
+private:
+	typename FutureState<T>::ptr m_state;
+
+}; // class Future end
+
+template<class T>
+template<class F>
+void Promise<T>::setWith(F& fn)
+{
+	try
+	{
+		setValue(fn());
+	}
+	catch(...)
+	{
+		setException(std::current_exception());
+	}
+}
+
+template<>
+template<class F>
+void Promise<void>::setWith(F& fn)
+{
+	try
+	{
+		fn();
+		setValue();
+	}
+	catch(...)
+	{
+		setException(std::current_exception());
+	}
+}
+
+// 等待一组任务结束，计数归零时唤醒所有等待者，归零后可以重新add
+class WaitGroup : noncopyable
+{
+public:
+	typedef Spinlock MutexType;
+
+	~WaitGroup();
+
+	// 增加n个待完成的任务
+	void add(int64_t n = 1);
+
+	// 完成一个任务
+	void done();
+
+	// 等待计数归零
+	void wait();
+
+	// 当前未完成的任务数
+	int64_t count() const { return m_count.load(std::memory_order_acquire); }
+
+private:
+	std::atomic<int64_t> m_count = {0};     // 未完成的任务数
+	MutexType m_mutex;                      // 保护等待队列
+	FutureWaiters m_waiters;                // 等待计数归零的协程和线程
+
+}; // class WaitGroup end
+
+// 在调度器中执行fn，返回其结果的Future
+template<class F>
+Future<typename std::result_of<typename std::decay<F>::type&()>::type> run_async(Scheduler* scheduler, F&& fn)
+{
+	typedef typename std::decay<F>::type Fn;
+	typedef typename std::result_of<Fn&()>::type R;
+
+	struct Runner
+	{
+		Promise<R> promise;
+		Fn fn;
+
+		void operator()() { promise.setWith(fn); }
+	};
+
+	Promise<R> promise;
+	Future<R> future = promise.getFuture();
+	scheduler->schedule(Task(Runner{std::move(promise), std::forward<F>(fn)}));
+	return future;
+}
+
+// 全部完成后就绪，结果按输入顺序排列，任一个失败时结果为最先完成的那个异常
+template<class T>
+Future<std::vector<T>> when_all(const std::vector<Future<T>>& futures)
+{
+	struct Context
+	{
+		std::vector<Future<T>> futures;
+		Promise<std::vector<T>> promise;
+		std::atomic<size_t> remaining;
+		std::atomic<bool> failed = {false};
+
+		void complete(size_t index)
+		{
+			if(futures[index].getException() && !failed.exchange(true))
+				promise.setException(futures[index].getException());
+			if(--remaining != 0 || failed)
+				return;
+			std::vector<T> values;
+			values.reserve(futures.size());
+			for(auto& future : futures)
+				values.push_back(future.get());
+			promise.setValue(std::move(values));
+		}
+	};
+
+	auto ctx = std::make_shared<Context>();
+	ctx->futures = futures;
+	ctx->remaining = futures.size();
+	Future<std::vector<T>> future = ctx->promise.getFuture();
+	if(futures.empty())
+	{
+		ctx->promise.setValue(std::vector<T>());
+		return future;
+	}
+	for(size_t i = 0; i < futures.size(); ++i)
+		futures[i].onReady([ctx, i]() { ctx->complete(i); });
+	return future;
+}
+
+// 无结果值的when_all
+Future<void> when_all(const std::vector<Future<void>>& futures);
+
+// 任一个完成(成功或失败)后就绪，结果为它在输入中的序号
+template<class T>
+Future<size_t> when_any(const std::vector<Future<T>>& futures)
+{
+	ASSERT2(!futures.empty(), "when_any of no futures");
+
+	struct Context
+	{
+		Promise<size_t> promise;
+		std::atomic<bool> fired = {false};
+	};
+
+	auto ctx = std::make_shared<Context>();
+	Future<size_t> future = ctx->promise.getFuture();
+	for(size_t i = 0; i < futures.size(); ++i)
+	{
+		futures[i].onReady([ctx, i]() {
+			if(!ctx->fired.exchange(true))
+				ctx->promise.setValue(i);
+		});
+	}
+	return future;
+}
+
+} // namespace shiosylar end
+
+#endif
@@ -3,6 +3,17 @@
 
 // IO管理类，继承于 Scheduler 、TimerManager
 
+/*
+空闲的工作线程分为两种角色
+1. 轮询线程：同一时刻最多一个，阻塞在epoll_wait中，负责IO事件和定时器
+2. 休眠线程：其余空闲线程各自阻塞在自己的eventfd上，登记在基类Scheduler的休眠栈中
+tickle()从休眠栈弹出一个线程写它的eventfd，只唤醒这一个，没有休眠线程时才唤醒轮询线程
+每个eventfd带一个已通知标志，被唤醒前重复的通知不再产生系统调用
+轮询线程取到任务离开轮询角色时，唤醒一个休眠线程接替轮询，保证IO事件始终有线程等待
+一次epoll_wait触发的协程和定时任务先收集到本地批次中，一次加锁放入轮询线程的本地队列
+轮询线程自己执行一个，其余每个任务最多唤醒一个休眠线程来偷取
+*/
+
 #include "scheduler.h"
 #include "timer.h"
 
@@ -32,7 +43,7 @@ private:
 		{
 			Scheduler* scheduler = nullptr;
 			Fiber::ptr fiber;
-			std::function<void()> cb;
+			Task cb;
 		};
 
 		// 传入事件类型，获取事件回调
@@ -41,8 +52,8 @@ private:
 		// 重置事件回调
 		void resetContext(EventContext& ctx);
 
-		// 触发事件回调
-		void triggerEvent(Event event);
+		// 触发事件回调，batch不为空时属于当前调度器的任务放入batch，由调用者批量发布
+		void triggerEvent(Event event, std::vector<FiberAndThread>* batch = nullptr);
 
 		EventContext read; 			// 读事件触发回调
 		EventContext write; 		// 写事件触发回调
@@ -53,12 +64,13 @@ private:
 	}; // struct FdContext end
 
 public:
-	IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = "");
+	IOManager(size_t threads = 1, bool use_caller = true, const std::string& name = ""
+				,const std::vector<int>& cpus = std::vector<int>());
 
 	~IOManager();
 
 	// 添加 fd 上的事件
-	int addEvent(int fd, Event event, std::function<void()> cb = nullptr);
+	int addEvent(int fd, Event event, Task cb = nullptr);
 
 	// 删除 fd 上的事件，会清除事件的回调
 	bool delEvent(int fd, Event event);
@@ -72,10 +84,16 @@ public:
 	// 获取 IOManager 对象指针
 	static IOManager* GetThis();
 
+	// 累计的唤醒次数，即写eventfd的次数
+	uint64_t getWakeupCount() const { return m_wakeupCount; }
+
 protected:
 	// 向管道中写数据，唤醒epoll_wait
 	void tickle() override;
 
+	// 只唤醒指定的工作线程，它正在轮询时唤醒epoll_wait
+	void tickleWorker(size_t index) override;
+
 	// 判断IOManager是否可以停止
 	bool stopping() override;
 
@@ -91,9 +109,40 @@ protected:
 	// 判断IOManager是否可以停止
 	bool stopping(uint64_t& timeout);
 
+private:
+	// 空闲工作线程的休眠上下文
+	struct IdleContext
+	{
+		int eventFd = -1; 							// 休眠时阻塞读取的eventfd
+		std::atomic<bool> signalled = {false}; 		// 已写过eventfd还未被读取，合并重复的通知
+		char padding[64]; 							// 避免相邻工作线程的伪共享
+	};
+
+	// 在自己的eventfd上休眠，直到被唤醒，返回是否空闲超时退出
+	bool park(size_t index);
+
+	// 从休眠栈中取出一个线程并唤醒，返回是否唤醒了
+	bool unparkOne();
+
+	// 唤醒指定的休眠线程，调用前已将其移出休眠栈
+	void signalWorker(size_t index);
+
+	// 唤醒轮询线程的epoll_wait
+	void signalPoller();
+
+	// 唤醒所有空闲线程，调度器停止时使用
+	void wakeAll();
+
+	// 离开轮询角色，有休眠线程时唤醒一个接替轮询
+	void leavePoller();
+
 private:
 	int m_epfd = 0; 									// epoll描述符
-	int m_tickleFds[2]; 								// 命名管道，用于唤醒当前线程的epoll_wait
+	int m_tickleFd = -1; 								// eventfd，用于唤醒轮询线程的epoll_wait
+	std::atomic<bool> m_tickleSignalled = {false}; 		// 已写过m_tickleFd还未被读取
+	std::atomic<int> m_poller = {-1}; 					// 轮询线程的工作线程编号，-1为没有
+	std::vector<IdleContext*> m_idleContexts; 			// 各工作线程的休眠上下文，下标为工作线程编号
+	std::atomic<uint64_t> m_wakeupCount = {0}; 			// 累计的唤醒次数
 	std::atomic<size_t> m_pendingEventCount = {0}; 		// 活跃的事件数
 	RWMutexType m_mutex; 								// 互斥量读写锁
 	std::vector<FdContext*> m_fdContexts; 				// fd 容器
@@ -0,0 +1,128 @@
+#ifndef __SHIOSYLAR_MPMC_QUEUE_H__
+#define __SHIOSYLAR_MPMC_QUEUE_H__
+
+// 有界无锁多生产者多消费者队列
+
+/*
+环形数组，每个槽位带一个序号，生产者和消费者各自用CAS抢占位置
+1. 槽位在构造时一次性分配好，入队出队只在槽位上做移动赋值，不再分配内存
+2. 槽位序号等于入队位置时可写，等于入队位置+1时可读，读完后序号加上容量，留给下一轮
+3. 队列满时push返回false，由调用者决定溢出到其他容器
+*/
+
+#include <atomic>
+#include <stddef.h>
+#include <stdint.h>
+#include <utility>
+#include "noncopyable.h"
+
+namespace shiosylar
+{
+
+template<class T>
+class MPMCQueue : noncopyable
+{
+public:
+	// 容量向上取整为2的幂
+	MPMCQueue(size_t capacity)
+	{
+		size_t size = 2;
+		while(size < capacity)
+			size <<= 1;
+		m_mask = size - 1;
+		m_cells = new Cell[size];
+		for(size_t i = 0; i < size; ++i)
+			m_cells[i].seq.store(i, std::memory_order_relaxed);
+		m_enqueuePos.store(0, std::memory_order_relaxed);
+		m_dequeuePos.store(0, std::memory_order_relaxed);
+	}
+
+	~MPMCQueue()
+	{
+		delete[] m_cells;
+	}
+
+	// 入队，成功时v的内容被移走，队列满时返回false且不改动v
+	bool push(T& v)
+	{
+		Cell* cell = nullptr;
+		size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+		while(true)
+		{
+			cell = &m_cells[pos & m_mask];
+			size_t seq = cell->seq.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)pos;
+			if(dif == 0)
+			{
+				if(m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if(dif < 0) // 槽位还没被上一轮读走，队列已满
+				return false;
+			else
+				pos = m_enqueuePos.load(std::memory_order_relaxed);
+		}
+		cell->data = std::move(v);
+		cell->seq.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// 出队，队列空时返回false
+	bool pop(T& v)
+	{
+		Cell* cell = nullptr;
+		size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+		while(true)
+		{
+			cell = &m_cells[pos & m_mask];
+			size_t seq = cell->seq.load(std::memory_order_acquire);
+			intptr_t dif = (intptr_t)seq - (intptr_t)(pos + 1);
+			if(dif == 0)
+			{
+				if(m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if(dif < 0) // 槽位还没被写入，队列为空
+				return false;
+			else
+				pos = m_dequeuePos.load(std::memory_order_relaxed);
+		}
+		v = std::move(cell->data);
+		cell->data = T(); // 释放槽位中残留的资源，如智能指针
+		cell->seq.store(pos + m_mask + 1, std::memory_order_release);
+		return true;
+	}
+
+	// 近似的元素个数，并发时仅供参考
+	size_t size() const
+	{
+		size_t enq = m_enqueuePos.load(std::memory_order_relaxed);
+		size_t deq = m_dequeuePos.load(std::memory_order_relaxed);
+		return enq > deq ? enq - deq : 0;
+	}
+
+	// 队列容量
+	size_t capacity() const { return m_mask + 1; }
+
+private:
+	// 槽位，seq标识该槽位当前可写还是可读
+	struct Cell
+	{
+		std::atomic<size_t> seq;
+		T data;
+	};
+
+private:
+	Cell* m_cells = nullptr;                    // 预分配的槽位数组
+	size_t m_mask = 0;                          // 容量-1，用于取模
+	char m_pad0[64];                            // 隔开入队和出队位置，避免伪共享
+	std::atomic<size_t> m_enqueuePos;           // 下一个入队位置
+	char m_pad1[64];
+	std::atomic<size_t> m_dequeuePos;           // 下一个出队位置
+	char m_pad2[64];
+
+}; // class MPMCQueue end
+
+} // namespace shiosylar end
+
+#endif
@@ -3,6 +3,7 @@
 
 // 互斥量封装
 // 信号量-互斥锁-读写锁-自旋锁-原子锁（CAS）
+// 协程互斥锁-协程信号量-协程条件变量-协程读写锁
 
 #include <thread>
 #include <functional>
@@ -14,7 +15,7 @@
 #include <list>
 
 #include "noncopyable.h"
-// #include "fiber.h"
+#include "fiber.h"
 
 namespace shiosylar
 {
@@ -315,27 +316,193 @@ private:
 
 };
 
-// class Scheduler;
-// class FiberSemaphore : Noncopyable {
-// public:
-//     typedef Spinlock MutexType;
+class Scheduler;
 
-//     FiberSemaphore(size_t initial_concurrency = 0);
-//     ~FiberSemaphore();
+// 挂起等待的协程和它所属的调度器，唤醒时放回该调度器
+struct FiberWaiter
+{
+    Scheduler* scheduler = nullptr;
+    Fiber::ptr fiber;
+    bool writer = false;            // 读写锁中是否等待写锁
+};
+
+/*
+协程同步原语，只能在调度器的任务协程中使用
+1. 未竞争时加锁、解锁只有一次原子操作
+2. 竞争时当前协程登记到等待队列后YieldToHold挂起，不阻塞所在线程和线程上的其他协程
+3. 唤醒时把协程放回它所属的调度器，可能在该调度器的其他线程上继续执行
+4. 等待队列由自旋锁保护，只在竞争时使用
+*/
+
+// 协程互斥锁
+class FiberMutex : noncopyable
+{
+public:
+    typedef ScopedLockImpl<FiberMutex> Lock;
+
+    FiberMutex() {}
+
+    ~FiberMutex();
+
+    void lock()
+    {
+        uint32_t expected = UNLOCKED;
+        if(!m_state.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire))
+            lockSlow();
+    }
+
+    bool tryLock()
+    {
+        uint32_t expected = UNLOCKED;
+        return m_state.compare_exchange_strong(expected, LOCKED, std::memory_order_acquire);
+    }
 
-//     bool tryWait();
-//     void wait();
-//     void notify();
+    void unlock()
+    {
+        if(m_state.exchange(UNLOCKED, std::memory_order_release) == CONTENDED)
+            wakeOne();
+    }
 
-//     size_t getConcurrency() const { return m_concurrency;}
-//     void reset() { m_concurrency = 0;}
-// private:
-//     MutexType m_mutex;
-//     std::list<std::pair<Scheduler*, Fiber::ptr> > m_waiters;
-//     size_t m_concurrency;
-// };
+private:
+    enum
+    {
+        UNLOCKED    = 0,    // 未加锁
+        LOCKED      = 1,    // 已加锁，没有等待者
+        CONTENDED   = 2,    // 已加锁，可能有等待者，解锁时需要唤醒
+    };
+
+    // 竞争时挂起等待
+    void lockSlow();
+
+    // 唤醒一个等待者
+    void wakeOne();
+
+private:
+    Spinlock m_mutex;                       // 等待队列锁
+    std::list<FiberWaiter> m_waiters;       // 等待队列
+    std::atomic<uint32_t> m_state = {UNLOCKED};
+
+}; // class FiberMutex end
+
+// 协程信号量
+class FiberSemaphore : noncopyable
+{
+public:
+    FiberSemaphore(size_t initial_concurrency = 0);
+
+    ~FiberSemaphore();
+
+    // 不挂起的尝试获取
+    bool tryWait();
+
+    // 获取，没有可用的信号时挂起
+    void wait()
+    {
+        if(m_count.fetch_sub(1, std::memory_order_acquire) <= 0)
+            waitSlow();
+    }
+
+    // 释放，有等待者时唤醒一个
+    void notify()
+    {
+        if(m_count.fetch_add(1, std::memory_order_release) < 0)
+            notifySlow();
+    }
+
+    // 当前可用的信号数
+    size_t getConcurrency() const
+    {
+        int64_t count = m_count;
+        return count > 0 ? count : 0;
+    }
 
+private:
+    void waitSlow();
+
+    void notifySlow();
+
+private:
+    Spinlock m_mutex;                       // 等待队列锁
+    std::list<FiberWaiter> m_waiters;       // 等待队列
+    std::atomic<int64_t> m_count;           // 可用的信号数，为负时绝对值是等待者数(含正在登记的)
+    size_t m_wakeups = 0;                   // 释放时等待者还没登记进队列，留给它直接取走的信号数
+
+}; // class FiberSemaphore end
+
+// 协程条件变量，与FiberMutex配合使用
+class FiberCondition : noncopyable
+{
+public:
+    FiberCondition() {}
+
+    ~FiberCondition();
+
+    // 调用前已持有mutex，挂起期间释放，被唤醒后重新加锁再返回
+    void wait(FiberMutex& mutex);
+
+    // 唤醒一个等待者
+    void notify();
+
+    // 唤醒所有等待者
+    void notifyAll();
+
+private:
+    Spinlock m_mutex;                       // 等待队列锁
+    std::list<FiberWaiter> m_waiters;       // 等待队列
+    std::atomic<size_t> m_waiterCount = {0}; // 等待者数，为0时通知只有一次原子读
+
+}; // class FiberCondition end
+
+// 协程读写锁，写者优先，有写者等待时新来的读者也排队
+class FiberRWMutex : noncopyable
+{
+public:
+    typedef ReadScopedLockImpl<FiberRWMutex> ReadLock;
+
+    typedef WriteScopedLockImpl<FiberRWMutex> WriteLock;
+
+    FiberRWMutex() {}
+
+    ~FiberRWMutex();
+
+    void rdlock()
+    {
+        uint32_t state = m_state.load(std::memory_order_relaxed);
+        if((state & (WRITER | WAITERS))
+                || !m_state.compare_exchange_weak(state, state + 1, std::memory_order_acquire))
+            rdlockSlow();
+    }
+
+    void wrlock()
+    {
+        uint32_t expected = 0;
+        if(!m_state.compare_exchange_strong(expected, WRITER, std::memory_order_acquire))
+            wrlockSlow();
+    }
+
+    void unlock();
+
+private:
+    enum : uint32_t
+    {
+        READERS     = 0x3fffffff,   // 持有读锁的读者数
+        WRITER      = 0x40000000,   // 写锁已被持有
+        WAITERS     = 0x80000000,   // 等待队列非空，解锁时需要唤醒
+    };
+
+    void rdlockSlow();
+
+    void wrlockSlow();
+
+    // 锁被释放且有等待者时，唤醒队首的写者或队首连续的所有读者
+    void wake();
+
+private:
+    Spinlock m_mutex;                       // 等待队列锁
+    std::list<FiberWaiter> m_waiters;       // 等待队列
+    std::atomic<uint32_t> m_state = {0};
 
+}; // class FiberRWMutex end
 
 } // namespace shiosylar end
 
@@ -0,0 +1,192 @@
+#ifndef __SHIOSYLAR_OFFLOAD_H__
+#define __SHIOSYLAR_OFFLOAD_H__
+
+// 阻塞任务卸载线程池
+
+/*
+普通文件读写、fsync、压缩、第三方阻塞库等调用无法被hook，会卡住整个工作线程和排在后面的协程
+1. offload(fn)挂起当前协程，fn交给独立的固定大小线程池执行，执行完后把协程放回原来的调度器继续运行
+2. fn的返回值和抛出的异常都带回调用协程，像普通函数调用一样使用
+3. 排队的任务数有上限，队列满时调用协程挂起等待空位，不阻塞工作线程
+4. 不在调度器的协程中调用(如普通线程、线程池自身)时，直接在当前线程执行fn
+5. 线程池中的线程不开启hook，fn中的系统调用是真正的阻塞调用
+*/
+
+#include <atomic>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <type_traits>
+#include <vector>
+#include "scheduler.h"
+#include "singleton.h"
+#include "task.h"
+#include "thread.h"
+
+namespace shiosylar
+{
+
+// 卸载线程池
+class OffloadPool : noncopyable
+{
+public:
+	typedef std::shared_ptr<OffloadPool> ptr;
+	typedef Mutex MutexType;
+
+	// 线程池的统计信息，累计值从创建开始计算
+	struct Stats
+	{
+		uint64_t submitted = 0;         // 提交到线程池的任务数
+		uint64_t completed = 0;         // 执行完成的任务数
+		uint64_t inlined = 0;           // 不在协程中调用，直接在调用线程执行的任务数
+		uint64_t fullWaits = 0;         // 因队列满而挂起等待的次数
+		uint64_t queued = 0;            // 当前排队中的任务数
+		uint64_t waiting = 0;           // 当前等待队列空位的协程数
+		uint64_t running = 0;           // 当前正在执行任务的线程数
+		uint64_t totalQueueUs = 0;      // 累计排队时间(微秒)
+		uint64_t totalRunUs = 0;        // 累计执行时间(微秒)
+		uint64_t maxRunUs = 0;          // 最长执行时间(微秒)
+	};
+
+	// 使用配置offload.threads和offload.queue_size创建，供单例使用
+	OffloadPool();
+
+	// threads为线程数，max_queue为排队任务数上限
+	OffloadPool(size_t threads, size_t max_queue, const std::string& name = "offload");
+
+	// 执行完已排队的任务后停止
+	~OffloadPool();
+
+	// 在线程池中执行fn，当前协程挂起直到fn执行完成，返回fn的返回值或重新抛出fn的异常
+	template<class F>
+	typename std::result_of<F&()>::type offload(F&& fn)
+	{
+		typedef typename std::result_of<F&()>::type R;
+		Result<R> result;
+		execute([&result, &fn]() { result.run(fn); });
+		return result.get();
+	}
+
+	// 在线程池中执行job，当前协程挂起直到job执行完成
+	void execute(Task job);
+
+	// 停止线程池，执行完已排队的任务，之后提交的任务在调用线程执行
+	void stop();
+
+	// 获取统计信息
+	Stats getStats();
+
+	const std::string& getName() const { return m_name; }
+
+private:
+	// 排队中的任务
+	struct Job
+	{
+		Task fn;                        // 要执行的函数
+		Scheduler* scheduler = nullptr; // 调用协程所属的调度器
+		Fiber::ptr fiber;               // 调用协程，执行完后放回调度器
+		uint64_t submitUs = 0;          // 提交时间
+	};
+
+	// 等待队列空位的协程
+	struct Waiter
+	{
+		Scheduler* scheduler = nullptr;
+		Fiber::ptr fiber;
+	};
+
+	// fn的执行结果，保存返回值或异常
+	template<class R>
+	struct Result
+	{
+		std::unique_ptr<R> value;
+		std::exception_ptr error;
+
+		template<class F>
+		void run(F& fn)
+		{
+			try
+			{
+				value.reset(new R(fn()));
+			}
+			catch(...)
+			{
+				error = std::current_exception();
+			}
+		}
+
+		R get()
+		{
+			if(error)
+				std::rethrow_exception(error);
+			return std::move(*value);
+		}
+	};
+
+	// 线程池线程的入口函数
+	void run();
+
+	// 当前是否在调度器的任务协程中，只有此时可以挂起
+	static bool InFiber();
+
+private:
+	std::string m_name;                         // 线程池名称
+	size_t m_maxQueue;                          // 排队任务数上限
+	MutexType m_mutex;                          // 队列锁
+	Semaphore m_sem;                            // 每个任务和每个停止通知各一个信号
+	std::deque<Job> m_jobs;                     // 排队中的任务
+	std::deque<Waiter> m_waiters;               // 等待队列空位的协程
+	std::vector<Thread::ptr> m_threads;         // 线程池
+	bool m_stopping = false;                    // 是否已经停止
+
+	// 统计
+	std::atomic<uint64_t> m_submitted = {0};
+	std::atomic<uint64_t> m_completed = {0};
+	std::atomic<uint64_t> m_inlined = {0};
+	std::atomic<uint64_t> m_fullWaits = {0};
+	std::atomic<uint64_t> m_running = {0};
+	std::atomic<uint64_t> m_totalQueueUs = {0};
+	std::atomic<uint64_t> m_totalRunUs = {0};
+	std::atomic<uint64_t> m_maxRunUs = {0};
+
+}; // class OffloadPool end
+
+// 无返回值的执行结果
+template<>
+struct OffloadPool::Result<void>
+{
+	std::exception_ptr error;
+
+	template<class F>
+	void run(F& fn)
+	{
+		try
+		{
+			fn();
+		}
+		catch(...)
+		{
+			error = std::current_exception();
+		}
+	}
+
+	void get()
+	{
+		if(error)
+			std::rethrow_exception(error);
+	}
+};
+
+// 默认卸载线程池单例
+typedef Singleton<OffloadPool> OffloadMgr;
+
+// 在默认卸载线程池中执行fn，挂起当前协程直到完成，返回fn的返回值
+template<class F>
+typename std::result_of<F&()>::type offload(F&& fn)
+{
+	return OffloadMgr::GetInstance()->offload(std::forward<F>(fn));
+}
+
+} // namespace shiosylar end
+
+#endif
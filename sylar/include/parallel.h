@@ -0,0 +1,192 @@
+#ifndef __SHIOSYLAR_PARALLEL_H__
+#define __SHIOSYLAR_PARALLEL_H__
+
+// 基于调度器的并行算法
+
+/*
+把CPU密集的批处理分散到调度器已有的工作线程上，不创建额外线程
+1. 区间按自适应大小分块：每次取剩余量的1/(2*线程数)，不小于grain，开始时块大、末尾块小，兼顾开销与负载均衡
+2. 块由调用者和至多线程数个辅助任务共同领取，哪个线程空闲就多做，先领完的不用等其他任务被调度
+3. 在调度器的协程中调用时，等待剩余的块完成期间挂起当前协程，不阻塞所在线程；普通线程中调用时阻塞等待
+4. 某个块抛出异常后不再执行后续的块，所有已领取的块结束后在调用者中重新抛出第一个异常
+5. scheduler为空时使用当前线程的调度器，都没有时在当前线程串行执行
+*/
+
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <iterator>
+#include <memory>
+#include <utility>
+#include "future.h"
+#include "mutex.h"
+#include "scheduler.h"
+
+namespace shiosylar
+{
+
+// parallel_sort中元素少于此数时直接串行排序
+static const size_t PARALLEL_SORT_MIN = 16384;
+
+// parallel_for_range的共享状态，辅助任务可能在调用者返回后才被调度，由智能指针管理
+template<class F>
+struct ParallelForContext
+{
+	F* fn;                              // 块函数，只在还有未完成的块时访问
+	size_t end;                         // 区间终点
+	size_t grain;                       // 最小块大小
+	size_t divisor;                     // 块大小为剩余量除以divisor
+	std::atomic<size_t> next;           // 下一个未领取的下标
+	std::atomic<size_t> remaining;      // 未完成的元素数，归零时唤醒调用者
+	std::atomic<bool> failed = {false}; // 是否有块抛出了异常
+	std::exception_ptr error;           // 第一个异常，failed由false变为true的一方写入
+	Promise<void> promise;              // 全部完成时设置
+
+	// 领取并执行块，直到领完为止
+	void run()
+	{
+		size_t cur = next.load(std::memory_order_relaxed);
+		while(cur < end)
+		{
+			size_t chunk = std::max(grain, (end - cur) / divisor);
+			size_t stop = std::min(end, cur + chunk);
+			if(!next.compare_exchange_weak(cur, stop, std::memory_order_relaxed))
+				continue;
+
+			// 出错后领到的块直接跳过，只计数
+			if(!failed.load(std::memory_order_relaxed))
+			{
+				try
+				{
+					(*fn)(cur, stop);
+				}
+				catch(...)
+				{
+					if(!failed.exchange(true))
+						error = std::current_exception();
+				}
+			}
+			if(remaining.fetch_sub(stop - cur, std::memory_order_acq_rel) == stop - cur)
+				promise.setValue();
+			cur = next.load(std::memory_order_relaxed);
+		}
+	}
+};
+
+// 对[begin, end)分块并行执行fn(块起点, 块终点)，全部完成后返回
+template<class F>
+void parallel_for_range(Scheduler* scheduler, size_t begin, size_t end, F&& fn, size_t grain = 0)
+{
+	if(begin >= end)
+		return;
+	if(!scheduler)
+		scheduler = Scheduler::GetThis();
+	size_t total = end - begin;
+	size_t threads = scheduler ? scheduler->getThreadCount() : 1;
+	if(grain == 0)
+		grain = std::max<size_t>(1, total / (threads * 256));
+	if(threads <= 1 || total <= grain)
+	{
+		fn(begin, end);
+		return;
+	}
+
+	// 辅助任务通过ctx->fn访问调用者栈上的块函数，parallel_reduce和parallel_sort也经过这里
+	// 共享栈协程等待时栈会被其他协程覆盖
+	ASSERT2(!Fiber::OnSharedStack(), "parallel_for from shared stack fiber id=" << Fiber::GetFiberId()
+			<< ", run it in a private stack fiber");
+
+	typedef typename std::remove_reference<F>::type Fn;
+	auto ctx = std::make_shared<ParallelForContext<Fn>>();
+	ctx->fn = &fn;
+	ctx->end = end;
+	ctx->grain = grain;
+	ctx->divisor = threads * 2;
+	ctx->next = begin;
+	ctx->remaining = total;
+	Future<void> done = ctx->promise.getFuture();
+
+	// 调用者本身是该调度器的工作线程时也领取块，少派生一个辅助任务
+	bool caller_is_worker = Scheduler::GetThis() == scheduler && Scheduler::GetWorkerIndex() >= 0;
+	size_t helpers = std::min(threads - (caller_is_worker ? 1 : 0), (total + grain - 1) / grain - 1);
+	for(size_t i = 0; i < helpers; ++i)
+		scheduler->schedule([ctx]() { ctx->run(); });
+
+	ctx->run();
+	done.wait();
+	if(ctx->error)
+		std::rethrow_exception(ctx->error);
+}
+
+// 对[begin, end)中的每个下标i并行执行fn(i)
+template<class F>
+void parallel_for(Scheduler* scheduler, size_t begin, size_t end, F&& fn, size_t grain = 0)
+{
+	parallel_for_range(scheduler, begin, end, [&fn](size_t b, size_t e) {
+		for(size_t i = b; i < e; ++i)
+			fn(i);
+	}, grain);
+}
+
+// 并行计算reduce(identity, map(begin), ..., map(end - 1))
+// 每个块先在本地归约再合并，合并顺序不确定，reduce需满足结合律和交换律
+template<class T, class Map, class Reduce>
+T parallel_reduce(Scheduler* scheduler, size_t begin, size_t end, T identity,
+				Map&& map, Reduce&& reduce, size_t grain = 0)
+{
+	Spinlock mutex;
+	T result = identity;
+	parallel_for_range(scheduler, begin, end, [&](size_t b, size_t e) {
+		T acc = identity;
+		for(size_t i = b; i < e; ++i)
+			acc = reduce(std::move(acc), map(i));
+		Spinlock::Lock lock(mutex);
+		result = reduce(std::move(result), std::move(acc));
+	}, grain);
+	return result;
+}
+
+// 并行排序，先把区间分成2的幂个段并行排序，再逐轮两两并行归并，不保证稳定
+template<class RandomIt, class Compare>
+void parallel_sort(Scheduler* scheduler, RandomIt first, RandomIt last, Compare comp)
+{
+	size_t n = last - first;
+	if(!scheduler)
+		scheduler = Scheduler::GetThis();
+	size_t threads = scheduler ? scheduler->getThreadCount() : 1;
+	if(threads <= 1 || n < PARALLEL_SORT_MIN)
+	{
+		std::sort(first, last, comp);
+		return;
+	}
+
+	// 段数取不小于线程数的2的幂，同时保证每段不少于PARALLEL_SORT_MIN/2个元素
+	size_t parts = 1;
+	while(parts < threads && n / (parts * 2) >= PARALLEL_SORT_MIN / 2)
+		parts *= 2;
+	auto bound = [n, parts](size_t part) { return n * part / parts; };
+
+	parallel_for(scheduler, 0, parts, [&](size_t part) {
+		std::sort(first + bound(part), first + bound(part + 1), comp);
+	}, 1);
+	for(size_t width = 1; width < parts; width *= 2)
+	{
+		parallel_for(scheduler, 0, parts / (width * 2), [&](size_t pair) {
+			size_t lo = pair * width * 2;
+			std::inplace_merge(first + bound(lo), first + bound(lo + width),
+							first + bound(lo + width * 2), comp);
+		}, 1);
+	}
+}
+
+template<class RandomIt>
+void parallel_sort(Scheduler* scheduler, RandomIt first, RandomIt last)
+{
+	typedef typename std::iterator_traits<RandomIt>::value_type V;
+	parallel_sort(scheduler, first, last, std::less<V>());
+}
+
+} // namespace shiosylar end
+
+#endif
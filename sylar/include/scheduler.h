@@ -15,14 +15,22 @@
    只会在stop()函数中，stoppping()函数返回false，调度器尚未停止时，才会切到调度协程m_rootFiber
    运行run，其他情况是不会切到主线程的调度协程m_rootFiber中去运行run函数
    并且m_rootFiber是开启了use_caller，任务完成切到主协程而不是切到调度协程
+5. 看门狗默认关闭，scheduler.watchdog_ms大于0时每个调度器多一个看门狗线程，任务超时时向工作线程发
+   scheduler.watchdog_signal(默认SIGURG)获取调用栈，该信号原来的处理函数被保存，其他线程收到时转给它
+   工作线程正在未hook的阻塞系统调用(如nanosleep、epoll_wait、poll)中时，即使有SA_RESTART也会返回EINTR
 */
 
 #include <memory>
 #include <vector>
 #include <list>
+#include <deque>
+#include <unordered_map>
+#include <atomic>
 #include <iostream>
+#include <signal.h>
 #include "fiber.h"
 #include "thread.h"
+#include "mpmc_queue.h"
 
 namespace shiosylar
 {
@@ -30,75 +38,162 @@ namespace shiosylar
 // 调度器类
 class Scheduler
 {
+friend bool maybe_yield();
 public:
 	typedef std::shared_ptr<Scheduler> ptr;
 	typedef Mutex MutexType;
 
-	Scheduler(size_t threads = 1, bool use_caller = true, const std::string& name = "");
+	// 任务优先级，每个优先级有独立的队列
+	enum Priority
+	{
+		HIGH    = 0,    // 延迟敏感的任务，如请求处理
+		NORMAL  = 1,    // 默认优先级
+		LOW     = 2,    // 后台任务，如日志刷盘、缓存刷新
+	};
+
+	// 优先级的数量
+	static const size_t PRIORITY_COUNT = 3;
+
+	// 单个优先级的统计信息
+	struct PriorityStats
+	{
+		uint64_t depth = 0;             // 当前排队中的任务数
+		uint64_t dequeued = 0;          // 累计出队的任务数
+		uint64_t totalWaitUs = 0;       // 累计排队等待时间(微秒)
+		uint64_t maxWaitUs = 0;         // 最大排队等待时间(微秒)
+	};
+
+	// 等待时间直方图的桶数，第0个桶为[0, 1)微秒，第i个桶为[2^(i-1), 2^i)微秒，最后一个桶含更长的等待
+	static const size_t LATENCY_BUCKETS = 24;
+
+	// 单个工作线程的统计快照，计数从调度器创建开始累计，由抓取方自己做差
+	struct WorkerStats
+	{
+		size_t index = 0;               // 工作线程编号
+		int threadId = -1;              // 线程id
+		int cpu = -1;                   // 绑定的cpu
+		uint64_t tasks = 0;             // 执行的任务数
+		uint64_t switches = 0;          // 从调度协程切入任务协程和idle协程的次数
+		uint64_t steals = 0;            // 成功偷取的次数
+		uint64_t stolenTasks = 0;       // 偷来的任务数
+		uint64_t idleUs = 0;            // 在idle协程中的时间(微秒)
+		uint64_t pollUs = 0;            // 已返回的epoll_wait的耗时(微秒)，属于idleUs的一部分
+		uint64_t depth = 0;             // 本地队列和收件箱中排队的任务数
+		bool active = false;            // 是否有线程在运行，空闲退出或还未扩容的为false
+		uint64_t waitHistogram[LATENCY_BUCKETS] = {0}; // 入队到开始执行的等待时间分布
+	};
+
+	// 截止时间任务的统计，计数从调度器创建开始累计
+	struct DeadlineStats
+	{
+		uint64_t scheduled = 0;         // 提交的截止时间任务数
+		uint64_t completed = 0;         // 执行完成的任务数
+		uint64_t onTime = 0;            // 在截止时间前完成的任务数
+		uint64_t late = 0;              // 开始执行时未超时、完成时已超时的任务数
+		uint64_t shed = 0;              // 超时未执行而被丢弃的任务数
+		uint64_t depth = 0;             // 当前排队中的任务数
+
+		// 按时完成率，已经有结果(完成或丢弃)的任务中按时完成的比例
+		double onTimeRate() const
+		{
+			uint64_t total = completed + shed;
+			return total ? (double)onTime / total : 1.0;
+		}
+	};
+
+	// cpus为工作线程绑定的cpu，第i个创建的线程绑定cpus[i % cpus.size()]，为空时读取配置scheduler.cpus中该名称的设置
+	// 配置scheduler.max_threads中该名称的上限大于threads时，线程数在[scheduler.min_threads, scheduler.max_threads]间伸缩
+	Scheduler(size_t threads = 1, bool use_caller = true, const std::string& name = ""
+				,const std::vector<int>& cpus = std::vector<int>());
 
 	virtual ~Scheduler();
 
 	// 获取调度器名称
 	const std::string& getName() const { return m_name; }
 
+	// 获取当前创建的线程数，不含use_caller的创建者线程
+	size_t getThreadCount() const { return m_threadCount; }
+
+	// 函数任务是否在共享栈协程中运行，缺省读取配置scheduler.shared_stack，应在start前设置
+	// 共享栈协程第一次运行后绑定所在的线程，之后只会被投递到该线程，不会被偷取
+	// 这样的协程只能交回第一次运行它的调度器，交给其他调度器时断言失败
+	void setSharedStack(bool v) { m_sharedStack = v; }
+
+	bool isSharedStack() const { return m_sharedStack; }
+
 	// 获取调度器对象的指针
 	static Scheduler* GetThis();
 
 	// 获取调度器协程对象的指针
 	static Fiber* GetMainFiber();
 
+	// 当前线程在调度器中的工作线程编号，不在run中时为-1
+	static int GetWorkerIndex();
+
 	// 开启调度器
 	void start();
 
 	// 停止调度器
 	void stop();
 
-	// 向任务队列插入单个任务，thread参数指定任务执行的线程，-1为无限制
+	// 向任务队列插入单个任务，thread参数指定任务执行的线程，-1为无限制，priority为任务优先级
+	// 在本调度器的工作线程中调用时插入该线程的本地队列，否则插入无锁的全局注入队列
+	// 任务按完美转发构造，右值的函数对象直接移入队列，不再拷贝
 	template<class FiberOrCb>
-	void schedule(FiberOrCb fc, int thread = -1)
+	void schedule(FiberOrCb&& fc, int thread = -1, Priority priority = NORMAL)
 	{
-		bool need_tickle = false;
-		{
-			MutexType::Lock lock(m_mutex);
-			need_tickle = scheduleNoLock(fc, thread);
-		}
-
-		if(need_tickle)
+		if(scheduleNoLock(std::forward<FiberOrCb>(fc), thread, priority))
 			tickle();
 	}
 
 	// 批量的向任务队列插入任务
 	template<class InputIterator>
-	void schedule(InputIterator begin, InputIterator end)
+	void schedule(InputIterator begin, InputIterator end, Priority priority = NORMAL)
 	{
 		bool need_tickle = false;
+		while(begin != end)
 		{
-			MutexType::Lock lock(m_mutex);
-			while(begin != end)
-			{
-				need_tickle = scheduleNoLock(&*begin, -1) || need_tickle;
-				++begin;
-			}
+			need_tickle = scheduleNoLock(&*begin, -1, priority) || need_tickle;
+			++begin;
 		}
 		if(need_tickle)
 			tickle();
 	}
 
+	// 提交带截止时间的任务，deadline_us为GetCurrentUS()的绝对时间
+	// 截止时间任务排在独立的最小堆中，工作线程在收件箱之后、其他队列之前按最早截止时间优先(EDF)取出
+	// 每个工作线程连续取出scheduler.deadline_burst个截止时间任务后，先从优先级队列按加权轮询取一个，
+	// 持续的截止时间任务不会饿死HIGH/NORMAL/LOW，优先级队列为空时不受此限制，0为不限制(严格EDF)
+	// 提交或取出时已经超过截止时间的任务不再执行，改为执行on_shed(可为空)，按丢弃计数
+	void scheduleDeadline(Task cb, uint64_t deadline_us, Task on_shed = nullptr);
+
+	// 获取截止时间任务的统计
+	DeadlineStats getDeadlineStats();
+
 	void switchTo(int thread = -1);
 
+	// 获取某个优先级的排队深度和等待时间统计
+	PriorityStats getPriorityStats(Priority priority);
+
+	// 获取各工作线程的统计快照，不加锁，可以周期性抓取
+	std::vector<WorkerStats> getWorkerStats();
+
 	std::ostream& dump(std::ostream& os);
 
 protected:
 	// 用于通知各个线程有任务到来
 	virtual void tickle();
 
-	// 线程的入口函数
-	void run();
+	// 通知指定的工作线程有任务到来，该线程休眠时只唤醒它
+	virtual void tickleWorker(size_t index);
+
+	// 线程的入口函数，index为工作线程编号
+	void run(size_t index);
 
 	// 调度器是否已经停止
 	virtual bool stopping();
 
-	// 没有取到任务的忙等待函数
+	// 没有取到任务时先自旋等待，再休眠到被唤醒
 	virtual void idle();
 
 	// 设置当前线程的调度器指针
@@ -110,27 +205,62 @@ protected:
 		return m_idleThreadCount > 0;
 	}
 
+	// 工作线程数量，含use_caller的创建者线程
+	size_t getWorkerCount() const { return m_workers.size(); }
+
+	// 是否有该工作线程能取到的任务，不含其他线程收件箱中的任务
+	bool hasWork(size_t index);
+
+	// 累加工作线程在epoll_wait中的时间，只能由该工作线程调用
+	void addPollTime(size_t index, uint64_t us);
+
+	// 工作线程休眠多久(毫秒)后可以退出，0表示不能退出，如创建者线程或线程数已到下限
+	uint64_t getRetireIdleMs(size_t index) const;
+
+	// 空闲超时的工作线程退出，调用前已移出休眠栈，返回false时继续工作
+	// 返回true后该线程的idle协程应当立即结束，run随之返回，线程退出
+	bool retireWorker(size_t index);
+
+	// 休眠栈，保存休眠的工作线程编号，后进先出，先唤醒缓存最热的线程
+	// 基类在futex上休眠，IOManager在eventfd上休眠，休眠和唤醒的方式由派生类决定，共用这一个栈
+	// 登记休眠的工作线程
+	void pushParked(size_t index);
+
+	// 把指定的工作线程移出休眠栈，已被其他线程取出(它负责唤醒)时返回false
+	bool removeParked(size_t index);
+
+	// 取出最近休眠的工作线程，没有时返回-1
+	int popParked();
+
+	// 取出全部休眠的工作线程
+	void takeParked(std::vector<size_t>& indexes);
+
+	// 休眠的工作线程数，通知时无锁探测，调用前应有seq_cst屏障与休眠前的检查配对
+	size_t parkedCount() const { return m_parkedCount.load(std::memory_order_relaxed); }
+
 private:
-	// 向任务队列插入任务，底层封装
+	// 向任务队列插入任务，底层封装，返回是否需要通知其他线程
 	template<class FiberOrCb>
-	bool scheduleNoLock(FiberOrCb fc, int thread)
+	bool scheduleNoLock(FiberOrCb&& fc, int thread, Priority priority)
 	{
-		bool need_tickle = m_fibers.empty();
-		FiberAndThread ft(fc, thread);
+		FiberAndThread ft(std::forward<FiberOrCb>(fc), thread);
+		ft.priority = priority;
 		if(ft.fiber || ft.cb)
-			m_fibers.push_back(ft);
-		return need_tickle;
+			return enqueue(ft);
+		return false;
 	}
 
-private:
+protected:
 	// 任务节点的封装，一个任务至少含有一个协程或者函数
 	struct FiberAndThread
 	{
 		Fiber::ptr fiber;               // 协程
-		std::function<void()> cb;       // 协程执行函数
+		Task cb;                        // 协程执行函数
 		int thread;                     // 线程id
+		Priority priority = NORMAL;     // 优先级
+		uint64_t enqueueUs = 0;         // 入队时间(微秒)，用于统计等待时间
 
-		FiberAndThread(Fiber::ptr f, int thr) :fiber(f), thread(thr)
+		FiberAndThread(Fiber::ptr f, int thr) :fiber(std::move(f)), thread(thr)
 		{
 
 		}
@@ -141,16 +271,21 @@ private:
 			fiber.swap(*f); // 也可以用std::move，swap底层也是move
 		}
 
-		FiberAndThread(std::function<void()> f, int thr) :cb(f), thread(thr)
+		FiberAndThread(Task f, int thr) :cb(std::move(f)), thread(thr)
 		{
 
 		}
 
-		FiberAndThread(std::function<void()>* f, int thr) :thread(thr)
+		FiberAndThread(Task* f, int thr) :thread(thr)
 		{
 			cb.swap(*f);
 		}
 
+		FiberAndThread(std::function<void()>* f, int thr) :cb(std::move(*f)), thread(thr)
+		{
+			*f = nullptr;
+		}
+
 		FiberAndThread() :thread(-1)
 		{
 
@@ -161,20 +296,193 @@ private:
 			fiber = nullptr;
 			cb = nullptr;
 			thread = -1;
+			priority = NORMAL;
+			enqueueUs = 0;
 		}
 
 	}; // struct FiberAndThread end
 
+	// 批量发布任务，在本调度器的工作线程中一次加锁放入本地队列，指定线程的任务放入收件箱
+	// 不在工作线程中时逐个插入全局队列，发布后batch被清空，返回放入本地队列的任务数，由调用者决定唤醒多少线程
+	size_t scheduleBatch(std::vector<FiberAndThread>& batch);
+
 private:
-	MutexType m_mutex;                          // Mutex                          
-	std::vector<Thread::ptr> m_threads;         // 线程池  
-	std::list<FiberAndThread> m_fibers;         // 待执行的协程队列
+	// 工作线程上下文，每个工作线程持有每个优先级一个本地任务队列和一个收件箱
+	// 本地队列的主人从队首取任务、在队尾插入，空闲线程从队首偷走一半
+	// 收件箱存放指定由该线程执行的任务，只有主人会取，不会被偷走
+	struct WorkerContext
+	{
+		size_t index = 0;                           // 工作线程编号
+		std::atomic<int> threadId = {-1};           // 工作线程id
+		std::atomic<bool> active = {false};         // 是否有线程在运行，收件箱投递前检查
+		MutexType mutex;                            // 本地队列锁，只和偷取者竞争
+		std::deque<FiberAndThread> tasks[PRIORITY_COUNT];   // 各优先级的本地任务队列
+		std::atomic<size_t> size[PRIORITY_COUNT];   // 各本地队列长度，加锁前先无锁探测
+		MutexType inboxMutex;                       // 收件箱锁
+		std::deque<FiberAndThread> inbox;           // 收件箱，指定线程的任务
+		std::atomic<size_t> inboxSize = {0};        // 收件箱长度
+		std::vector<FiberAndThread> stolen;         // 偷取时的临时缓冲，复用内存
+		uint32_t tick = 0;                          // 取任务计数，定期优先检查全局队列
+		uint32_t deadlineRun = 0;                   // 连续取出的截止时间任务数，取到优先级队列的任务时清零
+		bool yielded = false;                       // 任务刚在maybe_yield中让出，下次取任务先检查全局队列
+		uint32_t credits[PRIORITY_COUNT];           // 加权轮询中各优先级剩余的出队额度
+		std::atomic<int> parked = {0};              // 是否在休眠，也是futex休眠的地址
+		int cpu = -1;                               // 绑定的cpu，-1为不绑定
+		int numaNode = -1;                          // 所在的NUMA节点，-1为未知
+
+		// 出队统计，只由本线程写入，读取时汇总
+		std::atomic<uint64_t> dequeued[PRIORITY_COUNT];
+		std::atomic<uint64_t> totalWaitUs[PRIORITY_COUNT];
+		std::atomic<uint64_t> maxWaitUs[PRIORITY_COUNT];
+		std::atomic<uint64_t> waitHistogram[LATENCY_BUCKETS];
+		std::atomic<uint64_t> switches = {0};
+		std::atomic<uint64_t> steals = {0};
+		std::atomic<uint64_t> stolenTasks = {0};
+		std::atomic<uint64_t> idleUs = {0};
+		std::atomic<uint64_t> idleSinceUs = {0};    // 本次进入idle的时间，不在idle中为0
+		std::atomic<uint64_t> pollUs = {0};
+
+		// 看门狗，runStartUs和runFiberId只由本线程写入
+		static const int STACK_FRAMES = 64;         // 记录的调用栈深度上限
+		uint64_t dequeueUs = 0;                     // 最近一次取到任务的时间
+		std::atomic<uint64_t> runStartUs = {0};     // 当前任务开始运行的时间，不在运行任务时为0
+		std::atomic<uint64_t> runFiberId = {0};     // 当前任务协程的id
+		uint64_t sliceStartUs = 0;                  // maybe_yield当前时间片的开始时间，只由本线程读写
+		pthread_t pthread = 0;                      // 线程句柄，看门狗向它发信号获取调用栈，在m_workerMutex内读写，退出run前清零
+		std::atomic<int> stackDepth = {0};          // 信号处理函数记录的调用栈深度，-1为已请求还未记录
+		void* stack[STACK_FRAMES];                  // 信号处理函数记录的调用栈
+		uint64_t reportedStartUs = 0;               // 看门狗已报告过的任务开始时间，同一次运行只报告一次
+		char padding[64];                           // 避免相邻工作线程的伪共享
+
+		WorkerContext();
+
+		// 本地队列中的任务总数
+		size_t localSize() const;
+
+	}; // struct WorkerContext end
+
+	// 将任务插入本地队列或全局队列，返回是否需要通知其他线程
+	bool enqueue(FiberAndThread& ft);
+
+	// 先取收件箱，再按优先级策略选出队列，依次从本地队列、全局队列、其他线程的本地队列中取任务
+	bool nextTask(WorkerContext* worker, FiberAndThread& ft, bool& tickle_me);
+
+	// 按严格优先级或加权轮询选出本次优先出队的优先级
+	size_t pickPriority(WorkerContext* worker);
+
+	// 从某个优先级的各个队列中取任务
+	bool popPriority(WorkerContext* worker, size_t priority, FiberAndThread& ft, bool& tickle_me);
+
+	// 从截止时间堆中取截止时间最早的任务，已超时的丢弃或换成其丢弃回调
+	bool popDeadline(WorkerContext* worker, FiberAndThread& ft);
+
+	// 截止时间任务执行完成，记录是否按时
+	void onDeadlineDone(uint64_t deadline_us);
+
+	// 从收件箱队首取任务
+	bool popInbox(WorkerContext* worker, FiberAndThread& ft, bool& tickle_me);
+
+	// 任务出队后的计数，活跃数先加一再减排队数，stopping不会看到两者同时为0
+	void onDequeue(WorkerContext* worker, FiberAndThread& ft);
+
+	// 所有队列中待执行的任务总数
+	size_t pendingTasks() const;
+
+	// 记录工作线程id和上下文的对应关系
+	void bindWorker(WorkerContext* worker, int thread);
+
+	// 从本地队列队首取任务
+	bool popLocal(WorkerContext* worker, size_t priority, FiberAndThread& ft, bool& tickle_me);
+
+	// 从全局注入队列和全局溢出队列取任务
+	bool popGlobal(WorkerContext* worker, size_t priority, FiberAndThread& ft, bool& tickle_me);
+
+	// 取到的协程还没有切出时，放回本地队列稍后再执行，返回是否放回
+	bool deferRunning(WorkerContext* worker, FiberAndThread& ft, bool& tickle_me);
+
+	// 从其他工作线程的本地队列偷取一半任务
+	bool steal(WorkerContext* thief, size_t priority, FiberAndThread& ft, bool& tickle_me);
+
+	// 先自旋等待任务，超时后在futex上休眠，直到被唤醒或有任务可取，返回是否空闲超时退出
+	bool park(WorkerContext* worker);
+
+	// 排队等待过久时扩容一个线程
+	void grow();
+
+	// 唤醒休眠的工作线程
+	void unpark(WorkerContext* worker);
+
+	// 唤醒所有休眠的工作线程，调度器停止时使用
+	void unparkAll();
+
+	// 看门狗线程的入口函数，定期检查各工作线程当前任务的运行时间
+	void watchdog();
+
+	// 报告运行超时的任务，获取该工作线程的调用栈一起打印
+	void reportOverrun(WorkerContext* worker, uint64_t start, uint64_t now);
+
+	// 看门狗信号的处理函数，在被检查的工作线程上记录调用栈，不是调度器的工作线程时转给原来的处理函数
+	static void WatchdogSignalHandler(int sig, siginfo_t* info, void* context);
+
+private:
+	MutexType m_mutex;                          // 全局溢出队列锁
+	std::vector<Thread::ptr> m_threads;         // 线程池，下标为工作线程编号减去创建者线程，退出的线程在扩容或停止时回收
+	MPMCQueue<FiberAndThread>* m_injectQueues[PRIORITY_COUNT];  // 各优先级的全局注入队列，非工作线程和IO事件、定时器提交的任务
+	std::list<FiberAndThread> m_fibers[PRIORITY_COUNT];         // 各优先级的全局溢出队列，注入队列满时的任务
+	std::atomic<size_t> m_globalCount[PRIORITY_COUNT];          // 各全局溢出队列长度
+	std::atomic<size_t> m_depth[PRIORITY_COUNT];                // 各优先级排队中的任务数，含收件箱
+	uint32_t m_weights[PRIORITY_COUNT];         // 加权轮询时各优先级的权重
+	bool m_strictPriority = false;              // 是否使用严格优先级，高优先级非空时不取低优先级
+	uint32_t m_deadlineBurst = 0;               // 连续取出截止时间任务的上限，之后让优先级队列取一个，0为不限制
+	std::vector<WorkerContext*> m_workers;      // 工作线程上下文，下标即工作线程编号
+	MutexType m_parkMutex;                      // 休眠栈锁
+	std::vector<size_t> m_parkedWorkers;        // 休眠栈，休眠的工作线程编号，后进先出
+	std::atomic<size_t> m_parkedCount = {0};    // 休眠的工作线程数，通知时无锁探测
+	uint64_t m_idleSpinUs = 0;                  // 休眠前的自旋时间(微秒)
+	std::vector<int> m_cpus;                    // 工作线程绑定的cpu
+	bool m_numaAware = false;                   // 工作线程分布在多个NUMA节点上，偷取时优先同节点
+	size_t m_minThreads = 0;                    // 创建线程数的下限
+	size_t m_maxThreads = 0;                    // 创建线程数的上限，与下限相等时不伸缩
+	uint64_t m_growWaitUs = 0;                  // 任务排队等待超过该时间(微秒)时扩容
+	uint64_t m_retireIdleMs = 0;                // 工作线程连续休眠超过该时间(毫秒)时退出
+	std::atomic<bool> m_growing = {false};      // 是否正在扩容，同一时刻只有一个线程创建新线程
+	std::atomic<uint64_t> m_lastGrowUs = {0};   // 上次扩容的时间
+	// 截止时间堆中的任务
+	struct DeadlineTask
+	{
+		uint64_t deadlineUs;            // 截止时间
+		uint64_t seq;                   // 提交序号，截止时间相同时先提交的先执行
+		FiberAndThread ft;              // 任务，执行完时记录完成时间
+		Task onShed;                    // 超时丢弃时执行的回调
+
+		// 用于最小堆，截止时间早的在堆顶
+		bool operator<(const DeadlineTask& other) const
+		{
+			return deadlineUs != other.deadlineUs ? deadlineUs > other.deadlineUs : seq > other.seq;
+		}
+	};
+
+	Spinlock m_deadlineMutex;                   // 截止时间堆锁
+	std::vector<DeadlineTask> m_deadlineHeap;   // 截止时间任务的最小堆
+	uint64_t m_deadlineSeq = 0;                 // 截止时间任务的提交序号，在m_deadlineMutex下修改
+	std::atomic<size_t> m_deadlineCount = {0};  // 截止时间堆中的任务数，取任务时无锁探测
+	std::atomic<uint64_t> m_deadlineScheduled = {0};
+	std::atomic<uint64_t> m_deadlineCompleted = {0};
+	std::atomic<uint64_t> m_deadlineOnTime = {0};
+	std::atomic<uint64_t> m_deadlineShed = {0};
+	uint64_t m_timeSliceUs = 0;                 // maybe_yield的时间片(微秒)
+	uint64_t m_watchdogUs = 0;                  // 任务连续运行超过该时间(微秒)时看门狗报告，0为不启用
+	bool m_sharedStack = false;                 // 函数任务是否在共享栈协程中运行
+	Thread::ptr m_watchdog;                     // 看门狗线程
+	std::atomic<int> m_watchdogStop = {0};      // 看门狗停止标志，也是futex休眠的地址
+	RWMutex m_workerMutex;                      // 线程id到工作线程的映射锁
+	std::unordered_map<int, WorkerContext*> m_threadWorkers; // 线程id到工作线程上下文的映射
 	Fiber::ptr m_rootFiber;                     // use_caller为true时有效,使用当前线程
 	std::string m_name;                         // 协程调度器名称
 
 protected:
-	std::vector<int> m_threadIds;                   // 协程下的线程id数组
-	size_t m_threadCount = 0;                       // 线程数量
+	std::vector<int> m_threadIds;                   // 协程下的线程id数组，扩缩容时在m_mutex下修改
+	std::atomic<size_t> m_threadCount = {0};        // 创建的线程数量
 	std::atomic<size_t> m_activeThreadCount = {0};  // 工作线程数量
 	std::atomic<size_t> m_idleThreadCount = {0};    // 空闲线程数量
 	bool m_stopping = true;                         // 是否正在停止
@@ -183,6 +491,11 @@ protected:
 
 }; // class Scheduler end
 
+// 协作式的让出检查点，当前任务连续运行超过scheduler.time_slice_us且有其他任务排队时让出，返回是否让出
+// 未超时只需读一次时钟，在不调用hook系统调用的长循环中定期调用，限制其他任务的排队时延
+// 没有其他任务排队时只重新开始时间片，看门狗仍从任务取出时算起，长时间不结束的任务照样会被报告
+bool maybe_yield();
+
 class SchedulerSwitcher : public noncopyable
 {
 public:
@@ -0,0 +1,241 @@
+#ifndef __SHIOSYLAR_TASK_H__
+#define __SHIOSYLAR_TASK_H__
+
+// 只可移动的任务函数对象
+
+/*
+替代std::function<void()>，作为调度器任务队列、协程运行函数、定时器和IO事件回调的存储类型
+1. 只能移动不能拷贝，任务在队列之间传递时只转移所有权，不拷贝捕获的对象
+2. 内置64字节缓冲区，捕获几个指针加一个智能指针的lambda直接存放在对象内，不分配堆内存
+3. 超过缓冲区大小、对齐要求更高或移动构造可能抛异常的可调用对象放到堆上，对象内只存指针
+4. 每种可调用类型对应一张静态操作表，完成调用、移动、析构，操作表的地址可以作为可调用类型的标识
+*/
+
+#include <cstddef>
+#include <functional>
+#include <new>
+#include <type_traits>
+#include <typeinfo>
+#include <utility>
+
+namespace shiosylar
+{
+
+class Task
+{
+public:
+	// 内置缓冲区的大小
+	static const size_t INLINE_SIZE = 64;
+
+	Task() noexcept {}
+
+	Task(std::nullptr_t) noexcept {}
+
+	// 从任意无参可调用对象构造，空的函数指针和std::function构造出空任务
+	template<class F
+			,class Fn = typename std::decay<F>::type
+			,class = typename std::enable_if<!std::is_same<Fn, Task>::value>::type
+			,class = decltype(std::declval<Fn&>()())>
+	Task(F&& f)
+	{
+		if(IsNull(f))
+			return;
+		init<Fn>(std::forward<F>(f), std::integral_constant<bool, IsInline<Fn>::value>());
+	}
+
+	Task(Task&& other) noexcept
+	{
+		moveFrom(other);
+	}
+
+	Task& operator=(Task&& other) noexcept
+	{
+		if(this != &other)
+		{
+			clear();
+			moveFrom(other);
+		}
+		return *this;
+	}
+
+	Task& operator=(std::nullptr_t) noexcept
+	{
+		clear();
+		return *this;
+	}
+
+	Task(const Task&) = delete;
+
+	Task& operator=(const Task&) = delete;
+
+	~Task()
+	{
+		clear();
+	}
+
+	// 执行任务，空任务抛出std::bad_function_call，与std::function一致
+	void operator()()
+	{
+		if(!m_ops)
+			throw std::bad_function_call();
+		m_ops->invoke(&m_storage);
+	}
+
+	explicit operator bool() const noexcept { return m_ops != nullptr; }
+
+	// 可调用对象类型的标识，同一种类型(如同一处定义的lambda)相同，空任务为nullptr
+	const void* typeKey() const noexcept { return m_ops; }
+
+	// 可调用对象类型的名称，未经反修饰，空任务为nullptr
+	const char* typeName() const { return m_ops ? m_ops->name() : nullptr; }
+
+	void swap(Task& other) noexcept
+	{
+		Task tmp(std::move(other));
+		other = std::move(*this);
+		*this = std::move(tmp);
+	}
+
+private:
+	// 可调用对象的操作表
+	struct Ops
+	{
+		void (*invoke)(void* storage);
+		void (*move)(void* dst, void* src);     // 移动到dst，并析构src中的对象
+		void (*destroy)(void* storage);
+		const char* (*name)();                  // 类型名，用函数取得，操作表保持静态初始化
+	};
+
+	typedef typename std::aligned_storage<INLINE_SIZE, alignof(std::max_align_t)>::type Storage;
+
+	// 是否可以存放在内置缓冲区中，移动必须不抛异常，保证Task的移动不抛异常
+	template<class Fn>
+	struct IsInline : std::integral_constant<bool,
+			sizeof(Fn) <= sizeof(Storage)
+			&& alignof(Fn) <= alignof(Storage)
+			&& std::is_nothrow_move_constructible<Fn>::value>
+	{ };
+
+	// 存放在内置缓冲区中的可调用对象
+	template<class Fn>
+	struct InlineOps
+	{
+		static void Invoke(void* storage)
+		{
+			(*static_cast<Fn*>(storage))();
+		}
+
+		static void Move(void* dst, void* src)
+		{
+			Fn* fn = static_cast<Fn*>(src);
+			new (dst) Fn(std::move(*fn));
+			fn->~Fn();
+		}
+
+		static void Destroy(void* storage)
+		{
+			static_cast<Fn*>(storage)->~Fn();
+		}
+
+		static const char* Name()
+		{
+			return typeid(Fn).name();
+		}
+
+		static const Ops s_ops;
+	};
+
+	// 存放在堆上的可调用对象，缓冲区中只存指针
+	template<class Fn>
+	struct HeapOps
+	{
+		static void Invoke(void* storage)
+		{
+			(**static_cast<Fn**>(storage))();
+		}
+
+		static void Move(void* dst, void* src)
+		{
+			*static_cast<Fn**>(dst) = *static_cast<Fn**>(src);
+		}
+
+		static void Destroy(void* storage)
+		{
+			delete *static_cast<Fn**>(storage);
+		}
+
+		static const char* Name()
+		{
+			return typeid(Fn).name();
+		}
+
+		static const Ops s_ops;
+	};
+
+	template<class Fn, class F>
+	void init(F&& f, std::true_type)
+	{
+		new (&m_storage) Fn(std::forward<F>(f));
+		m_ops = &InlineOps<Fn>::s_ops;
+	}
+
+	template<class Fn, class F>
+	void init(F&& f, std::false_type)
+	{
+		*reinterpret_cast<Fn**>(&m_storage) = new Fn(std::forward<F>(f));
+		m_ops = &HeapOps<Fn>::s_ops;
+	}
+
+	void moveFrom(Task& other) noexcept
+	{
+		if(other.m_ops)
+		{
+			other.m_ops->move(&m_storage, &other.m_storage);
+			m_ops = other.m_ops;
+			other.m_ops = nullptr;
+		}
+	}
+
+	void clear() noexcept
+	{
+		if(m_ops)
+		{
+			m_ops->destroy(&m_storage);
+			m_ops = nullptr;
+		}
+	}
+
+	template<class F>
+	static bool IsNull(const F&) { return false; }
+
+	template<class R, class... Args>
+	static bool IsNull(R (*f)(Args...)) { return f == nullptr; }
+
+	template<class S>
+	static bool IsNull(const std::function<S>& f) { return !f; }
+
+private:
+	Storage m_storage;              // 内置缓冲区，存放可调用对象或其堆上的指针
+	const Ops* m_ops = nullptr;     // 操作表，为空表示空任务
+
+}; // class Task end
+
+template<class Fn>
+const Task::Ops Task::InlineOps<Fn>::s_ops = {
+	&Task::InlineOps<Fn>::Invoke,
+	&Task::InlineOps<Fn>::Move,
+	&Task::InlineOps<Fn>::Destroy,
+	&Task::InlineOps<Fn>::Name
+};
+
+template<class Fn>
+const Task::Ops Task::HeapOps<Fn>::s_ops = {
+	&Task::HeapOps<Fn>::Invoke,
+	&Task::HeapOps<Fn>::Move,
+	&Task::HeapOps<Fn>::Destroy,
+	&Task::HeapOps<Fn>::Name
+};
+
+} // namespace shiosylar end
+
+#endif
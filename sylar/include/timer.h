@@ -3,10 +3,12 @@
 
 // 定时器类的封装，由IOManager继承使用
 
+#include <atomic>
 #include <memory>
 #include <vector>
 #include <set>
 #include "thread.h"
+#include "task.h"
 
 namespace shiosylar
 {
@@ -30,15 +32,26 @@ public:
 
 private:
 	// 私有构造，只能通过TimerManager定时器管理类进行创建
-	Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager);
+	Timer(uint64_t ms, Task cb, bool recurring, TimerManager* manager);
 
 	Timer(uint64_t next);
 
+	// 回调函数是否还在，为空说明定时器已被取消或一次性任务已经触发
+	bool hasCallback() const { return m_cb || m_recurringCb; }
+
 private:
 	bool m_recurring = false; 				 // 是否为重复定时器
 	uint64_t m_ms = 0; 						 // 循环周期
 	uint64_t m_next = 0; 					 // 触发的精确时间，定时器创建的时间 + 定时周期
-	std::function<void()> m_cb; 			 // 触发的回调函数
+	// 重复定时器的回调函数，每次触发共享同一个对象，running保证它不会被并发运行
+	struct RecurringCb
+	{
+		Task cb;
+		std::atomic<bool> running = {false}; // 已经投递且还没运行完
+	};
+
+	Task m_cb; 								 // 一次性定时器的回调函数，触发时移入任务队列
+	std::shared_ptr<RecurringCb> m_recurringCb; // 重复定时器的回调函数
 	TimerManager* m_manager = nullptr; 		 // 所属的管理器指针
 
 private:
@@ -64,11 +77,13 @@ public:
 	virtual ~TimerManager();
 
 	// 传入触发时间、触发回调、是否为重复定时器来添加一个定时器
-	Timer::ptr addTimer(uint64_t ms, std::function<void()> cb
+	// 重复定时器每次触发运行的是同一个回调对象而不是副本，上一次触发的回调还没运行完时跳过本次触发
+	// 所以回调不会并发运行，可以修改自己捕获的状态，回调运行得比周期慢时触发次数会少于周期数
+	Timer::ptr addTimer(uint64_t ms, Task cb
 						,bool recurring = false);
 
 	// 添加一个条件定时器，weak_cond是判断条件
-	Timer::ptr addConditionTimer(uint64_t ms, std::function<void()> cb
+	Timer::ptr addConditionTimer(uint64_t ms, Task cb
 						,std::weak_ptr<void> weak_cond
 						,bool recurring = false);
 
@@ -76,7 +91,7 @@ public:
 	uint64_t getNextTimer();
 
 	// 获取已触发定时器的回调函数，并将其插入任务队列
-	void listExpiredCb(std::vector<std::function<void()> >& cbs);
+	void listExpiredCb(std::vector<Task>& cbs);
 
 	// 查询是否还有未完成的定时任务
 	bool hasTimer();
@@ -14,6 +14,8 @@
 #include <sys/syscall.h>
 #include <stdio.h>
 #include <stdint.h>
+#include <time.h>
+#include <atomic>
 #include <vector>
 #include <string>
 #include <iomanip>
@@ -42,6 +44,38 @@ uint64_t GetCurrentMS();
 
 uint64_t GetCurrentUS();
 
+// 自旋等待时的CPU提示，降低自旋的功耗并把执行资源让给同核的超线程
+inline void CpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#elif defined(__aarch64__)
+	asm volatile("yield" ::: "memory");
+#endif
+}
+
+// 在addr上休眠，直到被FutexWake唤醒或*addr不等于expected，timeout为空则不超时
+// 返回0表示被唤醒或值已改变，-1表示超时或被信号中断
+int FutexWait(std::atomic<int>* addr, int expected, const struct timespec* timeout = nullptr);
+
+// 唤醒最多count个在addr上休眠的线程，返回唤醒的数量
+int FutexWake(std::atomic<int>* addr, int count);
+
+// 解析cpulist格式的字符串，如"0-3,8,10-11"，返回cpu编号数组
+std::vector<int> ParseCpuList(const std::string& str);
+
+// NUMA节点数，读取/sys/devices/system/node，读取失败时返回1
+int GetNumaNodeCount();
+
+// cpu所在的NUMA节点，未知时返回-1
+int GetCpuNumaNode(int cpu);
+
+// 当前线程正在运行的NUMA节点，未知时返回-1
+int GetCurrentNumaNode();
+
+// 设置[addr, addr + len)的内存优先从node节点分配，addr需按页对齐，缺页时生效
+bool BindMemoryToNode(void* addr, size_t len, int node);
+
 
 template<class T>
 const char* TypeToName()
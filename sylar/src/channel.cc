@@ -0,0 +1,228 @@
+#include "../include/channel.h"
+#include "../include/macro.h"
+#include "../include/scheduler.h"
+
+#include <algorithm>
+
+namespace shiosylar
+{
+
+// Select每次从不同的项开始检查，避免总是先完成靠前的项
+static thread_local uint32_t t_select_start = 0;
+
+// 完成等待项前先认领
+bool ChannelWaiter::claim()
+{
+	if(!select)
+		return true;
+	int expected = -1;
+	return select->fired.compare_exchange_strong(expected, index);
+}
+
+// 记录要唤醒的等待项
+void ChannelWakeup::set(ChannelWaiter* waiter)
+{
+	scheduler = waiter->scheduler;
+	fiber = waiter->fiber;
+	thread = waiter->thread;
+}
+
+// 放回所属的调度器，还没切出时调度器会稍后再执行
+void ChannelWakeup::wake()
+{
+	if(!fiber)
+		return;
+	// 同一个工作线程上的协程之间交接，放入本线程收件箱，下一个就执行它，不通知其他线程
+	if(scheduler == Scheduler::GetThis() && thread == GetThreadId())
+		scheduler->schedule(std::move(fiber), thread);
+	else
+		scheduler->schedule(std::move(fiber));
+}
+
+// 从等待队列中取出第一个能认领的等待项，已被Select的其他项完成的直接丢弃
+ChannelWaiter* ChannelBase::PopWaiter(std::list<ChannelWaiter*>& waiters)
+{
+	while(!waiters.empty())
+	{
+		ChannelWaiter* waiter = waiters.front();
+		waiters.pop_front();
+		if(waiter->claim())
+			return waiter;
+	}
+	return nullptr;
+}
+
+// 用当前协程填充等待项
+void ChannelBase::InitWaiter(ChannelWaiter& waiter)
+{
+	ASSERT2(Scheduler::GetThis() && Scheduler::GetWorkerIndex() >= 0
+			&& Fiber::GetThis().get() != Scheduler::GetMainFiber(),
+			"channel blocking operation used outside a scheduler fiber");
+	waiter.scheduler = Scheduler::GetThis();
+	waiter.fiber = Fiber::GetThis();
+	waiter.thread = GetThreadId();
+}
+
+// 关闭通道，等待的收发方都以失败返回
+void ChannelBase::close()
+{
+	std::vector<ChannelWakeup> wakeups;
+	{
+		MutexType::Lock lock(m_mutex);
+		if(m_closed)
+			return;
+		m_closed = true;
+		ChannelWaiter* waiter = nullptr;
+		while((waiter = PopWaiter(m_receivers)) != nullptr)
+		{
+			waiter->ok = false;
+			wakeups.push_back(ChannelWakeup());
+			wakeups.back().set(waiter);
+		}
+		while((waiter = PopWaiter(m_senders)) != nullptr)
+		{
+			waiter->ok = false;
+			wakeups.push_back(ChannelWakeup());
+			wakeups.back().set(waiter);
+		}
+	}
+	for(auto& wakeup : wakeups)
+		wakeup.wake();
+}
+
+// 通道是否已经关闭
+bool ChannelBase::isClosed()
+{
+	MutexType::Lock lock(m_mutex);
+	return m_closed;
+}
+
+// 发送或接收，不能立即完成时登记到等待队列后挂起，由对方完成收发后唤醒
+bool ChannelBase::sendOrRecv(bool send, void* slot)
+{
+	ChannelWakeup wakeup;
+	ChannelWaiter local;
+	std::unique_ptr<ChannelWaiter> heap;
+	if(Fiber::OnSharedStack())
+		heap.reset(new ChannelWaiter);
+	ChannelWaiter& waiter = heap ? *heap : local;
+	bool ok = false;
+	{
+		MutexType::Lock lock(m_mutex);
+		bool done = send ? trySendLocked(slot, ok, wakeup) : tryRecvLocked(slot, ok, wakeup);
+		if(!done)
+		{
+			InitWaiter(waiter);
+			waiter.slot = slot;
+			(send ? m_senders : m_receivers).push_back(&waiter);
+		}
+	}
+
+	if(waiter.fiber)
+	{
+		Fiber::YieldToHold();
+		return waiter.ok;
+	}
+	wakeup.wake();
+	return ok;
+}
+
+// 按地址顺序给所有通道加锁，同一个通道只加一次
+void Select::lockAll(std::vector<ChannelBase*>& channels)
+{
+	if(channels.empty())
+	{
+		for(auto& c : m_cases)
+			channels.push_back(c.channel);
+		std::sort(channels.begin(), channels.end());
+		channels.erase(std::unique(channels.begin(), channels.end()), channels.end());
+	}
+	for(auto channel : channels)
+		channel->m_mutex.lock();
+}
+
+void Select::unlockAll(std::vector<ChannelBase*>& channels)
+{
+	for(auto it = channels.rbegin(); it != channels.rend(); ++it)
+		(*it)->m_mutex.unlock();
+}
+
+// 锁住所有通道后依次检查，都不能完成时在每个通道上登记等待项后挂起
+// 被唤醒时已有一项被认领并完成，再次锁住所有通道，移除其余等待项
+int Select::select(bool block)
+{
+	m_ok = false;
+	size_t count = m_cases.size();
+	if(count == 0)
+		return -1;
+
+	std::vector<ChannelBase*> channels;
+	ChannelWakeup wakeup;
+	lockAll(channels);
+	size_t start = t_select_start++;
+	for(size_t i = 0; i < count; ++i)
+	{
+		size_t index = (start + i) % count;
+		Case& c = m_cases[index];
+		bool done = c.send ? c.channel->trySendLocked(c.slot, m_ok, wakeup)
+						   : c.channel->tryRecvLocked(c.slot, m_ok, wakeup);
+		if(done)
+		{
+			unlockAll(channels);
+			wakeup.wake();
+			return index;
+		}
+	}
+
+	if(!block)
+	{
+		unlockAll(channels);
+		return -1;
+	}
+
+	// 共享栈协程挂起后栈会被换出，选择状态和收发的数据放在堆上，等待项本来就在堆上
+	bool shared = Fiber::OnSharedStack();
+	ChannelSelectState local_state;
+	std::unique_ptr<ChannelSelectState> heap_state;
+	if(shared)
+		heap_state.reset(new ChannelSelectState);
+	ChannelSelectState& state = shared ? *heap_state : local_state;
+	std::vector<ChannelWaiter> waiters(count);
+	for(size_t i = 0; i < count; ++i)
+	{
+		Case& c = m_cases[i];
+		ChannelWaiter& waiter = waiters[i];
+		ChannelBase::InitWaiter(waiter);
+		waiter.slot = shared ? c.heapSlot(HEAP_SLOT_NEW, c.send, c.slot, nullptr, false) : c.slot;
+		waiter.select = &state;
+		waiter.index = i;
+		(c.send ? c.channel->m_senders : c.channel->m_receivers).push_back(&waiter);
+	}
+	unlockAll(channels);
+
+	Fiber::YieldToHold();
+
+	// 其余等待项还在各个通道的队列中，指向本协程栈上的对象，返回前必须移除
+	lockAll(channels);
+	for(size_t i = 0; i < count; ++i)
+	{
+		Case& c = m_cases[i];
+		(c.send ? c.channel->m_senders : c.channel->m_receivers).remove(&waiters[i]);
+	}
+	unlockAll(channels);
+
+	int index = state.fired;
+	ASSERT(index >= 0);
+	m_ok = waiters[index].ok;
+	if(shared)
+	{
+		for(size_t i = 0; i < count; ++i)
+		{
+			Case& c = m_cases[i];
+			c.heapSlot(HEAP_SLOT_FREE, c.send, c.slot, waiters[i].slot, (int)i == index && m_ok);
+		}
+	}
+	return index;
+}
+
+} // namespace shiosylar end
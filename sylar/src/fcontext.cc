@@ -0,0 +1,184 @@
+#include "../include/fcontext.h"
+#include "../include/macro.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#ifndef SHIOSYLAR_FIBER_UCONTEXT
+
+// 保存当前的被调用者保存寄存器到当前栈上，栈顶写入*from_sp，再切到to_sp上恢复并返回
+extern "C" void shiosylar_swap_context(void** from_sp, void* to_sp);
+
+#if defined(__x86_64__)
+
+/*
+栈上的布局，从栈顶向高地址：
+    mxcsr(4字节) x87控制字(2字节) 填充(2字节)
+    r15 r14 r13 r12 rbx rbp 返回地址
+*/
+asm(R"(
+    .text
+    .globl shiosylar_swap_context
+    .hidden shiosylar_swap_context
+    .type shiosylar_swap_context, @function
+    .align 16
+shiosylar_swap_context:
+    pushq %rbp
+    pushq %rbx
+    pushq %r12
+    pushq %r13
+    pushq %r14
+    pushq %r15
+    subq $8, %rsp
+    stmxcsr (%rsp)
+    fnstcw 4(%rsp)
+    movq %rsp, (%rdi)
+    movq %rsi, %rsp
+    ldmxcsr (%rsp)
+    fldcw 4(%rsp)
+    addq $8, %rsp
+    popq %r15
+    popq %r14
+    popq %r13
+    popq %r12
+    popq %rbx
+    popq %rbp
+    ret
+    .size shiosylar_swap_context, .-shiosylar_swap_context
+)");
+
+// 切出时压栈的字节数，不含返回地址
+static const size_t SAVED_SIZE = 8 + 6 * 8;
+
+#elif defined(__aarch64__)
+
+/*
+栈上的布局，从栈顶向高地址：
+    d8-d15 x19-x28 x29(fp) x30(lr，即返回地址)
+*/
+asm(R"(
+    .text
+    .globl shiosylar_swap_context
+    .hidden shiosylar_swap_context
+    .type shiosylar_swap_context, %function
+    .align 4
+shiosylar_swap_context:
+    sub sp, sp, #0xa0
+    stp d8, d9, [sp, #0x00]
+    stp d10, d11, [sp, #0x10]
+    stp d12, d13, [sp, #0x20]
+    stp d14, d15, [sp, #0x30]
+    stp x19, x20, [sp, #0x40]
+    stp x21, x22, [sp, #0x50]
+    stp x23, x24, [sp, #0x60]
+    stp x25, x26, [sp, #0x70]
+    stp x27, x28, [sp, #0x80]
+    stp x29, x30, [sp, #0x90]
+    mov x2, sp
+    str x2, [x0]
+    mov sp, x1
+    ldp d8, d9, [sp, #0x00]
+    ldp d10, d11, [sp, #0x10]
+    ldp d12, d13, [sp, #0x20]
+    ldp d14, d15, [sp, #0x30]
+    ldp x19, x20, [sp, #0x40]
+    ldp x21, x22, [sp, #0x50]
+    ldp x23, x24, [sp, #0x60]
+    ldp x25, x26, [sp, #0x70]
+    ldp x27, x28, [sp, #0x80]
+    ldp x29, x30, [sp, #0x90]
+    add sp, sp, #0xa0
+    ret
+    .size shiosylar_swap_context, .-shiosylar_swap_context
+)");
+
+// 切出时压栈的字节数，含x29和x30
+static const size_t SAVED_SIZE = 0xa0;
+
+#endif
+
+#endif // SHIOSYLAR_FIBER_UCONTEXT
+
+namespace shiosylar
+{
+
+#ifdef SHIOSYLAR_FIBER_UCONTEXT
+
+const char* FiberContextName()
+{
+    return "ucontext";
+}
+
+void MakeFiberContext(FiberContext& ctx, void* stack, size_t size, void (*fn)())
+{
+    if(getcontext(&ctx.ctx))
+        ASSERT2(false, "getcontext");
+    ctx.ctx.uc_link = nullptr;
+    ctx.ctx.uc_stack.ss_sp = stack;
+    ctx.ctx.uc_stack.ss_size = size;
+    makecontext(&ctx.ctx, fn, 0);
+}
+
+void SwapFiberContext(FiberContext& from, FiberContext& to)
+{
+    if(swapcontext(&from.ctx, &to.ctx))
+        ASSERT2(false, "swapcontext");
+}
+
+// 寄存器保存在ucontext_t中，栈上只有切出时的调用帧
+void* FiberContextStackPointer(const FiberContext& ctx)
+{
+#if defined(__x86_64__)
+    return (void*)ctx.ctx.uc_mcontext.gregs[REG_RSP];
+#elif defined(__aarch64__)
+    return (void*)ctx.ctx.uc_mcontext.sp;
+#else
+    return nullptr;
+#endif
+}
+
+#else
+
+const char* FiberContextName()
+{
+    return "asm";
+}
+
+// 伪造一次切出时的栈，第一次切入时恢复出全零的寄存器，返回到fn
+void MakeFiberContext(FiberContext& ctx, void* stack, size_t size, void (*fn)())
+{
+    uintptr_t top = ((uintptr_t)stack + size) & ~(uintptr_t)15;
+#if defined(__x86_64__)
+    // 进入fn时栈顶是它的返回地址，按调用约定此时栈顶模16余8，返回地址为0，回溯到此为止
+    uintptr_t* ret = (uintptr_t*)(top - 16);
+    ret[1] = 0;
+    ret[0] = (uintptr_t)fn;
+    char* sp = (char*)ret - SAVED_SIZE;
+    memset(sp, 0, SAVED_SIZE);
+    uint32_t mxcsr = 0x1f80;    // 默认值，屏蔽所有浮点异常，就近舍入
+    uint16_t fpucw = 0x037f;    // 默认值，扩展精度，屏蔽所有浮点异常
+    memcpy(sp, &mxcsr, sizeof(mxcsr));
+    memcpy(sp + 4, &fpucw, sizeof(fpucw));
+#elif defined(__aarch64__)
+    // 恢复出的x30为fn，ret后以栈顶为sp进入fn，x29为0，回溯到此为止
+    char* sp = (char*)top - SAVED_SIZE;
+    memset(sp, 0, SAVED_SIZE);
+    ((uintptr_t*)(sp + 0x98))[0] = (uintptr_t)fn;
+#endif
+    ctx.sp = sp;
+}
+
+void SwapFiberContext(FiberContext& from, FiberContext& to)
+{
+    shiosylar_swap_context(&from.sp, to.sp);
+}
+
+// 寄存器压在栈上，上下文就是栈顶
+void* FiberContextStackPointer(const FiberContext& ctx)
+{
+    return ctx.sp;
+}
+
+#endif
+
+} // namespace shiosylar end
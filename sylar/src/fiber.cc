@@ -3,8 +3,17 @@
 #include "../include/macro.h"
 #include "../include/logger.h"
 #include "../include/scheduler.h"
+#include "../include/mutex.h"
 
+#include <algorithm>
 #include <atomic>
+#include <cxxabi.h>
+#include <set>
+#include <unordered_map>
+#include <vector>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 namespace shiosylar
 {
@@ -25,23 +34,600 @@ static thread_local Fiber::ptr t_threadFiber = nullptr;
 static ConfigVar<uint32_t>::ptr g_fiber_stack_size =
     Config::Lookup<uint32_t>("fiber.stack_size", 128 * 1024, "fiber stack size");
 
-// 内存接口封装类
-class MallocStackAllocator
+// 每个线程缓存的空闲栈数上限
+static ConfigVar<uint32_t>::ptr g_fiber_stack_cache =
+    Config::Lookup<uint32_t>("fiber.stack_cache", 64, "free fiber stacks cached per thread");
+// 全局池缓存的空闲栈数上限，线程缓存满了或线程退出时栈放到这里
+static ConfigVar<uint32_t>::ptr g_fiber_stack_pool =
+    Config::Lookup<uint32_t>("fiber.stack_pool", 1024, "free fiber stacks cached in global pool");
+
+// 只由一个线程写入的计数，用relaxed的读改写代替原子加，读取方可能看到稍旧的值
+static inline void RelaxedAdd(std::atomic<uint64_t>& counter, int64_t n)
+{
+    counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+/*
+池化的协程栈分配器
+1. 栈用mmap分配，最低地址处多映射一页PROT_NONE的保护页，栈溢出时立即段错误，而不是悄悄改写相邻的内存
+2. mmap只分配地址空间，物理页在第一次访问时才提交，128K的栈实际只占用用到的那几页
+3. 释放的栈先放入本线程的空闲链表，满了放入全局池，全局池也满了才munmap，分配时按同样的顺序查找
+   空闲链表的next指针写在栈的最高处，这一页一定已经提交过，命中时创建和销毁协程只是一次链表的出入
+4. 多NUMA节点时新映射的栈绑定到当前线程所在的节点，工作线程固定了cpu，本线程缓存的栈也还在本地节点
+*/
+class PooledStackAllocator
 {
 public:
     static void* Alloc(size_t size)
     {
-        return malloc(size);
+        size = RoundUp(size);
+        ThreadCache* cache = GetCache();
+        if(cache)
+        {
+            RelaxedAdd(cache->allocs, 1);
+            ThreadCache::Bucket* bucket = cache->find(size);
+            if(bucket && bucket->head)
+            {
+                void* vp = bucket->head;
+                bucket->head = Next(vp, size);
+                --bucket->count;
+                RelaxedAdd(cache->hits, 1);
+                RelaxedAdd(cache->cached, -1);
+                return vp;
+            }
+        }
+        else
+            ++s_allocs;
+
+        void* vp = PoolPop(size);
+        if(vp)
+        {
+            ++s_poolHits;
+            return vp;
+        }
+        return Map(size);
     }
 
     static void Dealloc(void* vp, size_t size)
     {
-        return free(vp);
+        size = RoundUp(size);
+        ThreadCache* cache = GetCache();
+        if(cache)
+        {
+            ThreadCache::Bucket* bucket = cache->find(size);
+            if(!bucket)
+                bucket = cache->add(size);
+            if(bucket && bucket->count < cache->limit)
+            {
+                Next(vp, size) = bucket->head;
+                bucket->head = vp;
+                ++bucket->count;
+                RelaxedAdd(cache->cached, 1);
+                return;
+            }
+        }
+        if(!PoolPush(vp, size))
+            Unmap(vp, size);
+    }
+
+    static Fiber::StackStats GetStats()
+    {
+        Fiber::StackStats stats;
+        Spinlock::Lock lock(s_mutex);
+        stats.allocs = s_allocs;
+        stats.threadHits = s_threadHits;
+        for(ThreadCache* cache : s_caches)
+        {
+            stats.allocs += cache->allocs.load(std::memory_order_relaxed);
+            stats.threadHits += cache->hits.load(std::memory_order_relaxed);
+            stats.threadCached += cache->cached.load(std::memory_order_relaxed);
+        }
+        stats.poolHits = s_poolHits;
+        stats.poolCached = s_poolCount;
+        stats.mapped = s_mapped;
+        return stats;
+    }
+
+private:
+    // 线程的空闲栈缓存，按栈大小分桶，通常只有默认大小一种，自适应栈大小时每个大小档位一个桶
+    struct ThreadCache
+    {
+        struct Bucket
+        {
+            size_t size = 0;
+            void* head = nullptr;
+            size_t count = 0;
+        };
+
+        static const size_t BUCKETS = 8;
+
+        Bucket* find(size_t size)
+        {
+            for(size_t i = 0; i < used; ++i)
+                if(buckets[i].size == size)
+                    return &buckets[i];
+            return nullptr;
+        }
+
+        // 桶用完时返回nullptr，这种大小的栈不在线程缓存
+        Bucket* add(size_t size)
+        {
+            if(used == BUCKETS)
+                return nullptr;
+            buckets[used].size = size;
+            return &buckets[used++];
+        }
+
+        Bucket buckets[BUCKETS];
+        size_t used = 0;
+        size_t limit = 0;
+        std::atomic<uint64_t> allocs {0};   // 本线程的分配次数
+        std::atomic<uint64_t> hits {0};     // 其中命中本线程缓存的次数
+        std::atomic<uint64_t> cached {0};   // 本线程缓存中的栈数
+    };
+
+    // 线程退出时把缓存的栈归还全局池，之后本线程再释放的栈直接走全局池
+    struct ThreadCacheHolder
+    {
+        ~ThreadCacheHolder()
+        {
+            ThreadCache* cache = t_cache;
+            if(!cache)
+                return;
+            t_cache = nullptr;
+            {
+                Spinlock::Lock lock(s_mutex);
+                s_caches.erase(cache);
+                s_allocs += cache->allocs;
+                s_threadHits += cache->hits;
+            }
+            for(size_t i = 0; i < cache->used; ++i)
+            {
+                ThreadCache::Bucket& bucket = cache->buckets[i];
+                while(bucket.head)
+                {
+                    void* vp = bucket.head;
+                    bucket.head = Next(vp, bucket.size);
+                    if(!PoolPush(vp, bucket.size))
+                        Unmap(vp, bucket.size);
+                }
+            }
+            delete cache;
+        }
+    };
+
+    // 第一次调用时创建本线程的缓存，线程退出后返回nullptr
+    static ThreadCache* GetCache()
+    {
+        if(t_cache)
+            return t_cache;
+        if(t_cacheDone)
+            return nullptr;
+        t_cacheDone = true;
+        static thread_local ThreadCacheHolder t_holder;
+        t_cache = new ThreadCache;
+        t_cache->limit = g_fiber_stack_cache->getValue();
+        Spinlock::Lock lock(s_mutex);
+        s_caches.insert(t_cache);
+        return t_cache;
+    }
+
+    // 空闲栈的next指针，放在栈的最高处
+    static void*& Next(void* vp, size_t size)
+    {
+        return *(void**)((char*)vp + size - sizeof(void*));
+    }
+
+    static void* PoolPop(size_t size)
+    {
+        Spinlock::Lock lock(s_mutex);
+        auto it = s_pool.find(size);
+        if(it == s_pool.end() || it->second.empty())
+            return nullptr;
+        void* vp = it->second.back();
+        it->second.pop_back();
+        --s_poolCount;
+        return vp;
+    }
+
+    static bool PoolPush(void* vp, size_t size)
+    {
+        uint32_t limit = g_fiber_stack_pool->getValue();
+        Spinlock::Lock lock(s_mutex);
+        if(s_poolCount >= limit)
+            return false;
+        s_pool[size].push_back(vp);
+        ++s_poolCount;
+        return true;
+    }
+
+    static void* Map(size_t size)
+    {
+        size_t page = PageSize();
+        char* base = (char*)mmap(nullptr, size + page, PROT_READ | PROT_WRITE,
+                                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        ASSERT2(base != MAP_FAILED, "mmap fiber stack size=" << size);
+        if(mprotect(base, page, PROT_NONE))
+            ASSERT2(false, "mprotect fiber stack guard page");
+        if(IsNuma())
+            BindMemoryToNode(base + page, size, GetCurrentNumaNode());
+        ++s_mapped;
+        return base + page;
+    }
+
+    static void Unmap(void* vp, size_t size)
+    {
+        size_t page = PageSize();
+        munmap((char*)vp - page, size + page);
+        --s_mapped;
+    }
+
+    static size_t PageSize()
+    {
+        static const size_t s_page = sysconf(_SC_PAGESIZE);
+        return s_page;
+    }
+
+    static size_t RoundUp(size_t size)
+    {
+        size_t page = PageSize();
+        return (size + page - 1) & ~(page - 1);
+    }
+
+    static bool IsNuma()
+    {
+        static const bool s_numa = GetNumaNodeCount() > 1;
+        return s_numa;
+    }
+
+private:
+    static thread_local ThreadCache* t_cache;
+    static thread_local bool t_cacheDone;
+
+    static Spinlock s_mutex;                                    // 保护全局池和线程缓存的登记
+    static std::set<ThreadCache*> s_caches;                     // 存活线程的缓存，用于汇总统计
+    static std::unordered_map<size_t, std::vector<void*> > s_pool;  // 全局池，按栈大小分组
+    static uint64_t s_poolCount;                                // 全局池中的栈数
+    static uint64_t s_threadHits;                               // 已退出线程的缓存命中数
+    static std::atomic<uint64_t> s_allocs;                      // 已退出线程和线程退出后的分配次数
+    static std::atomic<uint64_t> s_poolHits;                    // 命中全局池的次数
+    static std::atomic<uint64_t> s_mapped;                      // 当前映射的栈数，含使用中和缓存中的
+};
+
+thread_local PooledStackAllocator::ThreadCache* PooledStackAllocator::t_cache = nullptr;
+thread_local bool PooledStackAllocator::t_cacheDone = false;
+Spinlock PooledStackAllocator::s_mutex;
+std::set<PooledStackAllocator::ThreadCache*> PooledStackAllocator::s_caches;
+std::unordered_map<size_t, std::vector<void*> > PooledStackAllocator::s_pool;
+uint64_t PooledStackAllocator::s_poolCount = 0;
+uint64_t PooledStackAllocator::s_threadHits = 0;
+std::atomic<uint64_t> PooledStackAllocator::s_allocs {0};
+std::atomic<uint64_t> PooledStackAllocator::s_poolHits {0};
+std::atomic<uint64_t> PooledStackAllocator::s_mapped {0};
+
+using StackAllocator = PooledStackAllocator;
+
+// 每个线程的共享栈数，协程轮流绑定，数量越多换出越少
+static ConfigVar<uint32_t>::ptr g_shared_stack_count =
+    Config::Lookup<uint32_t>("fiber.shared_stack_count", 4, "shared fiber stacks per thread");
+// 共享栈的大小，所有绑定的协程共用，最深的调用不能超过它
+static ConfigVar<uint32_t>::ptr g_shared_stack_size =
+    Config::Lookup<uint32_t>("fiber.shared_stack_size", 256 * 1024, "shared fiber stack size");
+
+// 共享栈的统计
+static std::atomic<uint64_t> s_shared_fibers {0};
+static std::atomic<uint64_t> s_shared_stacks {0};
+static std::atomic<uint64_t> s_saved_bytes {0};
+static std::atomic<uint64_t> s_shared_saves {0};
+static std::atomic<uint64_t> s_shared_restores {0};
+static std::atomic<uint64_t> s_copied_bytes {0};
+
+struct SharedStackSet;
+
+// 共享栈，同一时刻只有占用者的内容在栈上，只由所属线程访问
+struct SharedStack
+{
+    char* base = nullptr;               // 栈的最低地址
+    size_t size = 0;                    // 栈大小
+    Fiber* occupant = nullptr;          // 内容在栈上的协程
+    SharedStackSet* set = nullptr;      // 所属的线程共享栈组
+};
+
+// 线程的一组共享栈，引用计数为绑定的协程数加上线程本身，线程退出后由最后一个协程释放
+struct SharedStackSet
+{
+    std::vector<SharedStack> stacks;
+    size_t next = 0;                    // 下一个协程绑定的共享栈
+    std::atomic<uint64_t> refs {1};
+
+    SharedStackSet()
+    {
+        size_t count = std::max<uint32_t>(1, g_shared_stack_count->getValue());
+        size_t size = g_shared_stack_size->getValue();
+        stacks.resize(count);
+        for(auto& stack : stacks)
+        {
+            stack.base = (char*)StackAllocator::Alloc(size);
+            stack.size = size;
+            stack.set = this;
+        }
+        s_shared_stacks += count;
+    }
+
+    ~SharedStackSet()
+    {
+        for(auto& stack : stacks)
+            StackAllocator::Dealloc(stack.base, stack.size);
+        s_shared_stacks -= stacks.size();
+    }
+
+    void release()
+    {
+        if(--refs == 0)
+            delete this;
+    }
+};
+
+// 线程私有变量--本线程的共享栈组，第一次绑定时创建
+static thread_local SharedStackSet* t_sharedStacks = nullptr;
+
+// 线程退出时放弃对共享栈组的引用
+struct SharedStackSetHolder
+{
+    ~SharedStackSetHolder()
+    {
+        if(t_sharedStacks)
+            t_sharedStacks->release();
+        t_sharedStacks = nullptr;
+    }
+};
+
+static SharedStackSet* GetSharedStacks()
+{
+    if(!t_sharedStacks)
+    {
+        static thread_local SharedStackSetHolder t_holder;
+        t_sharedStacks = new SharedStackSet;
+    }
+    return t_sharedStacks;
+}
+
+// 每个线程缓存的空闲协程对象数上限
+static ConfigVar<uint32_t>::ptr g_fiber_object_cache =
+    Config::Lookup<uint32_t>("fiber.object_cache", 256, "free fiber objects cached per thread");
+
+/*
+协程对象池
+1. 析构后的协程对象内存放入释放线程的空闲链表，创建时先从本线程的链表取，超过上限的还给malloc
+2. 链表的next指针写在空闲对象的内存里，出入链表没有锁和原子操作
+3. 统计计数只由本线程写入，读取时汇总存活线程的计数，线程退出时合并到全局计数
+*/
+class FiberObjectPool
+{
+public:
+    static void* Alloc(size_t size)
+    {
+        ThreadCache* cache = GetCache();
+        if(!cache || size != sizeof(Fiber))
+        {
+            ++s_allocs;
+            return ::operator new(size);
+        }
+        RelaxedAdd(cache->allocs, 1);
+        if(cache->head)
+        {
+            void* p = cache->head;
+            cache->head = *(void**)p;
+            --cache->count;
+            RelaxedAdd(cache->hits, 1);
+            RelaxedAdd(cache->cached, -1);
+            return p;
+        }
+        return ::operator new(size);
+    }
+
+    static void Dealloc(void* p)
+    {
+        ThreadCache* cache = GetCache();
+        if(!cache || cache->count >= cache->limit)
+            return ::operator delete(p);
+        *(void**)p = cache->head;
+        cache->head = p;
+        ++cache->count;
+        RelaxedAdd(cache->cached, 1);
+    }
+
+    static void GetStats(Fiber::StackStats& stats)
+    {
+        Spinlock::Lock lock(s_mutex);
+        stats.objectAllocs = s_allocs;
+        stats.objectHits = s_hits;
+        for(ThreadCache* cache : s_caches)
+        {
+            stats.objectAllocs += cache->allocs.load(std::memory_order_relaxed);
+            stats.objectHits += cache->hits.load(std::memory_order_relaxed);
+            stats.objectCached += cache->cached.load(std::memory_order_relaxed);
+        }
+    }
+
+private:
+    struct ThreadCache
+    {
+        void* head = nullptr;               // 空闲链表
+        size_t count = 0;                   // 链表长度
+        size_t limit = 0;                   // 链表长度上限
+        std::atomic<uint64_t> allocs {0};   // 本线程的分配次数
+        std::atomic<uint64_t> hits {0};     // 其中命中空闲链表的次数
+        std::atomic<uint64_t> cached {0};   // 链表长度，供统计读取
+    };
+
+    // 线程退出时释放空闲链表，之后本线程创建和销毁的协程对象直接走malloc
+    struct ThreadCacheHolder
+    {
+        ~ThreadCacheHolder()
+        {
+            ThreadCache* cache = t_cache;
+            if(!cache)
+                return;
+            t_cache = nullptr;
+            {
+                Spinlock::Lock lock(s_mutex);
+                s_caches.erase(cache);
+                s_allocs += cache->allocs;
+                s_hits += cache->hits;
+            }
+            while(cache->head)
+            {
+                void* p = cache->head;
+                cache->head = *(void**)p;
+                ::operator delete(p);
+            }
+            delete cache;
+        }
+    };
+
+    // 第一次调用时创建本线程的缓存，线程退出后返回nullptr
+    static ThreadCache* GetCache()
+    {
+        if(t_cache)
+            return t_cache;
+        if(t_cacheDone)
+            return nullptr;
+        t_cacheDone = true;
+        static thread_local ThreadCacheHolder t_holder;
+        t_cache = new ThreadCache;
+        t_cache->limit = g_fiber_object_cache->getValue();
+        Spinlock::Lock lock(s_mutex);
+        s_caches.insert(t_cache);
+        return t_cache;
     }
 
+private:
+    static thread_local ThreadCache* t_cache;
+    static thread_local bool t_cacheDone;
+
+    static Spinlock s_mutex;                    // 保护线程缓存的登记
+    static std::set<ThreadCache*> s_caches;     // 存活线程的缓存，用于汇总统计
+    static std::atomic<uint64_t> s_allocs;      // 已退出线程和不经过缓存的分配次数
+    static uint64_t s_hits;                     // 已退出线程的命中次数
 };
 
-using StackAllocator = MallocStackAllocator;
+thread_local FiberObjectPool::ThreadCache* FiberObjectPool::t_cache = nullptr;
+thread_local bool FiberObjectPool::t_cacheDone = false;
+Spinlock FiberObjectPool::s_mutex;
+std::set<FiberObjectPool::ThreadCache*> FiberObjectPool::s_caches;
+std::atomic<uint64_t> FiberObjectPool::s_allocs {0};
+uint64_t FiberObjectPool::s_hits = 0;
+
+// 每个线程每N次新建或重置私有栈协程抽一次涂色采样栈深，0为不采样
+static ConfigVar<uint32_t>::ptr g_stack_paint_sample =
+    Config::Lookup<uint32_t>("fiber.stack_paint_sample", 0, "paint one in N fiber stacks to sample high-water marks, 0 disables");
+// 是否按运行函数类型采样到的栈深选择未指定大小的协程栈
+static ConfigVar<bool>::ptr g_stack_adaptive =
+    Config::Lookup<bool>("fiber.stack_adaptive", false, "size fiber stacks by sampled high-water marks of their entry function");
+// 自适应栈大小在采样到的最大栈深上加的余量，百分比
+static ConfigVar<uint32_t>::ptr g_stack_margin =
+    Config::Lookup<uint32_t>("fiber.stack_margin", 100, "percent added to sampled high-water marks when sizing fiber stacks");
+// 自适应栈大小的下限
+static ConfigVar<uint32_t>::ptr g_stack_min_size =
+    Config::Lookup<uint32_t>("fiber.stack_min_size", 16 * 1024, "smallest adaptive fiber stack size");
+// 一类运行函数的采样数达到后才按采样选择栈大小
+static ConfigVar<uint32_t>::ptr g_stack_adapt_samples =
+    Config::Lookup<uint32_t>("fiber.stack_adapt_samples", 16, "samples of an entry function before its stack size adapts");
+
+// 创建协程的路径上读取的配置，缓存为静态变量
+static uint32_t s_stack_paint_sample = 0;
+static bool s_stack_adaptive = false;
+
+struct _StackProfileIniter
+{
+    _StackProfileIniter()
+    {
+        s_stack_paint_sample = g_stack_paint_sample->getValue();
+        s_stack_adaptive = g_stack_adaptive->getValue();
+
+        g_stack_paint_sample->addListener([](const uint32_t& old_value, const uint32_t& new_value){
+                LOG_INFO(g_logger) << "fiber stack paint sample changed from "
+                                         << old_value << " to " << new_value;
+                s_stack_paint_sample = new_value;
+        });
+        g_stack_adaptive->addListener([](const bool& old_value, const bool& new_value){
+                LOG_INFO(g_logger) << "fiber stack adaptive changed from "
+                                         << old_value << " to " << new_value;
+                s_stack_adaptive = new_value;
+        });
+    }
+};
+
+static _StackProfileIniter s_stack_profile_initer;
+
+// 涂在采样栈上的图案
+static const uint64_t STACK_PAINT = 0xa5a5a5a5a5a5a5a5ull;
+
+// 一类运行函数的栈深统计，键为Task的类型标识
+static Spinlock s_profile_mutex;
+static std::unordered_map<const void*, Fiber::StackProfile> s_profiles;
+// 任何一类的自适应栈大小变化时加一，线程缓存据此失效
+static std::atomic<uint64_t> s_profile_version {0};
+
+// 线程缓存的各类运行函数的自适应栈大小，0为使用默认大小
+struct StackSizeCache
+{
+    uint64_t version = 0;
+    std::unordered_map<const void*, uint32_t> sizes;
+};
+
+static thread_local StackSizeCache t_stack_sizes;
+// 本线程的采样计数
+static thread_local uint32_t t_paint_tick = 0;
+
+// 按最大栈深加上余量，从下限起翻倍到够用，不超过默认大小
+static uint32_t StackSizeClass(uint32_t high_water, uint32_t default_size)
+{
+    uint64_t want = (uint64_t)high_water * (100 + g_stack_margin->getValue()) / 100;
+    uint64_t size = std::max<uint32_t>(g_stack_min_size->getValue(), 4096);
+    while(size < want && size < default_size)
+        size *= 2;
+    return std::min<uint64_t>(size, default_size);
+}
+
+// 记入一次采样，采样数够了之后重新选择该类的栈大小
+static void RecordHighWater(const void* key, const char* name, uint32_t high_water)
+{
+    Spinlock::Lock lock(s_profile_mutex);
+    Fiber::StackProfile& profile = s_profiles[key];
+    if(profile.samples++ == 0 && name)
+    {
+        char* demangled = abi::__cxa_demangle(name, nullptr, nullptr, nullptr);
+        profile.name = demangled ? demangled : name;
+        free(demangled);
+    }
+    profile.maxHighWater = std::max(profile.maxHighWater, high_water);
+    if(profile.samples < g_stack_adapt_samples->getValue())
+        return;
+    uint32_t size = StackSizeClass(profile.maxHighWater, g_fiber_stack_size->getValue());
+    if(size != profile.stackSize)
+    {
+        profile.stackSize = size;
+        ++s_profile_version;
+    }
+}
+
+const size_t Fiber::LOCAL_SLOTS;
+
+// 已经登记的协程局部变量槽数和各槽的析构函数
+static std::atomic<size_t> s_local_slots {0};
+static void (*s_local_destroy[Fiber::LOCAL_SLOTS])(void*);
+
+void* Fiber::operator new(size_t size)
+{
+    return FiberObjectPool::Alloc(size);
+}
+
+void Fiber::operator delete(void* p)
+{
+    FiberObjectPool::Dealloc(p);
+}
 
 // 获取当前正在运行的协程ID
 uint64_t Fiber::GetFiberId()
@@ -55,33 +641,34 @@ uint64_t Fiber::GetFiberId()
 Fiber::Fiber()
 {
     m_state = EXEC;
-    SetThis(this);
-    if(getcontext(&m_ctx))
-        ASSERT2(false, "getcontext");
+    SetThis(this); // 主协程的上下文在第一次切出时保存
     ++s_fiber_count;
     LOG_DEBUG(g_logger) << "Fiber::Fiber main";
 }
 
 // 共有有参构造，创建普通协程，并运行函数
-Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
+Fiber::Fiber(Task cb, size_t stacksize, bool use_caller, bool shared_stack)
                 :
                 m_id(++s_fiber_id),
-                m_cb(cb)
+                m_cb(std::move(cb)),
+                m_shared(shared_stack)
 {
     ++s_fiber_count;
-    m_stacksize = stacksize ? stacksize : g_fiber_stack_size->getValue();
+    if(m_shared) // 共享栈在第一次切入时绑定
+    {
+        m_entry = use_caller ? &Fiber::CallerMainFunc : &Fiber::MainFunc;
+        LOG_DEBUG(g_logger) << "Fiber::Fiber id=" << m_id << " shared stack";
+        return;
+    }
 
-    m_stack = StackAllocator::Alloc(m_stacksize);
-    if(getcontext(&m_ctx))
-        ASSERT2(false, "getcontext");
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
+    m_fixedStack = stacksize != 0;
+    m_stacksize = m_fixedStack ? stacksize : chooseStackSize();
 
+    m_stack = StackAllocator::Alloc(m_stacksize);
     if(!use_caller) // 是否使用use_caller，默认不用
-        makecontext(&m_ctx, &Fiber::MainFunc, 0);
+        prepareStack(&Fiber::MainFunc);
     else
-        makecontext(&m_ctx, &Fiber::CallerMainFunc, 0);
+        prepareStack(&Fiber::CallerMainFunc);
 
     LOG_DEBUG(g_logger) << "Fiber::Fiber id=" << m_id;
 }
@@ -90,7 +677,27 @@ Fiber::Fiber(std::function<void()> cb, size_t stacksize, bool use_caller)
 Fiber::~Fiber()
 {
     --s_fiber_count;
-    if(m_stack)
+    if(m_localMask)
+        clearLocals();
+    if(m_shared)
+    {
+        ASSERT(m_state == TERM
+                        || m_state == EXCEPT
+                        || m_state == INIT);
+
+        if(m_sharedStack)
+        {
+            ASSERT(m_sharedStack->occupant != this);
+            m_sharedStack->set->release();
+            --s_shared_fibers;
+        }
+        if(m_saved)
+        {
+            s_saved_bytes -= m_savedCap;
+            free(m_saved);
+        }
+    }
+    else if(m_stack)
     {
         ASSERT(m_state == TERM
                         || m_state == EXCEPT
@@ -112,40 +719,182 @@ Fiber::~Fiber()
 }
 
 //重置协程，并重置状态
-void Fiber::reset(std::function<void()> cb)
+void Fiber::reset(Task cb)
 {
-    ASSERT(m_stack);
+    ASSERT(m_stack || m_shared);
     // 只有在初始态、结束态、异常态的时候才能重置
     ASSERT(m_state == TERM
                     || m_state == EXCEPT
                     || m_state == INIT);
-    m_cb = cb;
-    if(getcontext(&m_ctx))
-        ASSERT2(false, "getcontext");
+    if(m_localMask) // 上一个任务的协程局部变量到这里才析构
+        clearLocals();
+    m_cb = std::move(cb);
+    if(m_shared) // 已经绑定的共享栈不变，切入时再创建上下文
+    {
+        releaseSharedStack();
+        m_entry = &Fiber::MainFunc;
+        m_savedSize = 0;
+    }
+    else if(m_cb) // cb为空时只释放上一个任务，保留原来的栈，装入新的运行函数时再按它的类型选栈大小
+    {
+        if(s_stack_adaptive && !m_fixedStack) // 这类运行函数的栈大小不同时换一个栈
+        {
+            uint32_t size = chooseStackSize();
+            if(size != m_stacksize)
+            {
+                StackAllocator::Dealloc(m_stack, m_stacksize);
+                m_stacksize = size;
+                m_stack = StackAllocator::Alloc(m_stacksize);
+            }
+        }
+        prepareStack(&Fiber::MainFunc);
+    }
+    m_state = INIT; // 设置为初始化状态
+}
 
-    m_ctx.uc_link = nullptr;
-    m_ctx.uc_stack.ss_sp = m_stack;
-    m_ctx.uc_stack.ss_size = m_stacksize;
+// 按运行函数类型的栈深统计选择私有栈的大小，先查线程缓存，不命中再查全局统计
+uint32_t Fiber::chooseStackSize() const
+{
+    uint32_t default_size = g_fiber_stack_size->getValue();
+    if(!s_stack_adaptive || !m_cb)
+        return default_size;
 
-    makecontext(&m_ctx, &Fiber::MainFunc, 0);
-    m_state = INIT; // 设置为初始化状态
+    const void* key = m_cb.typeKey();
+    StackSizeCache& cache = t_stack_sizes;
+    uint64_t version = s_profile_version.load(std::memory_order_acquire);
+    if(cache.version != version)
+    {
+        cache.sizes.clear();
+        cache.version = version;
+    }
+    auto it = cache.sizes.find(key);
+    if(it == cache.sizes.end())
+    {
+        uint32_t size = 0;
+        {
+            Spinlock::Lock lock(s_profile_mutex);
+            auto pit = s_profiles.find(key);
+            if(pit != s_profiles.end())
+                size = pit->second.stackSize;
+        }
+        it = cache.sizes.emplace(key, size).first;
+    }
+    return it->second ? std::min(it->second, default_size) : default_size;
+}
+
+// 在私有栈上创建上下文，抽中采样时先把整个栈涂上图案
+void Fiber::prepareStack(void (*fn)())
+{
+    uint32_t sample = s_stack_paint_sample;
+    m_painted = sample && m_cb && ++t_paint_tick % sample == 0;
+    if(m_painted)
+    {
+        m_stackKey = m_cb.typeKey();
+        m_stackName = m_cb.typeName();
+        uint64_t* word = (uint64_t*)m_stack;
+        uint64_t* end = word + m_stacksize / sizeof(uint64_t);
+        std::fill(word, end, STACK_PAINT);
+    }
+    MakeFiberContext(m_ctx, m_stack, m_stacksize, fn);
+}
+
+// 从栈的最低地址向上找第一个被改写的字，以上就是这次运行用到的栈
+void Fiber::sampleStack()
+{
+    if(!m_painted)
+        return;
+    m_painted = false;
+    const uint64_t* word = (const uint64_t*)m_stack;
+    const uint64_t* end = word + m_stacksize / sizeof(uint64_t);
+    while(word < end && *word == STACK_PAINT)
+        ++word;
+    m_highWater = (const char*)end - (const char*)word;
+    RecordHighWater(m_stackKey, m_stackName, m_highWater);
+}
+
+// 切入共享栈协程前换出共享栈的占用者，换入自己
+void Fiber::loadSharedStack()
+{
+    if(!m_sharedStack) // 第一次切入，轮流绑定本线程的一个共享栈
+    {
+        SharedStackSet* set = GetSharedStacks();
+        m_sharedStack = &set->stacks[set->next++ % set->stacks.size()];
+        m_stackThread = GetThreadId();
+        ++set->refs;
+        ++s_shared_fibers;
+    }
+    else
+        ASSERT2(m_stackThread == GetThreadId(), "shared stack fiber id=" << m_id
+                << " bound to thread=" << m_stackThread << " swapped in on thread=" << GetThreadId());
+
+    SharedStack* stack = m_sharedStack;
+    if(stack->occupant == this)
+        return;
+    if(stack->occupant)
+        stack->occupant->saveSharedStack();
+    stack->occupant = this;
+
+    if(m_entry)
+    {
+        MakeFiberContext(m_ctx, stack->base, stack->size, m_entry);
+        m_entry = nullptr;
+        return;
+    }
+    memcpy(stack->base + stack->size - m_savedSize, m_saved, m_savedSize);
+    ++s_shared_restores;
+    s_copied_bytes += m_savedSize;
+}
+
+// 把栈顶到栈底的内容拷贝到堆缓冲区，缓冲区不够或大出一倍以上时重新分配
+void Fiber::saveSharedStack()
+{
+    SharedStack* stack = m_sharedStack;
+    char* top = stack->base + stack->size;
+    char* sp = (char*)FiberContextStackPointer(m_ctx);
+    if(!sp)
+        sp = stack->base;
+    ASSERT(sp >= stack->base && sp <= top);
+    uint32_t used = top - sp;
+    if(used > m_savedCap || m_savedCap > used * 2 + 1024)
+    {
+        uint32_t cap = (used + 63) & ~63u;
+        char* saved = (char*)malloc(cap);
+        ASSERT2(saved, "malloc shared stack save size=" << cap);
+        free(m_saved);
+        s_saved_bytes += cap;
+        s_saved_bytes -= m_savedCap;
+        m_saved = saved;
+        m_savedCap = cap;
+    }
+    memcpy(m_saved, sp, used);
+    m_savedSize = used;
+    ++s_shared_saves;
+    s_copied_bytes += used;
+}
+
+// 协程结束时放弃共享栈，栈上的内容不再需要保存
+void Fiber::releaseSharedStack()
+{
+    if(m_sharedStack && m_sharedStack->occupant == this)
+        m_sharedStack->occupant = nullptr;
 }
 
 // 切到当前协程
 void Fiber::call()
 {
+    ASSERT2(m_state != INIT || m_cb, "fiber reset with an empty callback cannot run");
     SetThis(this);
     m_state = EXEC;
-    if(swapcontext(&t_threadFiber->m_ctx, &m_ctx))
-        ASSERT2(false, "swapcontext");
+    if(m_shared)
+        loadSharedStack();
+    SwapFiberContext(t_threadFiber->m_ctx, m_ctx);
 }
 
 // 切回到主协程
 void Fiber::back()
 {
     SetThis(t_threadFiber.get());
-    if(swapcontext(&m_ctx, &t_threadFiber->m_ctx))
-        ASSERT2(false, "swapcontext");
+    SwapFiberContext(m_ctx, t_threadFiber->m_ctx);
 }
 
 //切换到当前协程执行，从调度器协程切出
@@ -153,17 +902,18 @@ void Fiber::swapIn()
 {
     SetThis(this); // 设置当前协程为正在运行的协程
     ASSERT(m_state != EXEC);
+    ASSERT2(m_state != INIT || m_cb, "fiber reset with an empty callback cannot run");
     m_state = EXEC;
-    if(swapcontext(&Scheduler::GetMainFiber()->m_ctx, &m_ctx))
-        ASSERT2(false, "swapcontext");
+    if(m_shared)
+        loadSharedStack();
+    SwapFiberContext(Scheduler::GetMainFiber()->m_ctx, m_ctx);
 }
 
 //切换到后台执行，切回到调度器协程
 void Fiber::swapOut()
 {
     SetThis(Scheduler::GetMainFiber()); // 设置主协程为正在运行的协程
-    if(swapcontext(&m_ctx, &Scheduler::GetMainFiber()->m_ctx))
-        ASSERT2(false, "swapcontext");
+    SwapFiberContext(m_ctx, Scheduler::GetMainFiber()->m_ctx);
 }
 
 //设置当前协程为正在运行的协程
@@ -176,18 +926,24 @@ void Fiber::SetThis(Fiber* f)
 Fiber::ptr Fiber::GetThis()
 {
     if(t_fiber)
-        return t_fiber->shared_from_this();
+        return Fiber::ptr(t_fiber);
     Fiber::ptr main_fiber(new Fiber); // 如果当前没有协程，则创建一个主协程并返回
     ASSERT(t_fiber == main_fiber.get());
     t_threadFiber = main_fiber;
-    return t_fiber->shared_from_this();
+    return main_fiber;
+}
+
+// 获取当前正在运行的协程的裸指针
+Fiber* Fiber::GetCurrent()
+{
+    return t_fiber;
 }
 
 //协程切换到调度协程，并且设置为Ready状态
 void Fiber::YieldToReady()
 {
-    Fiber::ptr cur = GetThis();
-    ASSERT(cur->m_state == EXEC);
+    Fiber* cur = t_fiber; // 切入的调度器持有引用，切回后重新入队，挂起期间不会析构
+    ASSERT(cur && cur->m_state == EXEC);
     cur->m_state = READY;
     cur->swapOut();
 }
@@ -195,8 +951,9 @@ void Fiber::YieldToReady()
 //协程切换到调度协程，并且设置为Hold状态
 void Fiber::YieldToHold()
 {
-    Fiber::ptr cur = GetThis();
-    ASSERT(cur->m_state == EXEC);
+    // 挂起期间自己持有一个引用，等待项被丢弃(如delEvent)而没有唤醒时协程泄漏，而不是在挂起状态下析构
+    Fiber::ptr cur(t_fiber);
+    ASSERT(cur && cur->m_state == EXEC);
     //cur->m_state = HOLD;
     cur->swapOut();
 }
@@ -207,10 +964,80 @@ uint64_t Fiber::TotalFibers()
     return s_fiber_count;
 }
 
+// 获取协程栈分配的统计
+Fiber::StackStats Fiber::GetStackStats()
+{
+    StackStats stats = StackAllocator::GetStats();
+    stats.sharedFibers = s_shared_fibers;
+    stats.sharedStacks = s_shared_stacks;
+    stats.savedBytes = s_saved_bytes;
+    stats.saves = s_shared_saves;
+    stats.restores = s_shared_restores;
+    stats.copiedBytes = s_copied_bytes;
+    FiberObjectPool::GetStats(stats);
+    return stats;
+}
+
+// 登记一个协程局部变量槽，槽号不回收
+size_t Fiber::RegisterLocal(void (*destroy)(void*))
+{
+    size_t slot = s_local_slots++;
+    ASSERT2(slot < LOCAL_SLOTS, "fiber local slots exhausted max=" << LOCAL_SLOTS
+            << ", define SHIOSYLAR_FIBER_LOCAL_SLOTS to raise it");
+    s_local_destroy[slot] = destroy;
+    return slot;
+}
+
+// 析构已经赋值的协程局部变量，先清掩码再析构
+void Fiber::clearLocals()
+{
+    uint64_t mask = m_localMask;
+    m_localMask = 0;
+    while(mask)
+    {
+        size_t slot = __builtin_ctzll(mask);
+        mask &= mask - 1;
+        if(s_local_destroy[slot])
+            s_local_destroy[slot](m_locals[slot]);
+    }
+}
+
+// 获取各类运行函数的栈深统计
+std::vector<Fiber::StackProfile> Fiber::GetStackProfiles()
+{
+    std::vector<StackProfile> profiles;
+    Spinlock::Lock lock(s_profile_mutex);
+    profiles.reserve(s_profiles.size());
+    for(auto& i : s_profiles)
+        profiles.push_back(i.second);
+    return profiles;
+}
+
+// 当前协程是否在共享栈上运行
+bool Fiber::OnSharedStack()
+{
+    return t_fiber && t_fiber->m_shared;
+}
+
+// p是否在当前协程绑定的共享栈上
+bool Fiber::OnSharedStack(const void* p)
+{
+    if(!t_fiber || !t_fiber->m_sharedStack)
+        return false;
+    const SharedStack* stack = t_fiber->m_sharedStack;
+    return (const char*)p >= stack->base && (const char*)p < stack->base + stack->size;
+}
+
+// 绑定到当前线程共享栈的协程数
+uint64_t Fiber::SharedStackFibers()
+{
+    return t_sharedStacks ? t_sharedStacks->refs - 1 : 0;
+}
+
 // 协程运行的主函数，运行完切回调度协程
 void Fiber::MainFunc()
 {
-    Fiber::ptr cur = GetThis(); // 这里获得了一个协程的智能指针，计数加一
+    Fiber* cur = t_fiber; // 切入者持有引用，运行期间不会析构，这里用裸指针不改变计数
     ASSERT(cur);
     try
     {
@@ -235,21 +1062,20 @@ void Fiber::MainFunc()
             << shiosylar::BacktraceToString();
     }
 
-    auto raw_ptr = cur.get(); // 得到协程对象的裸指针
-    cur.reset(); // 这里清除掉，计数减一，防止锁住对象导致不能自动析构
+    cur->sampleStack(); // 抽中采样时记录这次运行的栈深
+    cur->releaseSharedStack(); // 不会再切回来，共享栈上的内容不用保存
 
-    // 通过裸指针调用切回主协程，切回调度协程后，这里的上下文暂停了，且不会再切回来
-    // 前面不清除计数的话，这里的计数会一直存在，不会跳出作用域，就会锁住对象无法自动析构释放
-    raw_ptr->swapOut();
+    // 切回调度协程后，这里的上下文暂停了，且不会再切回来，协程对象由切入者释放
+    cur->swapOut();
 
     // 任务执行完毕了，不会再切回来，切回来就是出错了
-    ASSERT2(false, "never reach fiber_id=" + std::to_string(raw_ptr->getId()));
+    ASSERT2(false, "never reach fiber_id=" + std::to_string(cur->getId()));
 }
 
 // 使用use_caller时，协程的运行函数，运行完切回主协程
 void Fiber::CallerMainFunc()
 {
-    Fiber::ptr cur = GetThis();
+    Fiber* cur = t_fiber;
     ASSERT(cur);
     try
     {
@@ -273,10 +1099,10 @@ void Fiber::CallerMainFunc()
             << shiosylar::BacktraceToString();
     }
 
-    auto raw_ptr = cur.get();
-    cur.reset();
-    raw_ptr->back(); // 回到当前线程的主协程
-    ASSERT2(false, "never reach fiber_id=" + std::to_string(raw_ptr->getId()));
+    cur->sampleStack();
+    cur->releaseSharedStack();
+    cur->back(); // 回到当前线程的主协程
+    ASSERT2(false, "never reach fiber_id=" + std::to_string(cur->getId()));
 
 }
 
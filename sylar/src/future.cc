@@ -0,0 +1,191 @@
+#include "../include/future.h"
+#include "../include/fiber.h"
+
+namespace shiosylar
+{
+
+// 当前是否在调度器的任务协程中，只有此时可以挂起协程
+static bool InFiber()
+{
+	return Scheduler::GetThis() && Scheduler::GetWorkerIndex() >= 0
+			&& Fiber::GetThis().get() != Scheduler::GetMainFiber();
+}
+
+// 协程登记后挂起，普通线程登记栈上的信号量后阻塞
+void FutureWaiters::park(Spinlock::Lock& lock)
+{
+	if(InFiber())
+	{
+		FiberWaiter waiter;
+		waiter.scheduler = Scheduler::GetThis();
+		waiter.fiber = Fiber::GetThis();
+		fibers.push_back(std::move(waiter));
+		lock.unlock();
+		Fiber::YieldToHold();
+		return;
+	}
+	// 不在调度器中运行的共享栈协程阻塞线程等待，信号量放在堆上，不留下指向共享栈的指针
+	if(Fiber::OnSharedStack())
+	{
+		std::unique_ptr<Semaphore> sem(new Semaphore);
+		threads.push_back(sem.get());
+		lock.unlock();
+		sem->wait();
+		return;
+	}
+	Semaphore sem;
+	threads.push_back(&sem);
+	lock.unlock();
+	sem.wait();
+}
+
+// 协程放回它的调度器，还没切出时调度器会稍后再执行
+void FutureWaiters::notify()
+{
+	for(auto& waiter : fibers)
+		waiter.scheduler->schedule(std::move(waiter.fiber));
+	fibers.clear();
+	for(auto sem : threads)
+		sem->notify();
+	threads.clear();
+}
+
+bool FutureStateBase::isReady()
+{
+	MutexType::Lock lock(m_mutex);
+	return m_ready;
+}
+
+void FutureStateBase::wait()
+{
+	MutexType::Lock lock(m_mutex);
+	if(m_ready)
+		return;
+	m_waiters.park(lock);
+}
+
+void FutureStateBase::onReady(Task cb)
+{
+	{
+		MutexType::Lock lock(m_mutex);
+		if(!m_ready)
+		{
+			m_callbacks.push_back(std::move(cb));
+			return;
+		}
+	}
+	cb();
+}
+
+void FutureStateBase::setException(std::exception_ptr error)
+{
+	MutexType::Lock lock(m_mutex);
+	checkNotReadyLocked();
+	m_error = std::move(error);
+	setReady(lock);
+}
+
+void FutureStateBase::checkNotReadyLocked()
+{
+	if(m_ready)
+		throw std::logic_error("future result already set");
+}
+
+// 就绪后结果不再修改，等待者和回调在锁外处理
+void FutureStateBase::setReady(MutexType::Lock& lock)
+{
+	m_ready = true;
+	FutureWaiters waiters;
+	waiters.swap(m_waiters);
+	std::vector<Task> callbacks;
+	callbacks.swap(m_callbacks);
+	lock.unlock();
+
+	waiters.notify();
+	for(auto& cb : callbacks)
+		cb();
+}
+
+void FutureStateBase::rethrowIfError()
+{
+	if(m_error)
+		std::rethrow_exception(m_error);
+}
+
+WaitGroup::~WaitGroup()
+{
+	ASSERT(m_waiters.fibers.empty() && m_waiters.threads.empty());
+}
+
+// 计数不归零时只做一次CAS，可能归零时在锁内修改计数并取出等待者
+// 等待者只在锁内检查计数，看到归零时修改方已经不再访问本对象，等待者返回后可以立即销毁它
+void WaitGroup::add(int64_t n)
+{
+	int64_t count = m_count.load(std::memory_order_relaxed);
+	while(count + n != 0)
+	{
+		ASSERT2(count + n > 0, "WaitGroup count below zero");
+		if(m_count.compare_exchange_weak(count, count + n, std::memory_order_acq_rel))
+			return;
+	}
+
+	FutureWaiters waiters;
+	{
+		MutexType::Lock lock(m_mutex);
+		count = m_count.fetch_add(n, std::memory_order_acq_rel) + n;
+		ASSERT2(count >= 0, "WaitGroup count below zero");
+		if(count == 0)
+			waiters.swap(m_waiters);
+	}
+	waiters.notify();
+}
+
+void WaitGroup::done()
+{
+	add(-1);
+}
+
+void WaitGroup::wait()
+{
+	// 完成方在其他协程中调用done，共享栈协程挂起后栈上的WaitGroup会被覆盖
+	ASSERT2(!Fiber::OnSharedStack(this), "WaitGroup on the stack of shared stack fiber id="
+			<< Fiber::GetFiberId() << ", allocate it on the heap");
+	MutexType::Lock lock(m_mutex);
+	if(m_count.load(std::memory_order_acquire) == 0)
+		return;
+	m_waiters.park(lock);
+}
+
+// 无结果值的when_all，任一个失败时结果为最先完成的那个异常
+Future<void> when_all(const std::vector<Future<void>>& futures)
+{
+	struct Context
+	{
+		Promise<void> promise;
+		std::atomic<size_t> remaining;
+		std::atomic<bool> failed = {false};
+	};
+
+	auto ctx = std::make_shared<Context>();
+	ctx->remaining = futures.size();
+	Future<void> future = ctx->promise.getFuture();
+	if(futures.empty())
+	{
+		ctx->promise.setValue();
+		return future;
+	}
+	for(auto& f : futures)
+	{
+		Future<void> item = f;
+		f.onReady([ctx, item]() {
+			std::exception_ptr error = item.getException();
+			if(error && !ctx->failed.exchange(true))
+				ctx->promise.setException(error);
+			if(--ctx->remaining == 0 && !ctx->failed)
+				ctx->promise.setValue();
+		});
+	}
+	return future;
+}
+
+} // namespace shiosylar end
@@ -219,9 +219,9 @@ unsigned int sleep(unsigned int seconds)
 
     shiosylar::Fiber::ptr fiber = shiosylar::Fiber::GetThis();
     shiosylar::IOManager* iom = shiosylar::IOManager::GetThis();
-    iom->addTimer(seconds * 1000, std::bind((void(shiosylar::Scheduler::*)
-            (shiosylar::Fiber::ptr, int thread))&shiosylar::IOManager::schedule
-            ,iom, fiber, -1));
+    iom->addTimer(seconds * 1000, [iom, fiber]() {
+            iom->schedule(fiber);
+    });
     shiosylar::Fiber::YieldToHold();
     return 0;
 }
@@ -233,9 +233,9 @@ int usleep(useconds_t usec)
 
     shiosylar::Fiber::ptr fiber = shiosylar::Fiber::GetThis();
     shiosylar::IOManager* iom = shiosylar::IOManager::GetThis();
-    iom->addTimer(usec / 1000, std::bind((void(shiosylar::Scheduler::*)
-            (shiosylar::Fiber::ptr, int thread))&shiosylar::IOManager::schedule
-            ,iom, fiber, -1));
+    iom->addTimer(usec / 1000, [iom, fiber]() {
+            iom->schedule(fiber);
+    });
     shiosylar::Fiber::YieldToHold();
     return 0;
 }
@@ -248,9 +248,9 @@ int nanosleep(const struct timespec *req, struct timespec *rem)
     int timeout_ms = req->tv_sec * 1000 + req->tv_nsec / 1000 /1000;
     shiosylar::Fiber::ptr fiber = shiosylar::Fiber::GetThis();
     shiosylar::IOManager* iom = shiosylar::IOManager::GetThis();
-    iom->addTimer(timeout_ms, std::bind((void(shiosylar::Scheduler::*)
-            (shiosylar::Fiber::ptr, int thread))&shiosylar::IOManager::schedule
-            ,iom, fiber, -1));
+    iom->addTimer(timeout_ms, [iom, fiber]() {
+            iom->schedule(fiber);
+    });
     shiosylar::Fiber::YieldToHold();
     return 0;
 }
@@ -2,9 +2,12 @@
 #include "../include/macro.h"
 #include "../include/logger.h"
 
+#include <algorithm>
 #include <errno.h>
 #include <fcntl.h>
+#include <poll.h>
 #include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <string.h>
 #include <unistd.h>
 
@@ -14,6 +17,10 @@ namespace shiosylar
 // 全局的系统日志器
 static shiosylar::Logger::ptr g_logger = LOG_NAME("system");
 
+// 线程私有变量，当前线程正在为哪个IOManager分发事件
+// 分发事件时产生的任务由轮询线程自己执行，不需要唤醒其他线程
+static thread_local IOManager* t_polling = nullptr;
+
 enum EpollCtlOp {  };
 
 static std::ostream& operator<< (std::ostream& os, const EpollCtlOp& op)
@@ -87,7 +94,7 @@ void IOManager::FdContext::resetContext(EventContext& ctx)
 }
 
 // 触发事件回调
-void IOManager::FdContext::triggerEvent(IOManager::Event event)
+void IOManager::FdContext::triggerEvent(IOManager::Event event, std::vector<FiberAndThread>* batch)
 {
 	ASSERT(events & event);
 
@@ -96,7 +103,15 @@ void IOManager::FdContext::triggerEvent(IOManager::Event event)
 
 	EventContext& ctx = getContext(event); // 获取事件回调
 
-	if(ctx.cb) // 插入任务队列
+	// 属于当前调度器的任务先放入批次，分发完一轮事件后统一发布
+	if(batch && ctx.scheduler == Scheduler::GetThis())
+	{
+		if(ctx.cb)
+			batch->emplace_back(&ctx.cb, -1);
+		else
+			batch->emplace_back(&ctx.fiber, -1);
+	}
+	else if(ctx.cb) // 插入任务队列
 		ctx.scheduler->schedule(&ctx.cb);
 	else
 		ctx.scheduler->schedule(&ctx.fiber);
@@ -105,25 +120,33 @@ void IOManager::FdContext::triggerEvent(IOManager::Event event)
 	return;
 }
 
-IOManager::IOManager(size_t threads, bool use_caller, const std::string& name)
-	:Scheduler(threads, use_caller, name)
+IOManager::IOManager(size_t threads, bool use_caller, const std::string& name
+					,const std::vector<int>& cpus)
+	:Scheduler(threads, use_caller, name, cpus)
 {
 	m_epfd = epoll_create(5000); // 创建epollfd
 	ASSERT(m_epfd > 0);
 
-	int rt = pipe(m_tickleFds); // 创建管道，0端读取、1端写入
-	ASSERT(!rt);
+	m_tickleFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC); // 唤醒轮询线程的eventfd
+	ASSERT(m_tickleFd >= 0);
 
+	// 水平触发，未读取时epoll_wait会一直返回，不会丢失通知
 	epoll_event event;
 	memset(&event, 0, sizeof(epoll_event));
-	event.events = EPOLLIN | EPOLLET;
-	event.data.fd = m_tickleFds[0];
+	event.events = EPOLLIN;
+	event.data.fd = m_tickleFd;
 
-	rt = fcntl(m_tickleFds[0], F_SETFL, O_NONBLOCK); // 设置管道读取端非阻塞
+	int rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFd, &event);
 	ASSERT(!rt);
 
-	rt = epoll_ctl(m_epfd, EPOLL_CTL_ADD, m_tickleFds[0], &event); // 将管道读取端加入epoll监听
-	ASSERT(!rt);
+	// 每个工作线程一个阻塞的eventfd，休眠时读取
+	for(size_t i = 0; i < getWorkerCount(); ++i)
+	{
+		IdleContext* ctx = new IdleContext;
+		ctx->eventFd = eventfd(0, EFD_CLOEXEC);
+		ASSERT(ctx->eventFd >= 0);
+		m_idleContexts.push_back(ctx);
+	}
 
 	contextResize(32); // 初始化32个fd上下文对象在容器中
 
@@ -134,8 +157,12 @@ IOManager::~IOManager()
 {
 	stop();
 	close(m_epfd); // 关闭epollfd
-	close(m_tickleFds[0]); // 关闭管道的读写端
-	close(m_tickleFds[1]);
+	close(m_tickleFd);
+	for(auto ctx : m_idleContexts)
+	{
+		close(ctx->eventFd);
+		delete ctx;
+	}
 
 	// 释放掉容器中的fd上下文
 	for(size_t i = 0; i < m_fdContexts.size(); ++i)
@@ -161,7 +188,7 @@ void IOManager::contextResize(size_t size)
 }
 
 // 向epoll添加事件
-int IOManager::addEvent(int fd, Event event, std::function<void()> cb)
+int IOManager::addEvent(int fd, Event event, Task cb)
 {
 	FdContext* fd_ctx = nullptr;
 	RWMutexType::ReadLock lock(m_mutex);
@@ -345,14 +372,135 @@ IOManager* IOManager::GetThis()
 	return dynamic_cast<IOManager*>(Scheduler::GetThis());
 }
 
-// 向管道中写数据，唤醒epoll_wait
+// 唤醒一个空闲线程，优先唤醒休眠线程，让轮询线程继续等待IO
 void IOManager::tickle()
 {
 	if(!hasIdleThreads())
 		return;
 
-	int rt = write(m_tickleFds[1], "T", 1);
-	ASSERT(rt == 1);
+	// 轮询线程分发事件时产生的任务由它自己执行，执行时发现还有任务会再通知
+	if(t_polling == this)
+		return;
+
+	// 与park中的屏障配对，任务已经入队，要么这里看到休眠的线程，要么休眠前的检查看到任务
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(unparkOne())
+		return;
+	if(m_poller != -1)
+		signalPoller();
+}
+
+// 只唤醒指定的工作线程
+void IOManager::tickleWorker(size_t index)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(m_poller == (int)index)
+	{
+		signalPoller();
+		return;
+	}
+	if(parkedCount() == 0)
+		return;
+
+	if(removeParked(index)) // 没有休眠时会在下一轮取任务时看到收件箱
+		signalWorker(index);
+}
+
+// 在自己的eventfd上休眠，直到被唤醒，可以退出的线程限时休眠，超时后退出
+bool IOManager::park(size_t index)
+{
+	pushParked(index);
+
+	// 登记后再检查一次，轮询角色空出来时自己去轮询
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(hasWork(index) || m_poller == -1 || stopping())
+	{
+		if(removeParked(index))
+			return false;
+		// 已被其他线程取出栈，它马上会写eventfd，读掉这次通知
+	}
+
+	IdleContext* ctx = m_idleContexts[index];
+	uint64_t retire_ms = getRetireIdleMs(index);
+	if(retire_ms)
+	{
+		struct pollfd pfd;
+		pfd.fd = ctx->eventFd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		uint64_t deadline = GetCurrentMS() + retire_ms;
+		int rt = 0;
+		do
+		{
+			uint64_t now = GetCurrentMS();
+			rt = poll(&pfd, 1, now < deadline ? (int)(deadline - now) : 0);
+		} while(rt < 0 && errno == EINTR);
+
+		// 超时仍在休眠栈中则移出并退出，已被取出的等它写eventfd
+		if(rt == 0 && removeParked(index))
+			return retireWorker(index);
+	}
+
+	uint64_t value = 0;
+	while(read(ctx->eventFd, &value, sizeof(value)) < 0 && errno == EINTR);
+	ctx->signalled.exchange(false);
+	return false;
+}
+
+// 从休眠栈中取出一个线程并唤醒
+bool IOManager::unparkOne()
+{
+	if(parkedCount() == 0)
+		return false;
+
+	int index = popParked();
+	if(index < 0)
+		return false;
+	signalWorker(index);
+	return true;
+}
+
+// 唤醒指定的休眠线程
+void IOManager::signalWorker(size_t index)
+{
+	IdleContext* ctx = m_idleContexts[index];
+	if(ctx->signalled.exchange(true))
+		return;
+
+	uint64_t value = 1;
+	int rt = write(ctx->eventFd, &value, sizeof(value));
+	ASSERT(rt == sizeof(value));
+	++m_wakeupCount;
+}
+
+// 唤醒轮询线程的epoll_wait，上一次通知还没被读取时不再写
+void IOManager::signalPoller()
+{
+	if(m_tickleSignalled.exchange(true))
+		return;
+
+	uint64_t value = 1;
+	int rt = write(m_tickleFd, &value, sizeof(value));
+	ASSERT(rt == sizeof(value));
+	++m_wakeupCount;
+}
+
+// 唤醒所有空闲线程
+void IOManager::wakeAll()
+{
+	std::vector<size_t> parked;
+	takeParked(parked);
+	for(auto index : parked)
+		signalWorker(index);
+	signalPoller();
+}
+
+// 离开轮询角色
+void IOManager::leavePoller()
+{
+	m_poller = -1;
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	unparkOne();
 }
 
 // 判断IOManager是否可以停止
@@ -371,13 +519,16 @@ bool IOManager::stopping()
 	return stopping(timeout);
 }
 
-// 忙等待函数，会进入epoll_wait， 协程无任务可调度时执行idle协程
+// 空闲协程，轮询线程进入epoll_wait，其他空闲线程在自己的eventfd上休眠
 void IOManager::idle()
 {
 	LOG_DEBUG(g_logger) << "idle";
 	const uint64_t MAX_EVNETS = 256;
 	epoll_event* events = new epoll_event[MAX_EVNETS]();
 	std::shared_ptr<epoll_event> shared_events(events, [](epoll_event* ptr){ delete[] ptr; });
+	std::vector<Task> cbs; // 到期的定时任务，循环复用避免每轮分配
+	std::vector<FiberAndThread> batch; // 一轮epoll_wait触发的任务，循环复用避免每轮分配
+	size_t index = GetWorkerIndex();
 
 	while(true)
 	{
@@ -385,9 +536,30 @@ void IOManager::idle()
 		if(UNLIKELY(stopping(next_timeout)))
 		{
 			LOG_INFO(g_logger) << "name=" << getName() << " idle stopping exit";
+			int self = index;
+			m_poller.compare_exchange_strong(self, -1);
+			wakeAll(); // 唤醒其他空闲线程检查停止条件
 			break;
 		}
 
+		// 已经有其他轮询线程时，在自己的eventfd上休眠，等待被单独唤醒
+		int poller = -1;
+		if(m_poller != (int)index && !m_poller.compare_exchange_strong(poller, (int)index))
+		{
+			if(park(index))
+				return; // 空闲超时退出
+			Fiber::GetCurrent()->swapOut();
+			continue;
+		}
+
+		// 成为轮询线程后再检查一次任务，与tickle交错时不丢失通知
+		if(hasWork(index))
+		{
+			leavePoller();
+			Fiber::GetCurrent()->swapOut();
+			continue;
+		}
+
 		int rt = 0;
 		do
 		{
@@ -399,7 +571,9 @@ void IOManager::idle()
 			else
 				next_timeout = MAX_TIMEOUT;
 
+			uint64_t poll_start = GetCurrentUS();
 			rt = epoll_wait(m_epfd, events, MAX_EVNETS, (int)next_timeout);
+			addPollTime(index, GetCurrentUS() - poll_start);
 			if(rt < 0 && errno == EINTR) // 程序收到信号时，设置errno为EINTR，此时不做处理
 			{
 			}
@@ -408,24 +582,22 @@ void IOManager::idle()
 
 		} while(true);
 
-		std::vector<std::function<void()> > cbs;
+		t_polling = this;
 		listExpiredCb(cbs); // 取出触发的定时任务，存到容器 cbs 中
-		if(!cbs.empty())
-		{
-			schedule(cbs.begin(), cbs.end()); // 将定时器任务插入到协程的任务队列中
-			cbs.clear();
-		}
+		for(auto& cb : cbs)
+			batch.emplace_back(&cb, -1); // 定时器任务和IO事件一起批量发布
+		cbs.clear();
 
 		for(int i = 0; i < rt; ++i)
 		{
 			epoll_event& event = events[i];
-			if(event.data.fd == m_tickleFds[0])
+			if(event.data.fd == m_tickleFd)
 			{
-				uint8_t dummy[256];
-				while(read(m_tickleFds[0], dummy, sizeof(dummy)) > 0); // ET模式下，需要将数据读取完
+				uint64_t dummy = 0;
+				while(read(m_tickleFd, &dummy, sizeof(dummy)) < 0 && errno == EINTR);
+				m_tickleSignalled.exchange(false);
 				continue;
 			}
-
 			FdContext* fd_ctx = (FdContext*)event.data.ptr;
 			FdContext::MutexType::Lock lock(fd_ctx->mutex);
 			if(event.events & (EPOLLERR | EPOLLHUP))
@@ -456,28 +628,48 @@ void IOManager::idle()
 
 			if(real_events & READ)
 			{
-				fd_ctx->triggerEvent(READ);
+				fd_ctx->triggerEvent(READ, &batch);
 				--m_pendingEventCount;
 			}
 			if(real_events & WRITE)
 			{
-				fd_ctx->triggerEvent(WRITE);
+				fd_ctx->triggerEvent(WRITE, &batch);
 				--m_pendingEventCount;
 			}
 		}
 
-		Fiber::ptr cur = Fiber::GetThis();
-		auto raw_ptr = cur.get();
-		cur.reset();
+		t_polling = nullptr;
 
-		raw_ptr->swapOut();
+		if(!batch.empty())
+		{
+			// 先离开轮询角色，被唤醒的线程执行完任务后可以接替轮询
+			m_poller = -1;
+			size_t published = scheduleBatch(batch);
+
+			// 自己执行一个，其余每个任务最多唤醒一个休眠线程，至少唤醒一个接替轮询
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			size_t wake = published > 1 ? published - 1 : 1;
+			for(size_t i = 0; i < wake && unparkOne(); ++i);
+		}
+		else if(hasWork(index)) // 被通知有新任务，离开轮询角色去执行
+			leavePoller();
+		else // 没有产生任务(超时或定时器变化)，继续轮询
+			continue;
+
+		// 用裸指针切出，调度器持有idle协程的引用
+		Fiber::GetCurrent()->swapOut();
 	}
 }
 
 // 当有新的定时器插入到定时器的首部,执行该函数
 void IOManager::onTimerInsertedAtFront()
 {
-	tickle(); // 唤醒epoll_wait更新定时器
+	// 唤醒epoll_wait更新定时器，没有轮询线程时下一个空闲线程会成为轮询线程
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(m_poller != -1)
+		signalPoller();
+	else
+		unparkOne();
 }
 
 } // namespace shiosylar end
@@ -1,4 +1,6 @@
 #include "../include/mutex.h"
+#include "../include/macro.h"
+#include "../include/scheduler.h"
 #include <stdexcept>
 
 namespace shiosylar
@@ -27,48 +29,262 @@ void Semaphore::notify()
         throw std::logic_error("sem_post error");
 }
 
-// FiberSemaphore::FiberSemaphore(size_t initial_concurrency)
-//     :m_concurrency(initial_concurrency) {
-// }
-
-// FiberSemaphore::~FiberSemaphore() {
-//     SYLAR_ASSERT(m_waiters.empty());
-// }
-
-// bool FiberSemaphore::tryWait() {
-//     SYLAR_ASSERT(Scheduler::GetThis());
-//     {
-//         MutexType::Lock lock(m_mutex);
-//         if(m_concurrency > 0u) {
-//             --m_concurrency;
-//             return true;
-//         }
-//         return false;
-//     }
-// }
-
-// void FiberSemaphore::wait() {
-//     SYLAR_ASSERT(Scheduler::GetThis());
-//     {
-//         MutexType::Lock lock(m_mutex);
-//         if(m_concurrency > 0u) {
-//             --m_concurrency;
-//             return;
-//         }
-//         m_waiters.push_back(std::make_pair(Scheduler::GetThis(), Fiber::GetThis()));
-//     }
-//     Fiber::YieldToHold();
-// }
-
-// void FiberSemaphore::notify() {
-//     MutexType::Lock lock(m_mutex);
-//     if(!m_waiters.empty()) {
-//         auto next = m_waiters.front();
-//         m_waiters.pop_front();
-//         next.first->schedule(next.second);
-//     } else {
-//         ++m_concurrency;
-//     }
-// }
+// 当前协程，登记到等待队列后挂起
+static FiberWaiter CurrentWaiter(bool writer = false)
+{
+    ASSERT2(Scheduler::GetThis() && Scheduler::GetWorkerIndex() >= 0
+            && Fiber::GetThis().get() != Scheduler::GetMainFiber(),
+            "fiber sync primitive used outside a scheduler fiber");
+    FiberWaiter waiter;
+    waiter.scheduler = Scheduler::GetThis();
+    waiter.fiber = Fiber::GetThis();
+    waiter.writer = writer;
+    return waiter;
+}
+
+// 把等待的协程放回它的调度器，还没切出时调度器会稍后再执行
+static void Wake(FiberWaiter& waiter)
+{
+    waiter.scheduler->schedule(std::move(waiter.fiber));
+}
+
+FiberMutex::~FiberMutex()
+{
+    ASSERT(m_waiters.empty());
+}
+
+// 竞争时先把状态设为CONTENDED，原来是UNLOCKED则直接获得锁
+// 否则登记后挂起，持有者解锁时看到CONTENDED会唤醒一个等待者，被唤醒后重新竞争
+void FiberMutex::lockSlow()
+{
+    FiberWaiter waiter = CurrentWaiter();
+    while(true)
+    {
+        {
+            Spinlock::Lock lock(m_mutex);
+            if(m_state.exchange(CONTENDED, std::memory_order_acquire) == UNLOCKED)
+                return;
+            m_waiters.push_back(waiter);
+        }
+        Fiber::YieldToHold();
+    }
+}
+
+// 唤醒一个等待者
+void FiberMutex::wakeOne()
+{
+    FiberWaiter waiter;
+    {
+        Spinlock::Lock lock(m_mutex);
+        if(m_waiters.empty())
+            return;
+        waiter = std::move(m_waiters.front());
+        m_waiters.pop_front();
+    }
+    Wake(waiter);
+}
+
+FiberSemaphore::FiberSemaphore(size_t initial_concurrency)
+    :m_count(initial_concurrency)
+{
+}
+
+FiberSemaphore::~FiberSemaphore()
+{
+    ASSERT(m_waiters.empty());
+}
+
+bool FiberSemaphore::tryWait()
+{
+    int64_t count = m_count.load(std::memory_order_relaxed);
+    while(count > 0)
+    {
+        if(m_count.compare_exchange_weak(count, count - 1, std::memory_order_acquire))
+            return true;
+    }
+    return false;
+}
+
+// 计数已经减一，释放者先到时直接取走留下的信号，否则登记后挂起，被唤醒时信号已经交给自己
+void FiberSemaphore::waitSlow()
+{
+    FiberWaiter waiter = CurrentWaiter();
+    {
+        Spinlock::Lock lock(m_mutex);
+        if(m_wakeups > 0)
+        {
+            --m_wakeups;
+            return;
+        }
+        m_waiters.push_back(std::move(waiter));
+    }
+    Fiber::YieldToHold();
+}
+
+// 计数加一前为负，说明有等待者，唤醒一个，等待者还没登记时留给它
+void FiberSemaphore::notifySlow()
+{
+    FiberWaiter waiter;
+    {
+        Spinlock::Lock lock(m_mutex);
+        if(m_waiters.empty())
+        {
+            ++m_wakeups;
+            return;
+        }
+        waiter = std::move(m_waiters.front());
+        m_waiters.pop_front();
+    }
+    Wake(waiter);
+}
+
+FiberCondition::~FiberCondition()
+{
+    ASSERT(m_waiters.empty());
+}
+
+// 先登记再释放mutex，持有mutex的通知者一定能看到登记
+void FiberCondition::wait(FiberMutex& mutex)
+{
+    FiberWaiter waiter = CurrentWaiter();
+    {
+        Spinlock::Lock lock(m_mutex);
+        m_waiters.push_back(std::move(waiter));
+        ++m_waiterCount;
+    }
+    mutex.unlock();
+    Fiber::YieldToHold();
+    mutex.lock();
+}
+
+void FiberCondition::notify()
+{
+    if(m_waiterCount == 0)
+        return;
+    FiberWaiter waiter;
+    {
+        Spinlock::Lock lock(m_mutex);
+        if(m_waiters.empty())
+            return;
+        waiter = std::move(m_waiters.front());
+        m_waiters.pop_front();
+        --m_waiterCount;
+    }
+    Wake(waiter);
+}
+
+void FiberCondition::notifyAll()
+{
+    if(m_waiterCount == 0)
+        return;
+    std::list<FiberWaiter> waiters;
+    {
+        Spinlock::Lock lock(m_mutex);
+        waiters.swap(m_waiters);
+        m_waiterCount = 0;
+    }
+    for(auto& waiter : waiters)
+        Wake(waiter);
+}
+
+FiberRWMutex::~FiberRWMutex()
+{
+    ASSERT(m_waiters.empty());
+}
+
+// 设置WAITERS时用CAS确认锁仍被持有，保证持有者解锁时能看到等待者
+// woken为true时是被唤醒的等待者，已经排到队首，不再给写者让路
+void FiberRWMutex::rdlockSlow()
+{
+    FiberWaiter waiter = CurrentWaiter();
+    bool woken = false;
+    while(true)
+    {
+        {
+            Spinlock::Lock lock(m_mutex);
+            uint32_t state = m_state.load(std::memory_order_relaxed);
+            while(true)
+            {
+                if(!(state & WRITER) && (woken || !(state & WAITERS)))
+                {
+                    if(m_state.compare_exchange_weak(state, state + 1, std::memory_order_acquire))
+                        return;
+                }
+                else if(m_state.compare_exchange_weak(state, state | WAITERS, std::memory_order_relaxed))
+                    break;
+            }
+            m_waiters.push_back(waiter);
+        }
+        Fiber::YieldToHold();
+        woken = true;
+    }
+}
+
+void FiberRWMutex::wrlockSlow()
+{
+    FiberWaiter waiter = CurrentWaiter(true);
+    while(true)
+    {
+        {
+            Spinlock::Lock lock(m_mutex);
+            uint32_t state = m_state.load(std::memory_order_relaxed);
+            while(true)
+            {
+                if(!(state & (WRITER | READERS)))
+                {
+                    if(m_state.compare_exchange_weak(state, state | WRITER, std::memory_order_acquire))
+                        return;
+                }
+                else if(m_state.compare_exchange_weak(state, state | WAITERS, std::memory_order_relaxed))
+                    break;
+            }
+            m_waiters.push_back(waiter);
+        }
+        Fiber::YieldToHold();
+    }
+}
+
+// 写者解锁清除WRITER，读者解锁减少读者数，锁完全释放且有等待者时唤醒
+void FiberRWMutex::unlock()
+{
+    uint32_t state = m_state.load(std::memory_order_relaxed);
+    if(state & WRITER)
+    {
+        uint32_t expected = WRITER;
+        if(m_state.compare_exchange_strong(expected, 0, std::memory_order_release))
+            return;
+        m_state.fetch_and(~WRITER, std::memory_order_release);
+        wake();
+        return;
+    }
+    state = m_state.fetch_sub(1, std::memory_order_release);
+    if((state & WAITERS) && (state & READERS) == 1)
+        wake();
+}
+
+void FiberRWMutex::wake()
+{
+    std::list<FiberWaiter> waiters;
+    {
+        Spinlock::Lock lock(m_mutex);
+        if(!m_waiters.empty() && m_waiters.front().writer)
+        {
+            waiters.push_back(std::move(m_waiters.front()));
+            m_waiters.pop_front();
+        }
+        else
+        {
+            while(!m_waiters.empty() && !m_waiters.front().writer)
+            {
+                waiters.push_back(std::move(m_waiters.front()));
+                m_waiters.pop_front();
+            }
+        }
+        if(m_waiters.empty())
+            m_state.fetch_and(~WAITERS, std::memory_order_relaxed);
+    }
+    for(auto& waiter : waiters)
+        Wake(waiter);
+}
 
 } // namespace shiosylar end
@@ -0,0 +1,210 @@
+#include "../include/offload.h"
+#include "../include/config.h"
+#include "../include/logger.h"
+#include "../include/macro.h"
+
+namespace shiosylar
+{
+
+// 全局日志类，名称'system'
+static Logger::ptr g_logger = LOG_NAME("system");
+
+// 默认卸载线程池的线程数
+static ConfigVar<uint32_t>::ptr g_offload_threads =
+	Config::Lookup<uint32_t>("offload.threads", 4, "offload pool threads");
+
+// 默认卸载线程池的排队任务数上限
+static ConfigVar<uint32_t>::ptr g_offload_queue_size =
+	Config::Lookup<uint32_t>("offload.queue_size", 1024, "offload pool max queued jobs");
+
+// 多个线程同时更新的最大值，用CAS取最大
+static void UpdateMax(std::atomic<uint64_t>& max, uint64_t value)
+{
+	uint64_t cur = max.load(std::memory_order_relaxed);
+	while(value > cur && !max.compare_exchange_weak(cur, value, std::memory_order_relaxed));
+}
+
+OffloadPool::OffloadPool()
+	:OffloadPool(g_offload_threads->getValue(), g_offload_queue_size->getValue())
+{
+}
+
+OffloadPool::OffloadPool(size_t threads, size_t max_queue, const std::string& name)
+	:
+	m_name(name),
+	m_maxQueue(max_queue)
+{
+	ASSERT(threads > 0);
+	ASSERT(max_queue > 0);
+	for(size_t i = 0; i < threads; ++i)
+	{
+		m_threads.push_back(Thread::ptr(new Thread(std::bind(&OffloadPool::run, this),
+								m_name + "_" + std::to_string(i))));
+	}
+}
+
+OffloadPool::~OffloadPool()
+{
+	stop();
+}
+
+// 当前是否在调度器的任务协程中
+bool OffloadPool::InFiber()
+{
+	return Scheduler::GetThis() && Scheduler::GetWorkerIndex() >= 0
+			&& Fiber::GetThis().get() != Scheduler::GetMainFiber();
+}
+
+// 在线程池中执行job，当前协程挂起直到job执行完成
+void OffloadPool::execute(Task job)
+{
+	if(!InFiber())
+	{
+		++m_inlined;
+		job();
+		return;
+	}
+
+	// 任务通常按引用访问调用协程栈上的结果和局部变量，共享栈协程挂起后这些地址会被其他协程覆盖
+	ASSERT2(!Fiber::OnSharedStack(), "offload from shared stack fiber id=" << Fiber::GetFiberId()
+			<< ", run it in a private stack fiber");
+
+	Job item;
+	item.fn = std::move(job);
+	item.scheduler = Scheduler::GetThis();
+	item.fiber = Fiber::GetThis();
+	while(true)
+	{
+		MutexType::Lock lock(m_mutex);
+		if(m_stopping)
+		{
+			lock.unlock();
+			++m_inlined;
+			item.fn();
+			return;
+		}
+		if(m_jobs.size() < m_maxQueue)
+		{
+			item.submitUs = GetCurrentUS();
+			m_jobs.push_back(std::move(item));
+			++m_submitted;
+			break;
+		}
+
+		// 队列满，挂起等待线程池取走一个任务后唤醒，再重新尝试
+		Waiter waiter;
+		waiter.scheduler = item.scheduler;
+		waiter.fiber = item.fiber;
+		m_waiters.push_back(std::move(waiter));
+		lock.unlock();
+		++m_fullWaits;
+		Fiber::YieldToHold();
+	}
+	m_sem.notify();
+
+	// 线程池执行完后把本协程放回调度器，还没切出时调度器会稍后再执行
+	Fiber::YieldToHold();
+}
+
+// 停止线程池
+void OffloadPool::stop()
+{
+	std::vector<Thread::ptr> threads;
+	{
+		MutexType::Lock lock(m_mutex);
+		if(m_stopping)
+			return;
+		m_stopping = true;
+		threads.swap(m_threads);
+	}
+	for(size_t i = 0; i < threads.size(); ++i)
+		m_sem.notify();
+	for(auto& thread : threads)
+		thread->join();
+
+	// 还在等待空位的协程重新尝试时会在自己的线程执行
+	std::deque<Waiter> waiters;
+	{
+		MutexType::Lock lock(m_mutex);
+		waiters.swap(m_waiters);
+	}
+	for(auto& waiter : waiters)
+		waiter.scheduler->schedule(std::move(waiter.fiber));
+}
+
+// 线程池线程的入口函数，取出任务执行，执行完后唤醒调用协程
+void OffloadPool::run()
+{
+	while(true)
+	{
+		m_sem.wait();
+		Job job;
+		Waiter waiter;
+		{
+			MutexType::Lock lock(m_mutex);
+			if(m_jobs.empty())
+			{
+				if(m_stopping)
+					break;
+				continue;
+			}
+			job = std::move(m_jobs.front());
+			m_jobs.pop_front();
+			if(!m_waiters.empty())
+			{
+				waiter = std::move(m_waiters.front());
+				m_waiters.pop_front();
+			}
+		}
+
+		// 空出了一个位置，唤醒一个等待的协程
+		if(waiter.fiber)
+			waiter.scheduler->schedule(std::move(waiter.fiber));
+
+		uint64_t start = GetCurrentUS();
+		m_totalQueueUs += start - job.submitUs;
+		++m_running;
+		try
+		{
+			job.fn();
+		}
+		catch(std::exception& ex)
+		{
+			LOG_ERROR(g_logger) << m_name << " offload job except: " << ex.what();
+		}
+		catch(...)
+		{
+			LOG_ERROR(g_logger) << m_name << " offload job except";
+		}
+		--m_running;
+		uint64_t used = GetCurrentUS() - start;
+		m_totalRunUs += used;
+		UpdateMax(m_maxRunUs, used);
+		++m_completed;
+
+		job.fn = nullptr; // 先释放任务捕获的对象，再恢复调用协程
+		job.scheduler->schedule(std::move(job.fiber));
+	}
+}
+
+// 获取统计信息
+OffloadPool::Stats OffloadPool::getStats()
+{
+	Stats stats;
+	{
+		MutexType::Lock lock(m_mutex);
+		stats.queued = m_jobs.size();
+		stats.waiting = m_waiters.size();
+	}
+	stats.submitted = m_submitted;
+	stats.completed = m_completed;
+	stats.inlined = m_inlined;
+	stats.fullWaits = m_fullWaits;
+	stats.running = m_running;
+	stats.totalQueueUs = m_totalQueueUs;
+	stats.totalRunUs = m_totalRunUs;
+	stats.maxRunUs = m_maxRunUs;
+	return stats;
+}
+
+} // namespace shiosylar end
@@ -2,6 +2,17 @@
 #include "../include/logger.h"
 #include "../include/macro.h"
 #include "../include/hook.h"
+#include "../include/config.h"
+
+#include <algorithm>
+#include <set>
+#include <sstream>
+#include <errno.h>
+#include <execinfo.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
 
 namespace shiosylar
 {
@@ -12,13 +23,179 @@ static shiosylar::Logger::ptr g_logger = LOG_NAME("system");
 static thread_local Scheduler* t_scheduler = nullptr;
 // 线程私有变量，调度器协程对象的指针
 static thread_local Fiber* t_scheduler_fiber = nullptr;
+// 线程私有变量，当前线程在t_scheduler中的工作线程编号，不在run中时为-1
+static thread_local int t_worker_index = -1;
+// 线程私有变量，当前线程是否正在执行idle协程，idle中提交的IO回调和定时任务走全局注入队列
+static thread_local bool t_worker_idle = false;
+
+// 全局注入队列的容量，每个优先级一个，槽位在构造调度器时一次性分配
+static ConfigVar<uint32_t>::ptr g_inject_queue_size =
+	Config::Lookup<uint32_t>("scheduler.inject_queue_size", 16384, "scheduler inject queue capacity");
+
+// 加权轮询时高、普通、低优先级的权重
+static ConfigVar<std::vector<uint32_t> >::ptr g_priority_weights =
+	Config::Lookup("scheduler.priority_weights", std::vector<uint32_t>{8, 4, 1},
+		"scheduler weighted round robin weights of high/normal/low priority");
+
+// 是否使用严格优先级，为true时只要高优先级有任务就不取低优先级
+static ConfigVar<bool>::ptr g_priority_strict =
+	Config::Lookup("scheduler.priority_strict", false, "scheduler strict priority dequeue");
+
+// 连续取出截止时间任务的上限，达到后先取一个优先级队列的任务，0为不限制
+static ConfigVar<uint32_t>::ptr g_deadline_burst =
+	Config::Lookup<uint32_t>("scheduler.deadline_burst", 16, "scheduler max consecutive deadline tasks before a priority task, 0 for strict EDF");
+
+// 空闲线程休眠前的自旋时间，单核机器上自旋没有意义，不自旋
+static ConfigVar<uint32_t>::ptr g_idle_spin_us =
+	Config::Lookup<uint32_t>("scheduler.idle_spin_us", 50, "scheduler idle spin time before park in us");
+
+// 各调度器工作线程绑定的cpu，以调度器名称为键，如 scheduler.cpus.io: [0, 1, 2, 3]
+static ConfigVar<std::map<std::string, std::vector<int> > >::ptr g_scheduler_cpus =
+	Config::Lookup("scheduler.cpus", std::map<std::string, std::vector<int> >(),
+		"scheduler worker cpu affinity by scheduler name");
+
+// 只由一个线程写入的计数，用relaxed的读改写代替原子加，读取方可能看到稍旧的值
+static inline void RelaxedAdd(std::atomic<uint64_t>& counter, uint64_t n)
+{
+	counter.store(counter.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+// 等待时间所在的直方图桶
+static inline size_t LatencyBucket(uint64_t us)
+{
+	size_t bucket = us ? 64 - __builtin_clzll(us) : 0;
+	return bucket < Scheduler::LATENCY_BUCKETS ? bucket : Scheduler::LATENCY_BUCKETS - 1;
+}
+
+// 各调度器的线程数上限，以调度器名称为键，含use_caller的创建者线程，大于构造时的线程数时启用伸缩
+static ConfigVar<std::map<std::string, uint32_t> >::ptr g_scheduler_max_threads =
+	Config::Lookup("scheduler.max_threads", std::map<std::string, uint32_t>(),
+		"scheduler max threads by scheduler name");
+
+// 各调度器的线程数下限，以调度器名称为键，缺省为构造时的线程数
+static ConfigVar<std::map<std::string, uint32_t> >::ptr g_scheduler_min_threads =
+	Config::Lookup("scheduler.min_threads", std::map<std::string, uint32_t>(),
+		"scheduler min threads by scheduler name");
+
+// 任务排队等待超过该时间且仍有积压时扩容一个线程
+static ConfigVar<uint32_t>::ptr g_grow_wait_us =
+	Config::Lookup<uint32_t>("scheduler.grow_wait_us", 2000, "scheduler grow when queue wait exceeds in us");
+
+// 工作线程连续休眠超过该时间后退出
+static ConfigVar<uint32_t>::ptr g_retire_idle_ms =
+	Config::Lookup<uint32_t>("scheduler.retire_idle_ms", 30000, "scheduler retire worker after idle in ms");
+
+// maybe_yield的时间片，任务连续运行超过该时间且有其他任务排队时让出
+static ConfigVar<uint32_t>::ptr g_time_slice_us =
+	Config::Lookup<uint32_t>("scheduler.time_slice_us", 10000, "scheduler maybe_yield time slice in us");
 
-Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
+// 任务连续运行超过该时间时看门狗打印协程id和调用栈，0为不启用看门狗
+static ConfigVar<uint32_t>::ptr g_watchdog_ms =
+	Config::Lookup<uint32_t>("scheduler.watchdog_ms", 0, "scheduler watchdog budget of a running task in ms, 0 to disable");
+
+// 看门狗获取调用栈用的信号，在第一个启用看门狗的调度器启动时安装，之后修改不生效
+static ConfigVar<int>::ptr g_watchdog_signal =
+	Config::Lookup<int>("scheduler.watchdog_signal", SIGURG, "signal used by the scheduler watchdog to capture worker backtraces");
+
+// 函数任务在共享栈协程中运行的调度器名称，适合大量长时间挂起的连接协程，见fiber.h
+static ConfigVar<std::set<std::string> >::ptr g_scheduler_shared_stack =
+	Config::Lookup("scheduler.shared_stack", std::set<std::string>(),
+		"names of schedulers running callback tasks on shared fiber stacks");
+
+// 安装的看门狗信号和安装前的处理方式，不是工作线程收到信号时(如TCP带外数据的SIGURG)转给原来的处理函数
+static int s_watchdog_signal = 0;
+static struct sigaction s_prev_action;
+
+// 两次扩容的最小间隔，等新线程分担了负载再判断是否继续扩容
+static const uint64_t GROW_INTERVAL_US = 10 * 1000;
+
+Scheduler::WorkerContext::WorkerContext()
+{
+	for(size_t i = 0; i < LATENCY_BUCKETS; ++i)
+		waitHistogram[i] = 0;
+	for(size_t i = 0; i < PRIORITY_COUNT; ++i)
+	{
+		size[i] = 0;
+		credits[i] = 0;
+		dequeued[i] = 0;
+		totalWaitUs[i] = 0;
+		maxWaitUs[i] = 0;
+	}
+}
+
+// 本地队列中的任务总数
+size_t Scheduler::WorkerContext::localSize() const
+{
+	size_t n = 0;
+	for(size_t i = 0; i < PRIORITY_COUNT; ++i)
+		n += size[i];
+	return n;
+}
+
+Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name
+					,const std::vector<int>& cpus)
 	:
+	m_cpus(cpus),
 	m_name(name)
 {
 	ASSERT(threads > 0);
 
+	std::vector<uint32_t> weights = g_priority_weights->getValue();
+	for(size_t i = 0; i < PRIORITY_COUNT; ++i)
+	{
+		m_injectQueues[i] = new MPMCQueue<FiberAndThread>(g_inject_queue_size->getValue());
+		m_globalCount[i] = 0;
+		m_depth[i] = 0;
+		m_weights[i] = i < weights.size() ? weights[i] : 1;
+	}
+	m_strictPriority = g_priority_strict->getValue();
+	m_deadlineBurst = g_deadline_burst->getValue();
+	m_idleSpinUs = sysconf(_SC_NPROCESSORS_ONLN) > 1 ? g_idle_spin_us->getValue() : 0;
+
+	if(m_cpus.empty())
+	{
+		auto conf = g_scheduler_cpus->getValue();
+		auto it = conf.find(m_name);
+		if(it != conf.end())
+			m_cpus = it->second;
+	}
+
+	// 伸缩的线程数范围，配置中含创建者线程，保存时不含
+	size_t offset = use_caller ? 1 : 0;
+	size_t max_threads = threads;
+	size_t min_threads = threads;
+	auto max_conf = g_scheduler_max_threads->getValue();
+	auto it = max_conf.find(m_name);
+	if(it != max_conf.end() && it->second > threads)
+		max_threads = it->second;
+	auto min_conf = g_scheduler_min_threads->getValue();
+	it = min_conf.find(m_name);
+	if(it != min_conf.end() && it->second < threads)
+		min_threads = it->second > offset ? it->second : offset + 1;
+	m_maxThreads = max_threads - offset;
+	m_minThreads = min_threads - offset;
+	m_growWaitUs = g_grow_wait_us->getValue();
+	m_retireIdleMs = g_retire_idle_ms->getValue();
+	m_timeSliceUs = g_time_slice_us->getValue();
+	m_watchdogUs = g_watchdog_ms->getValue() * 1000ull;
+	m_sharedStack = g_scheduler_shared_stack->getValue().count(m_name) > 0;
+
+	// 按上限为每个工作线程准备上下文，use_caller时0号为创建者线程，不绑定cpu
+	std::set<int> nodes;
+	for(size_t i = 0; i < max_threads; ++i)
+	{
+		WorkerContext* worker = new WorkerContext;
+		worker->index = i;
+		if(!m_cpus.empty() && i >= offset)
+		{
+			worker->cpu = m_cpus[(i - offset) % m_cpus.size()];
+			worker->numaNode = GetCpuNumaNode(worker->cpu);
+			nodes.insert(worker->numaNode);
+		}
+		m_workers.push_back(worker);
+	}
+	m_numaAware = nodes.size() > 1;
+
 	if(use_caller)
 	{
 		shiosylar::Fiber::GetThis(); // 创建主协程
@@ -28,12 +205,13 @@ Scheduler::Scheduler(size_t threads, bool use_caller, const std::string& name)
 		t_scheduler = this; // 调度器指针赋值
 
 		// 初始化调度协程
-		m_rootFiber.reset(new Fiber(std::bind(&Scheduler::run, this), 0, true));
+		m_rootFiber.reset(new Fiber(std::bind(&Scheduler::run, this, 0), 0, true));
 		shiosylar::Thread::SetName(m_name); // 设置线程名称和调度器相同的名称
 
 		t_scheduler_fiber = m_rootFiber.get();
 		m_rootThread = shiosylar::GetThreadId(); // 设置当前为主线程
 		m_threadIds.push_back(m_rootThread);
+		bindWorker(m_workers[0], m_rootThread);
 	}
 	else
 		m_rootThread = -1;
@@ -45,6 +223,11 @@ Scheduler::~Scheduler()
 	ASSERT(m_stopping); // 断言调度器已经停止
 	if(GetThis() == this)
 		t_scheduler = nullptr;
+
+	for(auto i : m_workers)
+		delete i;
+	for(size_t i = 0; i < PRIORITY_COUNT; ++i)
+		delete m_injectQueues[i];
 }
 
 // 获取调度器对象的指针
@@ -59,6 +242,12 @@ Fiber* Scheduler::GetMainFiber()
 	return t_scheduler_fiber;
 }
 
+// 当前线程在调度器中的工作线程编号
+int Scheduler::GetWorkerIndex()
+{
+	return t_worker_index;
+}
+
 // 开启调度器，m_rootFiber协程并不会自动运行run，在stop中才运行
 void Scheduler::start()
 {
@@ -68,14 +257,39 @@ void Scheduler::start()
 	m_stopping = false;
 	ASSERT(m_threads.empty());
 
-	m_threads.resize(m_threadCount);
+	m_threads.resize(m_maxThreads);
+	size_t offset = m_rootFiber ? 1 : 0; // use_caller时0号工作线程是创建者线程
 	for(size_t i = 0; i < m_threadCount; ++i)
 	{
-		m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this),
+		m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this, i + offset),
 							m_name + "_" + std::to_string(i)));
 		m_threadIds.push_back(m_threads[i]->getId());
+		bindWorker(m_workers[i + offset], m_threads[i]->getId());
 	}
 	lock.unlock();
+
+	if(m_watchdogUs > 0)
+	{
+		// 信号处理函数只安装一次，先调用一次backtrace加载其依赖库，信号处理函数中不再分配内存
+		static bool s_installed = []() {
+			void* frames[1];
+			backtrace(frames, 1);
+			int sig = g_watchdog_signal->getValue();
+			struct sigaction sa;
+			memset(&sa, 0, sizeof(sa));
+			sa.sa_sigaction = &Scheduler::WatchdogSignalHandler;
+			sa.sa_flags = SA_RESTART | SA_SIGINFO;
+			sigemptyset(&sa.sa_mask);
+			if(sigaction(sig, &sa, &s_prev_action) != 0)
+				return false;
+			s_watchdog_signal = sig;
+			return true;
+		}();
+		if(!s_installed)
+			LOG_ERROR(g_logger) << m_name << " install watchdog signal handler error";
+		m_watchdogStop = 0;
+		m_watchdog.reset(new Thread(std::bind(&Scheduler::watchdog, this), m_name + "_watchdog"));
+	}
 }
 
 // 停止调度器
@@ -128,7 +342,27 @@ void Scheduler::stop()
 	}
 
 	for(auto& i : thrs)
-		i->join();
+	{
+		if(i)
+			i->join();
+	}
+
+	if(m_watchdog)
+	{
+		m_watchdogStop = 1;
+		FutexWake(&m_watchdogStop, 1);
+		m_watchdog->join();
+		m_watchdog.reset();
+	}
+}
+
+// 记录工作线程id和上下文的对应关系
+void Scheduler::bindWorker(WorkerContext* worker, int thread)
+{
+	RWMutex::WriteLock lock(m_workerMutex);
+	worker->threadId = thread;
+	worker->active = true;
+	m_threadWorkers[thread] = worker;
 }
 
 // 设置当前线程的调度器指针
@@ -138,7 +372,7 @@ void Scheduler::setThis()
 }
 
 // 线程入口函数，不断从任务队列取任务执行
-void Scheduler::run()
+void Scheduler::run(size_t index)
 {
 	LOG_DEBUG(g_logger) << m_name << " run";
 
@@ -150,6 +384,25 @@ void Scheduler::run()
 	if(shiosylar::GetThreadId() != m_rootThread)
 		t_scheduler_fiber = Fiber::GetThis().get();
 
+	WorkerContext* worker = m_workers[index];
+	t_worker_index = index;
+	{
+		RWMutex::WriteLock lock(m_workerMutex);
+		worker->pthread = pthread_self();
+	}
+
+	// 绑定cpu，之后分配的协程栈在本地NUMA节点上
+	if(worker->cpu >= 0)
+	{
+		cpu_set_t mask;
+		CPU_ZERO(&mask);
+		CPU_SET(worker->cpu, &mask);
+		int rt = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+		if(rt)
+			LOG_ERROR(g_logger) << m_name << " worker=" << index << " bind cpu="
+				<< worker->cpu << " error rt=" << rt << " " << strerror(rt);
+	}
+
 	// 如果没有任务则执行这个协程进行忙等待
 	Fiber::ptr idle_fiber(new Fiber(std::bind(&Scheduler::idle, this)));
 	Fiber::ptr cb_fiber; // 用来存储任务函数
@@ -159,53 +412,31 @@ void Scheduler::run()
 	{
 		ft.reset();
 		bool tickle_me = false;
-		bool is_active = false;
-		{
-			MutexType::Lock lock(m_mutex);
-			auto it = m_fibers.begin();
-			while(it != m_fibers.end())
-			{
-				// 如果该任务设置了必须特定线程执行，则跳过它
-				if(it->thread != -1 && it->thread != shiosylar::GetThreadId())
-				{
-					++it;
-					tickle_me = true;
-					continue;
-				}
-				ASSERT(it->fiber || it->cb); // 要么时协程任务，要么函数任务
-
-				// 如果该协程任务正在被执行则跳过它
-				if(it->fiber && it->fiber->getState() == Fiber::EXEC)
-				{
-					++it;
-					continue;
-				}
-
-				ft = *it;
-				m_fibers.erase(it++); // 取出任务，从任务列表中删除
-
-				// 一取出就使活跃线程数加一，防止此时任务队列为空，活跃数也为0
-				// 导致stopping返回true，此时还有任务运行，不能返回true，如idle()
-				++m_activeThreadCount;
-				is_active = true; // 标识成功取到任务
-				break;
-			}
-			tickle_me |= it != m_fibers.end(); // 设置是否唤醒其他线程
-		}
+
+		// 取到任务时活跃线程数已经加一，防止此时任务队列为空，活跃数也为0
+		// 导致stopping返回true，此时还有任务运行，不能返回true，如idle()
+		bool is_active = nextTask(worker, ft, tickle_me);
 
 		if(tickle_me)
 			tickle();
 
+		Priority priority = ft.priority; // 重新入队时保持原优先级
+
 		// 如果任务是协程，则判断协程不在结束态和异常态
 		if(ft.fiber && (ft.fiber->getState() != Fiber::TERM
 						&& ft.fiber->getState() != Fiber::EXCEPT))
 		{
+			RelaxedAdd(worker->switches, 1);
+			worker->runFiberId.store(ft.fiber->getId(), std::memory_order_relaxed);
+			worker->runStartUs.store(worker->dequeueUs, std::memory_order_release);
+			worker->sliceStartUs = worker->dequeueUs;
 			ft.fiber->swapIn(); // 切入该协程，运行任务
+			worker->runStartUs.store(0, std::memory_order_relaxed);
 			--m_activeThreadCount; // 这里切回来了，工作结束了，工作线程数减一
 
-			// 如果该协程处于就绪态，则需要重新插入到任务队列
+			// 如果该协程处于就绪态，则需要重新插入到任务队列，指针移入队列，不改变引用计数
 			if(ft.fiber->getState() == Fiber::READY)
-				schedule(ft.fiber);
+				schedule(std::move(ft.fiber), -1, priority);
 			else if(ft.fiber->getState() != Fiber::TERM
 					&& ft.fiber->getState() != Fiber::EXCEPT)
 			{
@@ -216,17 +447,21 @@ void Scheduler::run()
 		else if(ft.cb) // 如果任务是一个函数，则通过该函数创建一个协程来执行它
 		{
 			if(cb_fiber)
-				cb_fiber->reset(ft.cb); // cb_fiber已创建，传入函数并运行
+				cb_fiber->reset(std::move(ft.cb)); // cb_fiber已创建，传入函数并运行
 			else // 未创建，则通过这个函数创建cb_fiber对象
-				cb_fiber.reset(new Fiber(ft.cb));
+				cb_fiber.reset(new Fiber(std::move(ft.cb), 0, false, m_sharedStack));
 			ft.reset();
+			RelaxedAdd(worker->switches, 1);
+			worker->runFiberId.store(cb_fiber->getId(), std::memory_order_relaxed);
+			worker->runStartUs.store(worker->dequeueUs, std::memory_order_release);
+			worker->sliceStartUs = worker->dequeueUs;
 			cb_fiber->swapIn(); // 切入到函数协程，运行它
+			worker->runStartUs.store(0, std::memory_order_relaxed);
 			--m_activeThreadCount; // 切换回来，工作线程数减一
 			if(cb_fiber->getState() == Fiber::READY) // 为就绪态，则重新插入任务队列
 			{
-				schedule(cb_fiber);
-				// 任务未完成，cb_fiber所指的对象要保护起来，不能再使用了，要重新创建
-				cb_fiber.reset();
+				// 任务未完成，cb_fiber所指的对象移入队列，不能再使用了，要重新创建
+				schedule(std::move(cb_fiber), -1, priority);
 			}
 			else if(cb_fiber->getState() == Fiber::EXCEPT
 					|| cb_fiber->getState() == Fiber::TERM)
@@ -247,6 +482,11 @@ void Scheduler::run()
 				--m_activeThreadCount;
 				continue;
 			}
+
+			// 收件箱或本地队列里只剩还没从其他线程切出的协程，它们很快就能执行，不进入idle
+			if(worker->inboxSize > 0 || worker->localSize() > 0)
+				continue;
+
 			if(idle_fiber->getState() == Fiber::TERM)
 			{
 				LOG_INFO(g_logger) << "idle fiber term";
@@ -254,38 +494,806 @@ void Scheduler::run()
 			}
 
 			++m_idleThreadCount;
+			t_worker_idle = true;
+			uint64_t idle_start = shiosylar::GetCurrentUS();
+			worker->idleSinceUs.store(idle_start, std::memory_order_relaxed);
+			RelaxedAdd(worker->switches, 1);
 			idle_fiber->swapIn();
+			worker->idleSinceUs.store(0, std::memory_order_relaxed);
+			RelaxedAdd(worker->idleUs, shiosylar::GetCurrentUS() - idle_start);
+			t_worker_idle = false;
 			--m_idleThreadCount;
-			if(idle_fiber->getState() != Fiber::TERM
-					&& idle_fiber->getState() != Fiber::EXCEPT)
+			// idle结束表示调度器已停止或本线程空闲超时退出，都不再取任务
+			if(idle_fiber->getState() == Fiber::TERM)
 			{
+				LOG_INFO(g_logger) << "idle fiber term";
+				break;
+			}
+			if(idle_fiber->getState() != Fiber::EXCEPT)
 				idle_fiber->m_state = Fiber::HOLD;
+		}
+	}
+	// 线程退出前清除句柄，看门狗之后不会再向它发信号
+	{
+		RWMutex::WriteLock lock(m_workerMutex);
+		worker->pthread = 0;
+	}
+	t_worker_index = -1;
+}
+
+// 将任务插入收件箱、本地队列或全局队列，返回是否需要通知其他线程
+bool Scheduler::enqueue(FiberAndThread& ft)
+{
+	size_t priority = ft.priority;
+	ASSERT(priority < PRIORITY_COUNT);
+	ft.enqueueUs = shiosylar::GetCurrentUS();
+	++m_depth[priority];
+
+	// 共享栈协程的栈内容只能在绑定的线程上换回，总是投递到该线程
+	bool stack_bound = ft.fiber && ft.fiber->getStackThread() != -1;
+	if(stack_bound)
+		ft.thread = ft.fiber->getStackThread();
+
+	// 指定线程的任务放入该线程的收件箱，只通知该线程
+	if(ft.thread != -1)
+	{
+		WorkerContext* target = nullptr;
+		if(t_scheduler == this && t_worker_index >= 0
+				&& m_workers[t_worker_index]->threadId == ft.thread)
+			target = m_workers[t_worker_index];
+		else
+		{
+			RWMutex::ReadLock lock(m_workerMutex);
+			auto it = m_threadWorkers.find(ft.thread);
+			if(it != m_threadWorkers.end())
+				target = it->second;
+		}
+
+		// 目标线程已经空闲退出时按未知线程处理
+		bool delivered = false;
+		if(target)
+		{
+			MutexType::Lock lock(target->inboxMutex);
+			if(target->active)
+			{
+				target->inbox.push_back(std::move(ft));
+				++target->inboxSize;
+				delivered = true;
+			}
+		}
+		if(delivered)
+		{
+			// 投递给自己时本线程稍后就会取到，无需唤醒
+			if(target->index != (size_t)t_worker_index || t_scheduler != this)
+				tickleWorker(target->index);
+			return false;
+		}
+
+		// 绑定的线程不是本调度器的工作线程，在其他线程上切入会破坏共享栈，只能交回原来的调度器
+		ASSERT2(!stack_bound, m_name << " cannot run shared-stack fiber id=" << ft.fiber->getId()
+			<< " bound to thread=" << ft.thread << ", which is not one of its workers;"
+			<< " schedule it on the scheduler that first ran it");
+		LOG_ERROR(g_logger) << m_name << " schedule to unknown thread=" << ft.thread
+			<< ", run it on any thread";
+		ft.thread = -1;
+	}
+
+	// 工作线程上的任务产生的无指定线程任务，放入本地队列
+	if(t_scheduler == this && t_worker_index >= 0 && !t_worker_idle)
+	{
+		WorkerContext* worker = m_workers[t_worker_index];
+		{
+			MutexType::Lock lock(worker->mutex);
+			worker->tasks[priority].push_back(std::move(ft));
+			++worker->size[priority];
+		}
+		return hasIdleThreads(); // 有空闲线程则通知其来偷取
+	}
+
+	// 其他线程、IO回调和定时器提交的任务，无锁写入注入队列
+	MPMCQueue<FiberAndThread>* queue = m_injectQueues[priority];
+	bool need_tickle = queue->size() == 0;
+	if(queue->push(ft))
+		return need_tickle;
+	LOG_WARN(g_logger) << m_name << " inject queue full, capacity="
+		<< queue->capacity() << " priority=" << priority;
+
+	MutexType::Lock lock(m_mutex);
+	need_tickle = m_fibers[priority].empty();
+	m_fibers[priority].push_back(std::move(ft));
+	++m_globalCount[priority];
+	return need_tickle;
+}
+
+// 批量发布任务，一次加锁放入本地队列
+size_t Scheduler::scheduleBatch(std::vector<FiberAndThread>& batch)
+{
+	size_t published = 0;
+	if(t_scheduler == this && t_worker_index >= 0)
+	{
+		WorkerContext* worker = m_workers[t_worker_index];
+		uint64_t now = shiosylar::GetCurrentUS();
+		MutexType::Lock lock(worker->mutex);
+		for(auto& ft : batch)
+		{
+			if(ft.thread != -1 || !(ft.fiber || ft.cb)
+					|| (ft.fiber && ft.fiber->getStackThread() != -1))
+				continue;
+			size_t priority = ft.priority;
+			ASSERT(priority < PRIORITY_COUNT);
+			ft.enqueueUs = now;
+			++m_depth[priority];
+			worker->tasks[priority].push_back(std::move(ft));
+			++worker->size[priority];
+			ft.reset();
+			++published;
+		}
+	}
+
+	// 指定线程的任务和不在工作线程中发布的任务逐个插入
+	bool need_tickle = false;
+	for(auto& ft : batch)
+	{
+		if(ft.fiber || ft.cb)
+			need_tickle = enqueue(ft) || need_tickle;
+	}
+	batch.clear();
+	if(need_tickle)
+		tickle();
+	return published;
+}
+
+// 先取收件箱，再按优先级策略选出队列，依次从本地队列、全局队列、其他线程的本地队列中取任务
+bool Scheduler::nextTask(WorkerContext* worker, FiberAndThread& ft, bool& tickle_me)
+{
+	if(pendingTasks() == 0) // 所有队列都为空，空闲时不必逐个探测
+		return false;
+
+	// 指定本线程的任务只能由本线程执行，优先处理
+	// 刚在maybe_yield中让出的任务是共享栈协程时回到了收件箱，这次先取其他队列，否则它会立即再次执行
+	bool yielded = worker->yielded;
+	if(!yielded && popInbox(worker, ft, tickle_me))
+		return true;
+
+	// 截止时间任务按最早截止时间优先，先于普通的优先级队列
+	// 连续取出的个数到达上限后先取优先级队列，取不到时再回来取截止时间任务
+	bool deadline_first = m_deadlineBurst == 0 || worker->deadlineRun < m_deadlineBurst;
+	if(deadline_first && popDeadline(worker, ft))
+	{
+		++worker->deadlineRun;
+		return true;
+	}
+
+	size_t first = pickPriority(worker);
+	bool found = popPriority(worker, first, ft, tickle_me);
+
+	// 选中的优先级没取到任务(被其他线程取走或只剩其他线程的收件箱任务)，按优先级高低再试
+	for(size_t i = 0; !found && i < PRIORITY_COUNT; ++i)
+		found = i != first && popPriority(worker, i, ft, tickle_me);
+	if(found)
+	{
+		worker->deadlineRun = 0;
+		return true;
+	}
+
+	if(!deadline_first && popDeadline(worker, ft))
+		return true;
+	return yielded && popInbox(worker, ft, tickle_me);
+}
+
+// 按严格优先级或加权轮询选出本次优先出队的优先级
+size_t Scheduler::pickPriority(WorkerContext* worker)
+{
+	if(!m_strictPriority)
+	{
+		// 每轮每个优先级最多出队权重个任务，有任务的优先级额度都用完后开始新一轮
+		for(int round = 0; round < 2; ++round)
+		{
+			for(size_t i = 0; i < PRIORITY_COUNT; ++i)
+			{
+				if(worker->credits[i] > 0 && m_depth[i] > 0)
+					return i;
+			}
+			for(size_t i = 0; i < PRIORITY_COUNT; ++i)
+				worker->credits[i] = m_weights[i];
+		}
+	}
+
+	for(size_t i = 0; i < PRIORITY_COUNT; ++i)
+	{
+		if(m_depth[i] > 0)
+			return i;
+	}
+	return NORMAL;
+}
+
+// 从某个优先级的各个队列中取任务
+bool Scheduler::popPriority(WorkerContext* worker, size_t priority, FiberAndThread& ft, bool& tickle_me)
+{
+	if(m_depth[priority] == 0)
+		return false;
+
+	// 每隔61次优先检查一次全局队列，防止外部提交的任务被本地任务饿死
+	// 时间片用完让出的任务排在本地队列，也先看全局队列，否则外部任务仍要等它多跑几十个时间片
+	bool global_first = ++worker->tick % 61 == 0 || worker->yielded;
+	worker->yielded = false;
+	if(global_first && popGlobal(worker, priority, ft, tickle_me))
+		return true;
+
+	return popLocal(worker, priority, ft, tickle_me)
+			|| popGlobal(worker, priority, ft, tickle_me)
+			|| steal(worker, priority, ft, tickle_me);
+}
+
+// 排队数先于入堆增加，stopping不会在任务入堆前看到队列为空
+void Scheduler::scheduleDeadline(Task cb, uint64_t deadline_us, Task on_shed)
+{
+	++m_deadlineScheduled;
+	uint64_t now = shiosylar::GetCurrentUS();
+	if(now >= deadline_us)
+	{
+		++m_deadlineShed;
+		if(on_shed)
+			schedule(std::move(on_shed));
+		return;
+	}
+
+	// 任务执行完后记录完成时间，执行中挂起也在真正结束时才记录
+	struct Runner
+	{
+		Scheduler* scheduler;
+		uint64_t deadlineUs;
+		Task cb;
+
+		void operator()()
+		{
+			try
+			{
+				cb();
+			}
+			catch(...)
+			{
+				scheduler->onDeadlineDone(deadlineUs);
+				throw;
+			}
+			scheduler->onDeadlineDone(deadlineUs);
+		}
+	};
+
+	DeadlineTask task;
+	task.deadlineUs = deadline_us;
+	task.ft = FiberAndThread(Task(Runner{this, deadline_us, std::move(cb)}), -1);
+	task.ft.priority = HIGH;
+	task.ft.enqueueUs = now;
+	task.onShed = std::move(on_shed);
+	++m_depth[HIGH];
+	{
+		Spinlock::Lock lock(m_deadlineMutex);
+		task.seq = m_deadlineSeq++;
+		m_deadlineHeap.push_back(std::move(task));
+		std::push_heap(m_deadlineHeap.begin(), m_deadlineHeap.end());
+		++m_deadlineCount;
+	}
+	tickle();
+}
+
+// 截止时间任务按高优先级统计排队数和等待时间
+bool Scheduler::popDeadline(WorkerContext* worker, FiberAndThread& ft)
+{
+	if(m_deadlineCount == 0)
+		return false;
+
+	while(true)
+	{
+		DeadlineTask task;
+		{
+			Spinlock::Lock lock(m_deadlineMutex);
+			if(m_deadlineHeap.empty())
+				return false;
+			std::pop_heap(m_deadlineHeap.begin(), m_deadlineHeap.end());
+			task = std::move(m_deadlineHeap.back());
+			m_deadlineHeap.pop_back();
+			--m_deadlineCount;
+		}
+
+		if(shiosylar::GetCurrentUS() < task.deadlineUs)
+		{
+			ft = std::move(task.ft);
+			onDequeue(worker, ft);
+			return true;
+		}
+
+		// 已经超时，执行它也赶不上截止时间，只执行丢弃回调，让出线程给还来得及的任务
+		++m_deadlineShed;
+		if(task.onShed)
+		{
+			ft.cb = std::move(task.onShed);
+			ft.thread = -1;
+			ft.priority = HIGH;
+			ft.enqueueUs = task.ft.enqueueUs;
+			onDequeue(worker, ft);
+			return true;
+		}
+		--m_depth[HIGH];
+	}
+}
+
+// 截止时间任务执行完成，记录是否按时
+void Scheduler::onDeadlineDone(uint64_t deadline_us)
+{
+	++m_deadlineCompleted;
+	if(shiosylar::GetCurrentUS() <= deadline_us)
+		++m_deadlineOnTime;
+}
+
+// 获取截止时间任务的统计
+Scheduler::DeadlineStats Scheduler::getDeadlineStats()
+{
+	DeadlineStats stats;
+	stats.scheduled = m_deadlineScheduled;
+	stats.onTime = m_deadlineOnTime; // 先读按时数，保证不大于完成数
+	stats.completed = m_deadlineCompleted;
+	stats.late = stats.completed - stats.onTime;
+	stats.shed = m_deadlineShed;
+	stats.depth = m_deadlineCount;
+	return stats;
+}
+
+// 从收件箱队首取任务
+bool Scheduler::popInbox(WorkerContext* worker, FiberAndThread& ft, bool& tickle_me)
+{
+	if(worker->inboxSize == 0)
+		return false;
+
+	MutexType::Lock lock(worker->inboxMutex);
+	for(size_t n = worker->inbox.size(); n > 0; --n)
+	{
+		FiberAndThread& front = worker->inbox.front();
+
+		// 协程还没有从其他线程切出，放到队尾稍后再取
+		if(front.fiber && front.fiber->getState() == Fiber::EXEC)
+		{
+			worker->inbox.push_back(std::move(front));
+			worker->inbox.pop_front();
+			tickle_me = true;
+			continue;
+		}
+
+		ft = std::move(front);
+		worker->inbox.pop_front();
+		--worker->inboxSize;
+		onDequeue(worker, ft);
+		return true;
+	}
+	return false;
+}
+
+// 从本地队列队首取任务
+bool Scheduler::popLocal(WorkerContext* worker, size_t priority, FiberAndThread& ft, bool& tickle_me)
+{
+	if(worker->size[priority] == 0)
+		return false;
+
+	std::deque<FiberAndThread>& tasks = worker->tasks[priority];
+	MutexType::Lock lock(worker->mutex);
+	for(size_t n = tasks.size(); n > 0; --n)
+	{
+		FiberAndThread& front = tasks.front();
+		ASSERT(front.fiber || front.cb); // 要么时协程任务，要么函数任务
+
+		// 如果该协程任务正在被执行(还没切出)，则放到队尾稍后再取
+		if(front.fiber && front.fiber->getState() == Fiber::EXEC)
+		{
+			tasks.push_back(std::move(front));
+			tasks.pop_front();
+			tickle_me = true;
+			continue;
+		}
+
+		ft = std::move(front);
+		tasks.pop_front();
+		--worker->size[priority];
+		onDequeue(worker, ft);
+		tickle_me |= !tasks.empty();
+		return true;
+	}
+	return false;
+}
+
+// 从全局注入队列和全局溢出队列取任务
+bool Scheduler::popGlobal(WorkerContext* worker, size_t priority, FiberAndThread& ft, bool& tickle_me)
+{
+	MPMCQueue<FiberAndThread>* queue = m_injectQueues[priority];
+	if(queue->pop(ft))
+	{
+		tickle_me |= queue->size() > 0;
+		if(deferRunning(worker, ft, tickle_me))
+			return false;
+		onDequeue(worker, ft);
+		return true;
+	}
+
+	if(m_globalCount[priority] == 0)
+		return false;
+
+	MutexType::Lock lock(m_mutex);
+	std::list<FiberAndThread>& fibers = m_fibers[priority];
+	if(fibers.empty())
+		return false;
+
+	ft = std::move(fibers.front());
+	fibers.pop_front();
+	--m_globalCount[priority];
+	tickle_me |= !fibers.empty(); // 设置是否唤醒其他线程
+	lock.unlock();
+	if(deferRunning(worker, ft, tickle_me))
+		return false;
+	onDequeue(worker, ft);
+	return true;
+}
+
+// 从其他工作线程的本地队列偷取一半任务，第一个直接执行，其余放入自己的本地队列
+bool Scheduler::steal(WorkerContext* thief, size_t priority, FiberAndThread& ft, bool& tickle_me)
+{
+	// 工作线程分布在多个NUMA节点上时，第一轮只偷同节点的，第二轮再偷其它节点的
+	size_t count = m_workers.size();
+	size_t rounds = m_numaAware && thief->numaNode >= 0 ? 2 : 1;
+	for(size_t i = 0; i < count * rounds; ++i)
+	{
+		WorkerContext* victim = m_workers[(thief->index + thief->tick + i) % count];
+		if(victim == thief || victim->size[priority] == 0)
+			continue;
+		if(rounds == 2 && (victim->numaNode == thief->numaNode) != (i < count))
+			continue;
+
+		// 不同时持有两把锁，避免两个线程互相偷取时死锁
+		{
+			MutexType::Lock lock(victim->mutex);
+			std::deque<FiberAndThread>& tasks = victim->tasks[priority];
+			size_t n = (tasks.size() + 1) / 2;
+			for(size_t j = 0; j < n; ++j)
+			{
+				thief->stolen.push_back(std::move(tasks.front()));
+				tasks.pop_front();
 			}
+			victim->size[priority] -= n;
+		}
+		if(thief->stolen.empty())
+			continue;
+		RelaxedAdd(thief->steals, 1);
+		RelaxedAdd(thief->stolenTasks, thief->stolen.size());
+
+		auto it = thief->stolen.begin();
+		ft = std::move(*it);
+		if(++it != thief->stolen.end())
+		{
+			MutexType::Lock lock(thief->mutex);
+			for(; it != thief->stolen.end(); ++it)
+				thief->tasks[priority].push_back(std::move(*it));
+			thief->size[priority] += thief->stolen.size() - 1;
+			tickle_me = true;
 		}
+		thief->stolen.clear();
+		if(deferRunning(thief, ft, tickle_me))
+			return false;
+		onDequeue(thief, ft);
+		return true;
 	}
+	return false;
+}
+
+// 取到的协程还没有切出时，放回本地队列稍后再执行，返回是否放回
+// 任务一直留在队列中，排队数不变
+bool Scheduler::deferRunning(WorkerContext* worker, FiberAndThread& ft, bool& tickle_me)
+{
+	if(!ft.fiber || ft.fiber->getState() != Fiber::EXEC)
+		return false;
+
+	size_t priority = ft.priority;
+	{
+		MutexType::Lock lock(worker->mutex);
+		worker->tasks[priority].push_back(std::move(ft));
+		++worker->size[priority];
+	}
+	ft.reset();
+	tickle_me = true;
+	return true;
+}
+
+// 任务出队后的计数，活跃数先加一再减排队数，stopping不会看到两者同时为0
+void Scheduler::onDequeue(WorkerContext* worker, FiberAndThread& ft)
+{
+	size_t priority = ft.priority;
+	++m_activeThreadCount;
+	--m_depth[priority];
+
+	// 统计只由本线程写入
+	uint64_t now = shiosylar::GetCurrentUS();
+	worker->dequeueUs = now; // 也作为任务开始运行的时间，不再读一次时钟
+	uint64_t wait = now > ft.enqueueUs ? now - ft.enqueueUs : 0;
+	RelaxedAdd(worker->dequeued[priority], 1);
+	RelaxedAdd(worker->totalWaitUs[priority], wait);
+	RelaxedAdd(worker->waitHistogram[LatencyBucket(wait)], 1);
+	if(wait > worker->maxWaitUs[priority].load(std::memory_order_relaxed))
+		worker->maxWaitUs[priority].store(wait, std::memory_order_relaxed);
+
+	if(worker->credits[priority] > 0)
+		--worker->credits[priority];
+
+	// 排队过久且出队后仍有积压，现有线程处理不过来
+	if(UNLIKELY(wait > m_growWaitUs) && m_threadCount < m_maxThreads && pendingTasks() > 0)
+		grow();
+}
+
+// 所有队列中待执行的任务总数
+size_t Scheduler::pendingTasks() const
+{
+	size_t n = 0;
+	for(size_t i = 0; i < PRIORITY_COUNT; ++i)
+		n += m_depth[i];
+	return n;
 }
 
+// 唤醒一个休眠的工作线程，没有休眠的线程时不做系统调用
 void Scheduler::tickle()
 {
-	LOG_INFO(g_logger) << "tickle";
+	// 与park中的屏障配对，任务已经入队，要么这里看到休眠的线程，要么休眠前的检查看到任务
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(m_parkedCount == 0)
+		return;
+
+	int index = popParked();
+	if(index >= 0)
+		unpark(m_workers[index]);
+}
+
+// 只唤醒指定的工作线程，它没有休眠时会在下一轮取任务时看到收件箱
+void Scheduler::tickleWorker(size_t index)
+{
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(m_parkedCount == 0)
+		return;
+
+	if(removeParked(index))
+		unpark(m_workers[index]);
+}
+
+// 登记休眠的工作线程
+void Scheduler::pushParked(size_t index)
+{
+	MutexType::Lock lock(m_parkMutex);
+	m_parkedWorkers.push_back(index);
+	++m_parkedCount;
+}
+
+// 把指定的工作线程移出休眠栈
+bool Scheduler::removeParked(size_t index)
+{
+	MutexType::Lock lock(m_parkMutex);
+	auto it = std::find(m_parkedWorkers.begin(), m_parkedWorkers.end(), index);
+	if(it == m_parkedWorkers.end())
+		return false;
+	m_parkedWorkers.erase(it);
+	--m_parkedCount;
+	return true;
+}
+
+// 取出最近休眠的工作线程
+int Scheduler::popParked()
+{
+	MutexType::Lock lock(m_parkMutex);
+	if(m_parkedWorkers.empty())
+		return -1;
+	size_t index = m_parkedWorkers.back();
+	m_parkedWorkers.pop_back();
+	--m_parkedCount;
+	return index;
+}
+
+// 取出全部休眠的工作线程
+void Scheduler::takeParked(std::vector<size_t>& indexes)
+{
+	MutexType::Lock lock(m_parkMutex);
+	indexes.swap(m_parkedWorkers);
+	m_parkedWorkers.clear();
+	m_parkedCount = 0;
 }
 
 bool Scheduler::stopping()
 {
-	MutexType::Lock lock(m_mutex);
 	return m_autoStop 
 			&& m_stopping
-			&& m_fibers.empty()
+			&& pendingTasks() == 0
 			&& m_activeThreadCount == 0;
 }
 
 void Scheduler::idle()
 {
 	LOG_INFO(g_logger) << "idle";
+	WorkerContext* worker = m_workers[t_worker_index];
 	while(!stopping())
+	{
+		if(park(worker))
+			return; // 空闲超时退出
 		shiosylar::Fiber::YieldToHold();
+	}
+	// 最后一个任务结束时其他线程可能已经休眠，唤醒它们检查停止条件
+	unparkAll();
+}
+
+// 是否有该工作线程能取到的任务
+bool Scheduler::hasWork(size_t index)
+{
+	if(pendingTasks() == 0)
+		return false;
+	if(m_workers[index]->inboxSize > 0 || m_deadlineCount > 0)
+		return true;
+	for(size_t i = 0; i < PRIORITY_COUNT; ++i)
+	{
+		if(m_injectQueues[i]->size() > 0 || m_globalCount[i] > 0)
+			return true;
+	}
+	for(auto w : m_workers)
+	{
+		if(w->localSize() > 0)
+			return true;
+	}
+	return false;
+}
+
+// 先自旋等待任务，超时后在futex上休眠
+bool Scheduler::park(WorkerContext* worker)
+{
+	// 自旋阶段，很快到来的任务不必经过休眠和唤醒的系统调用
+	if(m_idleSpinUs > 0)
+	{
+		uint64_t deadline = shiosylar::GetCurrentUS() + m_idleSpinUs;
+		do
+		{
+			for(int i = 0; i < 32; ++i)
+				CpuRelax();
+			if(hasWork(worker->index) || stopping())
+				return false;
+		} while(shiosylar::GetCurrentUS() < deadline);
+	}
+
+	// 先登记为休眠，再检查一次任务，避免在检查和休眠之间到来的任务丢失唤醒
+	worker->parked = 1;
+	pushParked(worker->index);
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if(hasWork(worker->index) || stopping())
+	{
+		if(removeParked(worker->index))
+			worker->parked = 0;
+		// 已被其他线程取出栈的，等它唤醒，很快就会返回
+	}
+
+	// 可以退出的线程限时休眠，超时仍在休眠栈中则移出并退出，已被取出的等待唤醒
+	uint64_t retire_ms = getRetireIdleMs(worker->index);
+	uint64_t deadline = shiosylar::GetCurrentUS() + retire_ms * 1000;
+	while(worker->parked == 1)
+	{
+		uint64_t now = shiosylar::GetCurrentUS();
+		if(retire_ms == 0)
+			FutexWait(&worker->parked, 1);
+		else if(now < deadline)
+		{
+			struct timespec timeout;
+			timeout.tv_sec = (deadline - now) / 1000000;
+			timeout.tv_nsec = (deadline - now) % 1000000 * 1000;
+			FutexWait(&worker->parked, 1, &timeout);
+		}
+		else
+		{
+			if(removeParked(worker->index))
+			{
+				worker->parked = 0;
+				return retireWorker(worker->index);
+			}
+			retire_ms = 0;
+		}
+	}
+	return false;
+}
+
+// 工作线程休眠多久后可以退出
+uint64_t Scheduler::getRetireIdleMs(size_t index) const
+{
+	size_t offset = m_rootFiber ? 1 : 0;
+	if(m_maxThreads == m_minThreads || index < offset || m_threadCount <= m_minThreads)
+		return 0;
+	return m_retireIdleMs;
+}
+
+// 空闲超时的工作线程退出，至少保留一个创建的线程，只能由它执行的任务为空时才退出
+bool Scheduler::retireWorker(size_t index)
+{
+	WorkerContext* worker = m_workers[index];
+	size_t threads = 0;
+	{
+		MutexType::Lock lock(m_mutex);
+		if(m_stopping || m_threadCount <= m_minThreads || m_threadCount <= 1)
+			return false;
+		// 绑定了本线程共享栈的协程只能在本线程上继续运行
+		if(Fiber::SharedStackFibers() > 0)
+			return false;
+		{
+			MutexType::Lock inbox_lock(worker->inboxMutex);
+			if(worker->inboxSize > 0 || worker->localSize() > 0)
+				return false;
+			worker->active = false; // 之后投递给该线程的任务改为任意线程执行
+		}
+		int thread = worker->threadId;
+		{
+			RWMutex::WriteLock worker_lock(m_workerMutex);
+			m_threadWorkers.erase(thread);
+			worker->threadId = -1;
+		}
+		m_threadIds.erase(std::remove(m_threadIds.begin(), m_threadIds.end(), thread), m_threadIds.end());
+		threads = --m_threadCount;
+	}
+	LOG_INFO(g_logger) << m_name << " worker=" << index << " retired after idle, threads=" << threads;
+
+	// 最后一次检查之后到来的任务交给其他线程
+	if(pendingTasks() > 0)
+		tickle();
+	return true;
 }
 
+// 扩容一个线程，复用已退出线程的上下文，两次扩容至少间隔GROW_INTERVAL_US
+void Scheduler::grow()
+{
+	uint64_t now = shiosylar::GetCurrentUS();
+	if(now < m_lastGrowUs + GROW_INTERVAL_US || m_growing.exchange(true))
+		return;
+
+	size_t threads = 0;
+	size_t index = 0;
+	{
+		MutexType::Lock lock(m_mutex);
+		size_t offset = m_rootFiber ? 1 : 0;
+		for(size_t i = 0; i < m_threads.size() && !m_stopping && m_threadCount < m_maxThreads; ++i)
+		{
+			WorkerContext* worker = m_workers[i + offset];
+			if(worker->active)
+				continue;
+
+			// 该上下文上次的线程已经退出了run，回收后再复用
+			if(m_threads[i])
+				m_threads[i]->join();
+			m_threads[i].reset(new Thread(std::bind(&Scheduler::run, this, i + offset),
+								m_name + "_" + std::to_string(i)));
+			m_threadIds.push_back(m_threads[i]->getId());
+			bindWorker(worker, m_threads[i]->getId());
+			threads = ++m_threadCount;
+			index = i + offset;
+			m_lastGrowUs = now;
+			break;
+		}
+	}
+	m_growing = false;
+	if(threads)
+		LOG_INFO(g_logger) << m_name << " worker=" << index << " started for queue wait, threads=" << threads;
+}
+
+// 唤醒休眠的工作线程，调用前已经将其移出休眠栈
+void Scheduler::unpark(WorkerContext* worker)
+{
+	worker->parked = 0;
+	FutexWake(&worker->parked, 1);
+}
+
+// 唤醒所有休眠的工作线程
+void Scheduler::unparkAll()
+{
+	std::vector<size_t> indexes;
+	takeParked(indexes);
+	for(auto index : indexes)
+		unpark(m_workers[index]);
+}
+
+// 切换到指定线程(或本调度器的任意线程)继续执行当前协程
+// 指定线程时直接投递到目标线程的收件箱并唤醒它
 void Scheduler::switchTo(int thread)
 {
 	ASSERT(Scheduler::GetThis() != nullptr);
@@ -298,19 +1306,212 @@ void Scheduler::switchTo(int thread)
 	Fiber::YieldToHold();
 }
 
+// 获取某个优先级的排队深度和等待时间统计，出队统计由各工作线程汇总
+Scheduler::PriorityStats Scheduler::getPriorityStats(Priority priority)
+{
+	PriorityStats stats;
+	size_t i = priority;
+	ASSERT(i < PRIORITY_COUNT);
+	stats.depth = m_depth[i];
+	for(auto worker : m_workers)
+	{
+		stats.dequeued += worker->dequeued[i].load(std::memory_order_relaxed);
+		stats.totalWaitUs += worker->totalWaitUs[i].load(std::memory_order_relaxed);
+		uint64_t max_wait = worker->maxWaitUs[i].load(std::memory_order_relaxed);
+		if(max_wait > stats.maxWaitUs)
+			stats.maxWaitUs = max_wait;
+	}
+	return stats;
+}
+
+// 获取各工作线程的统计快照，各计数独立读取，相互之间不保证一致
+std::vector<Scheduler::WorkerStats> Scheduler::getWorkerStats()
+{
+	std::vector<WorkerStats> result(m_workers.size());
+	uint64_t now = shiosylar::GetCurrentUS();
+	for(size_t i = 0; i < m_workers.size(); ++i)
+	{
+		WorkerContext* worker = m_workers[i];
+		WorkerStats& stats = result[i];
+		stats.index = worker->index;
+		stats.threadId = worker->threadId;
+		stats.cpu = worker->cpu;
+		stats.active = worker->active;
+		for(size_t j = 0; j < PRIORITY_COUNT; ++j)
+			stats.tasks += worker->dequeued[j].load(std::memory_order_relaxed);
+		stats.switches = worker->switches.load(std::memory_order_relaxed);
+		stats.steals = worker->steals.load(std::memory_order_relaxed);
+		stats.stolenTasks = worker->stolenTasks.load(std::memory_order_relaxed);
+		// 正在idle中的线程加上本次已经空闲的时间
+		stats.idleUs = worker->idleUs.load(std::memory_order_relaxed);
+		uint64_t idle_since = worker->idleSinceUs.load(std::memory_order_relaxed);
+		if(idle_since && now > idle_since)
+			stats.idleUs += now - idle_since;
+		stats.pollUs = worker->pollUs.load(std::memory_order_relaxed);
+		stats.depth = worker->localSize() + worker->inboxSize;
+		for(size_t j = 0; j < LATENCY_BUCKETS; ++j)
+			stats.waitHistogram[j] = worker->waitHistogram[j].load(std::memory_order_relaxed);
+	}
+	return result;
+}
+
+// 累加工作线程在epoll_wait中的时间
+void Scheduler::addPollTime(size_t index, uint64_t us)
+{
+	ASSERT(index < m_workers.size());
+	RelaxedAdd(m_workers[index]->pollUs, us);
+}
+
+// 每隔预算的四分之一检查一次，超时的任务最晚在1.25倍预算时被发现
+void Scheduler::watchdog()
+{
+	uint64_t interval = std::max<uint64_t>(m_watchdogUs / 4, 1000);
+	struct timespec ts;
+	ts.tv_sec = interval / 1000000;
+	ts.tv_nsec = interval % 1000000 * 1000;
+	while(m_watchdogStop.load(std::memory_order_acquire) == 0)
+	{
+		FutexWait(&m_watchdogStop, 0, &ts);
+		uint64_t now = shiosylar::GetCurrentUS();
+		for(auto worker : m_workers)
+		{
+			if(!worker->active) // 空闲退出或还未扩容的线程
+				continue;
+			uint64_t start = worker->runStartUs.load(std::memory_order_acquire);
+			if(start == 0 || start == worker->reportedStartUs || now < start + m_watchdogUs)
+				continue;
+			worker->reportedStartUs = start;
+			reportOverrun(worker, start, now);
+		}
+	}
+}
+
+// 向工作线程发信号，由它在信号处理函数中记录自己的调用栈，最多等待50毫秒
+void Scheduler::reportOverrun(WorkerContext* worker, uint64_t start, uint64_t now)
+{
+	uint64_t fiber_id = worker->runFiberId.load(std::memory_order_relaxed);
+	worker->stackDepth.store(-1, std::memory_order_relaxed);
+	int rt = -1;
+	if(s_watchdog_signal)
+	{
+		// 读到的开始时间可能已经过时，线程随后退出，在锁内确认线程还在run中才发信号
+		RWMutex::ReadLock lock(m_workerMutex);
+		if(worker->active && worker->pthread)
+			rt = pthread_kill(worker->pthread, s_watchdog_signal);
+	}
+	for(int i = 0; rt == 0 && i < 50 && worker->stackDepth.load(std::memory_order_acquire) < 0; ++i)
+		usleep(1000);
+
+	std::stringstream ss;
+	ss << m_name << " worker=" << worker->index << " thread=" << worker->threadId
+	   << " fiber_id=" << fiber_id << " running " << (now - start) / 1000
+	   << "ms without yielding, budget=" << m_watchdogUs / 1000 << "ms";
+	int depth = worker->stackDepth.load(std::memory_order_acquire);
+	// 记录调用栈前任务已经切出时，调用栈不再属于该协程
+	if(depth > 0 && worker->runStartUs.load(std::memory_order_acquire) == start)
+	{
+		char** symbols = backtrace_symbols(worker->stack, depth);
+		if(symbols)
+		{
+			// 跳过信号处理函数自身和信号跳板
+			for(int i = 2; i < depth; ++i)
+				ss << std::endl << "    " << symbols[i];
+			free(symbols);
+		}
+	}
+	else
+		ss << ", backtrace unavailable";
+	LOG_WARN(g_logger) << ss.str();
+}
+
+// 只使用异步信号安全的操作，线程私有变量在线程进入run时已经初始化
+void Scheduler::WatchdogSignalHandler(int sig, siginfo_t* info, void* context)
+{
+	Scheduler* scheduler = t_scheduler;
+	int index = t_worker_index;
+	// 看门狗用pthread_kill发送，si_code为SI_TKILL，内核发来的(如TCP带外数据)即使落在工作线程上也转给原来的处理函数
+	bool from_watchdog = info && info->si_code == SI_TKILL && info->si_pid == getpid();
+	if(!from_watchdog || !scheduler || index < 0 || (size_t)index >= scheduler->m_workers.size())
+	{
+		// 原来是默认处理或忽略时什么也不做(SIGURG的默认处理就是忽略)
+		if(s_prev_action.sa_flags & SA_SIGINFO)
+		{
+			if(s_prev_action.sa_sigaction)
+				s_prev_action.sa_sigaction(sig, info, context);
+		}
+		else if(s_prev_action.sa_handler != SIG_DFL && s_prev_action.sa_handler != SIG_IGN)
+			s_prev_action.sa_handler(sig);
+		return;
+	}
+	int saved_errno = errno;
+	WorkerContext* worker = scheduler->m_workers[index];
+	int depth = backtrace(worker->stack, WorkerContext::STACK_FRAMES);
+	worker->stackDepth.store(depth, std::memory_order_release);
+	errno = saved_errno;
+}
+
+// 未超时只读一次时钟，超时但没有其他任务排队时开始新的时间片继续运行
+bool maybe_yield()
+{
+	Scheduler* scheduler = t_scheduler;
+	int index = t_worker_index;
+	if(!scheduler || index < 0)
+		return false;
+	Scheduler::WorkerContext* worker = scheduler->m_workers[index];
+	if(worker->runStartUs.load(std::memory_order_relaxed) == 0) // 不在任务协程中，如idle协程
+		return false;
+	uint64_t now = shiosylar::GetCurrentUS();
+	if(now < worker->sliceStartUs + scheduler->m_timeSliceUs)
+		return false;
+	// 只重新开始时间片，runStartUs仍是任务取出的时间，看门狗照样能发现长时间不让出的任务
+	if(scheduler->pendingTasks() == 0)
+	{
+		worker->sliceStartUs = now;
+		return false;
+	}
+	worker->yielded = true;
+	Fiber::YieldToReady(); // 调度器把本协程放回本地队列队尾
+	return true;
+}
+
 std::ostream& Scheduler::dump(std::ostream& os)
 {
+	std::vector<int> thread_ids;
+	{
+		MutexType::Lock lock(m_mutex);
+		thread_ids = m_threadIds;
+	}
 	os << "[Scheduler name=" << m_name
 	   << " size=" << m_threadCount
 	   << " active_count=" << m_activeThreadCount
 	   << " idle_count=" << m_idleThreadCount
 	   << " stopping=" << m_stopping
+	   << " depth=" << m_depth[HIGH] << "/" << m_depth[NORMAL] << "/" << m_depth[LOW]
 	   << " ]" << std::endl << "    ";
-	for(size_t i = 0; i < m_threadIds.size(); ++i)
+	for(size_t i = 0; i < thread_ids.size(); ++i)
 	{
 		if(i)
 			os << ", ";
-		os << m_threadIds[i];
+		os << thread_ids[i];
+	}
+	if(!m_cpus.empty())
+	{
+		os << std::endl << "    cpu/node:";
+		for(WorkerContext* worker : m_workers)
+			os << " " << worker->cpu << "/" << worker->numaNode;
+	}
+	for(const WorkerStats& stats : getWorkerStats())
+	{
+		if(!stats.active && !stats.tasks)
+			continue;
+		os << std::endl << "    worker=" << stats.index
+		   << (stats.active ? "" : " retired")
+		   << " tasks=" << stats.tasks
+		   << " switches=" << stats.switches
+		   << " steals=" << stats.steals << "/" << stats.stolenTasks
+		   << " idle_us=" << stats.idleUs
+		   << " poll_us=" << stats.pollUs
+		   << " depth=" << stats.depth;
 	}
 	return os;
 }
@@ -26,12 +26,19 @@ bool Timer::Comparator::operator()(const Timer::ptr& lhs, const Timer::ptr& rhs)
 }
 
 // 定时器初始化
-Timer::Timer(uint64_t ms, std::function<void()> cb, bool recurring, TimerManager* manager)
+Timer::Timer(uint64_t ms, Task cb, bool recurring, TimerManager* manager)
 	:m_recurring(recurring)
 	,m_ms(ms)
-	,m_cb(cb)
 	,m_manager(manager)
 {
+	if(m_recurring)
+	{
+		m_recurringCb = std::make_shared<RecurringCb>();
+		m_recurringCb->cb = std::move(cb);
+	}
+	else
+		m_cb = std::move(cb);
+
 	// 初始化的时候计算触发的精确时间
 	m_next = shiosylar::GetCurrentMS() + m_ms;
 }
@@ -44,9 +51,10 @@ Timer::Timer(uint64_t next)
 bool Timer::cancel()
 {
 	TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-	if(m_cb)
+	if(hasCallback())
 	{
 		m_cb = nullptr; // 回调函数置空
+		m_recurringCb.reset();
 		auto it = m_manager->m_timers.find(shared_from_this());
 		m_manager->m_timers.erase(it); // 从定时器容器中删除
 		return true;
@@ -58,7 +66,7 @@ bool Timer::cancel()
 bool Timer::refresh()
 {
 	TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-	if(!m_cb) // 如果回调函数为空，则说明定时任务已经被执行了
+	if(!hasCallback()) // 如果回调函数为空，则说明定时任务已经被执行了
 		return false;
 
 	auto it = m_manager->m_timers.find(shared_from_this());
@@ -78,7 +86,7 @@ bool Timer::reset(uint64_t ms, bool from_now)
 		return true;
 
 	TimerManager::RWMutexType::WriteLock lock(m_manager->m_mutex);
-	if(!m_cb) // 回调函数指针为空，则说明该任务已经被执行了
+	if(!hasCallback()) // 回调函数指针为空，则说明该任务已经被执行了
 		return false;
 
 	auto it = m_manager->m_timers.find(shared_from_this());
@@ -107,16 +115,16 @@ TimerManager::~TimerManager()
 {  }
 
 // 添加定时器
-Timer::ptr TimerManager::addTimer(uint64_t ms, std::function<void()> cb, bool recurring)
+Timer::ptr TimerManager::addTimer(uint64_t ms, Task cb, bool recurring)
 {
-	Timer::ptr timer(new Timer(ms, cb, recurring, this));
+	Timer::ptr timer(new Timer(ms, std::move(cb), recurring, this));
 	RWMutexType::WriteLock lock(m_mutex);
 	addTimer(timer, lock); // 调用底层接口
 	return timer;
 }
 
 // 条件定时器的回调函数，执行任务前先判断条件是否成立
-static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb)
+static void OnTimer(std::weak_ptr<void> weak_cond, Task& cb)
 {
 	std::shared_ptr<void> tmp = weak_cond.lock(); // 对weak进行提升，tmp为空说明条件不成立
 	if(tmp)
@@ -124,11 +132,11 @@ static void OnTimer(std::weak_ptr<void> weak_cond, std::function<void()> cb)
 }
 
 // 添加一个条件定时器
-Timer::ptr TimerManager::addConditionTimer(uint64_t ms, std::function<void()> cb
+Timer::ptr TimerManager::addConditionTimer(uint64_t ms, Task cb
 									,std::weak_ptr<void> weak_cond
 									,bool recurring)
 {
-	return addTimer(ms, std::bind(&OnTimer, weak_cond, cb), recurring);
+	return addTimer(ms, std::bind(&OnTimer, weak_cond, std::move(cb)), recurring);
 }
 
 // 获取下一次触发时间
@@ -148,7 +156,7 @@ uint64_t TimerManager::getNextTimer()
 }
 
 // 获取已触发定时器的回调函数，并将其插入任务队列
-void TimerManager::listExpiredCb(std::vector<std::function<void()> >& cbs)
+void TimerManager::listExpiredCb(std::vector<Task>& cbs)
 {
 	uint64_t now_ms = shiosylar::GetCurrentMS();
 	std::vector<Timer::ptr> expired;
@@ -183,14 +191,26 @@ void TimerManager::listExpiredCb(std::vector<std::function<void()> >& cbs)
 
 	for(auto& timer : expired)
 	{
-		cbs.push_back(timer->m_cb); // 插入到预备的任务队列容器中
 		if(timer->m_recurring) // 如果是重复的定时任务，则刷新触发时间，重新插入定时器容器中
 		{
+			// 上一次触发的回调还在排队或运行时跳过本次，同一个回调对象不会在多个线程上并发运行
+			std::shared_ptr<Timer::RecurringCb> cb = timer->m_recurringCb;
+			if(!cb->running.exchange(true, std::memory_order_acquire))
+			{
+				cbs.push_back([cb]() { // 插入到预备的任务队列容器中
+					struct Done // 回调抛出异常时也要清除标志，否则定时器不再触发
+					{
+						std::atomic<bool>& running;
+						~Done() { running.store(false, std::memory_order_release); }
+					} done {cb->running};
+					cb->cb();
+				});
+			}
 			timer->m_next = now_ms + timer->m_ms;
 			m_timers.insert(timer);
 		}
-		else
-			timer->m_cb = nullptr; // 一次性任务则将回调函数置空
+		else // 一次性任务直接移走回调函数，回调函数随之置空
+			cbs.push_back(std::move(timer->m_cb));
 
 	}
 }
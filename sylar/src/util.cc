@@ -7,10 +7,13 @@
 #include <dirent.h>
 #include <unistd.h>
 #include <string.h>
+#include <errno.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <arpa/inet.h>
 #include <ifaddrs.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 
 namespace shiosylar
 {
@@ -23,6 +26,117 @@ pid_t GetThreadId()
 	return syscall(SYS_gettid);
 }
 
+// 在addr上休眠，直到被唤醒或*addr不等于expected
+int FutexWait(std::atomic<int>* addr, int expected, const struct timespec* timeout)
+{
+	int rt = syscall(SYS_futex, reinterpret_cast<int*>(addr), FUTEX_WAIT_PRIVATE,
+					expected, timeout, nullptr, 0);
+	if(rt == -1 && errno == EAGAIN) // 休眠前值已经被改变
+		return 0;
+	return rt;
+}
+
+// 唤醒最多count个在addr上休眠的线程
+int FutexWake(std::atomic<int>* addr, int count)
+{
+	return syscall(SYS_futex, reinterpret_cast<int*>(addr), FUTEX_WAKE_PRIVATE,
+					count, nullptr, nullptr, 0);
+}
+
+// 解析cpulist格式的字符串
+std::vector<int> ParseCpuList(const std::string& str)
+{
+	std::vector<int> cpus;
+	size_t pos = 0;
+	while(pos < str.size())
+	{
+		size_t end = str.find(',', pos);
+		if(end == std::string::npos)
+			end = str.size();
+		std::string item = str.substr(pos, end - pos);
+		pos = end + 1;
+
+		int first = 0, last = 0;
+		int n = sscanf(item.c_str(), "%d-%d", &first, &last);
+		if(n <= 0 || first < 0)
+			continue;
+		if(n == 1)
+			last = first;
+		for(int i = first; i <= last; ++i)
+			cpus.push_back(i);
+	}
+	return cpus;
+}
+
+// 读取sysfs得到的cpu到NUMA节点的映射，只读取一次
+static const std::vector<int>& CpuNodeTable(int* node_count = nullptr)
+{
+	static int s_node_count = 1;
+	static std::vector<int> s_table = []() {
+		std::vector<int> table;
+		std::ifstream online("/sys/devices/system/node/online");
+		std::string line;
+		if(!online || !std::getline(online, line))
+			return table;
+
+		std::vector<int> nodes = ParseCpuList(line);
+		for(int node : nodes)
+		{
+			std::ifstream ifs("/sys/devices/system/node/node" + std::to_string(node) + "/cpulist");
+			std::string cpulist;
+			if(!ifs || !std::getline(ifs, cpulist))
+				continue;
+			for(int cpu : ParseCpuList(cpulist))
+			{
+				if(cpu >= (int)table.size())
+					table.resize(cpu + 1, -1);
+				table[cpu] = node;
+			}
+		}
+		if(!nodes.empty())
+			s_node_count = nodes.size();
+		return table;
+	}();
+	if(node_count)
+		*node_count = s_node_count;
+	return s_table;
+}
+
+// NUMA节点数
+int GetNumaNodeCount()
+{
+	int count = 1;
+	CpuNodeTable(&count);
+	return count;
+}
+
+// cpu所在的NUMA节点
+int GetCpuNumaNode(int cpu)
+{
+	const std::vector<int>& table = CpuNodeTable();
+	if(cpu < 0 || cpu >= (int)table.size())
+		return -1;
+	return table[cpu];
+}
+
+// 当前线程正在运行的NUMA节点
+int GetCurrentNumaNode()
+{
+	unsigned cpu = 0, node = 0;
+	if(syscall(SYS_getcpu, &cpu, &node, nullptr))
+		return -1;
+	return node;
+}
+
+// 设置内存优先从node节点分配
+bool BindMemoryToNode(void* addr, size_t len, int node)
+{
+	if(node < 0 || node >= (int)(sizeof(unsigned long) * 8))
+		return false;
+	unsigned long mask = 1ul << node;
+	return syscall(SYS_mbind, addr, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) == 0;
+}
+
 // 返回当前的协程ID
 uint32_t GetFiberId()
 {
@@ -0,0 +1,308 @@
+// 协程和调度器的核心微基准
+// 覆盖协程创建销毁、协程切换往返、调度器在不同线程数下的提交吞吐、不同工作线程上两个协程的乒乓、IOManager的唤醒延迟
+// 每项重复REPEATS次，取中位数和最小值，结果以JSON输出，便于在版本之间比较回归
+// 用法: bench_core [输出文件]，不指定时输出到标准输出
+
+#include "channel.h"
+#include "fiber.h"
+#include "iomanager.h"
+#include "logger.h"
+#include "mutex.h"
+#include "scheduler.h"
+#include "util.h"
+
+#include <algorithm>
+#include <atomic>
+#include <stdio.h>
+#include <string>
+#include <time.h>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+static const int REPEATS = 5;              // 每项的重复次数
+static const int CREATES = 200000;         // 创建销毁的次数
+static const int SWITCHES = 1000000;       // 协程切换的往返次数
+static const int YIELDS = 200000;          // 经过调度器让出的次数
+static const int TASKS = 200000;           // 吞吐测试提交的任务数
+static const int ROUND_TRIPS = 20000;      // 乒乓的往返次数
+static const int TICKLES = 2000;           // 唤醒延迟的采样数
+
+// 单调时钟的纳秒数
+static uint64_t now_ns()
+{
+    timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// 一项测试的结果，字段按加入的顺序输出
+struct Result
+{
+    std::string name;
+    std::vector<std::pair<std::string, std::string> > fields;
+
+    Result(const std::string& n) : name(n) {}
+
+    void add(const std::string& key, double value)
+    {
+        char buf[64];
+        snprintf(buf, sizeof(buf), "%.3f", value);
+        fields.emplace_back(key, buf);
+    }
+
+    void add(const std::string& key, uint64_t value)
+    {
+        fields.emplace_back(key, std::to_string(value));
+    }
+
+    void add(const std::string& key, bool value)
+    {
+        fields.emplace_back(key, value ? "true" : "false");
+    }
+};
+
+// 把REPEATS次的测量结果的中位数和最小值记入结果
+static void add_samples(Result& result, const std::string& key, std::vector<double> samples)
+{
+    std::sort(samples.begin(), samples.end());
+    result.add(key + "_median", samples[samples.size() / 2]);
+    result.add(key + "_min", samples.front());
+}
+
+static void noop()
+{
+}
+
+// 创建并销毁不运行的协程，栈和协程对象从缓存中复用
+static Result bench_create()
+{
+    Result result("fiber_create_destroy");
+    std::vector<double> samples;
+    for(int r = 0; r < REPEATS; ++r)
+    {
+        uint64_t start = now_ns();
+        for(int i = 0; i < CREATES; ++i)
+            shiosylar::Fiber::ptr fiber(new shiosylar::Fiber(&noop, 0, true));
+        samples.push_back((double)(now_ns() - start) / CREATES);
+    }
+    result.add("iterations", (uint64_t)CREATES);
+    add_samples(result, "ns_per_op", samples);
+    return result;
+}
+
+static shiosylar::Fiber* s_fiber = nullptr;
+
+static void switch_loop()
+{
+    for(int i = 0; i < SWITCHES; ++i)
+        s_fiber->back();
+}
+
+// 主协程与子协程之间的上下文切换往返，即不经过调度器的swapIn/swapOut
+static Result bench_switch()
+{
+    Result result("fiber_switch_round_trip");
+    std::vector<double> samples;
+    for(int r = 0; r < REPEATS; ++r)
+    {
+        shiosylar::Fiber::ptr fiber(new shiosylar::Fiber(&switch_loop, 0, true));
+        s_fiber = fiber.get();
+        uint64_t start = now_ns();
+        for(int i = 0; i < SWITCHES; ++i)
+            fiber->call();
+        samples.push_back((double)(now_ns() - start) / SWITCHES);
+        fiber->call(); // 让协程函数执行完
+    }
+    result.add("iterations", (uint64_t)SWITCHES);
+    add_samples(result, "ns_per_op", samples);
+    return result;
+}
+
+// 任务协程让出到调度协程再被切回，即调度器中一次swapOut加一次swapIn，含出入队
+static Result bench_yield()
+{
+    Result result("scheduler_yield_round_trip");
+    std::vector<double> samples;
+    for(int r = 0; r < REPEATS; ++r)
+    {
+        shiosylar::Semaphore done;
+        uint64_t used = 0;
+        shiosylar::Scheduler sc(1, false, "bench_yield");
+        sc.start();
+        sc.schedule([&]() {
+            uint64_t start = now_ns();
+            for(int i = 0; i < YIELDS; ++i)
+                shiosylar::Fiber::YieldToReady();
+            used = now_ns() - start;
+            done.notify();
+        });
+        done.wait();
+        sc.stop();
+        samples.push_back((double)used / YIELDS);
+    }
+    result.add("iterations", (uint64_t)YIELDS);
+    add_samples(result, "ns_per_op", samples);
+    return result;
+}
+
+static std::atomic<int> s_remaining {0};
+static shiosylar::Semaphore* s_done = nullptr;
+
+static void count_task()
+{
+    if(--s_remaining == 0)
+        s_done->notify();
+}
+
+// 外部线程向运行中的调度器提交任务，从第一个提交到最后一个执行完的吞吐
+static Result bench_throughput(size_t threads)
+{
+    Result result("scheduler_schedule_throughput");
+    std::vector<double> samples;
+    for(int r = 0; r < REPEATS; ++r)
+    {
+        shiosylar::Semaphore done;
+        s_done = &done;
+        s_remaining = TASKS;
+        shiosylar::Scheduler sc(threads, false, "bench_throughput");
+        sc.start();
+        uint64_t start = now_ns();
+        for(int i = 0; i < TASKS; ++i)
+            sc.schedule(&count_task);
+        done.wait();
+        uint64_t used = now_ns() - start;
+        sc.stop();
+        samples.push_back(TASKS * 1e9 / (used ? used : 1));
+    }
+    result.add("threads", (uint64_t)threads);
+    result.add("tasks", (uint64_t)TASKS);
+    add_samples(result, "tasks_per_sec", samples);
+    return result;
+}
+
+// 两个固定在不同工作线程上的协程通过无缓冲通道来回传递，每次往返两次跨线程唤醒
+static Result bench_ping_pong()
+{
+    Result result("cross_worker_ping_pong");
+    std::vector<double> samples;
+    bool distinct = true;
+    for(int r = 0; r < REPEATS; ++r)
+    {
+        shiosylar::Semaphore done;
+        uint64_t used = 0;
+        int ping_thread = -1, pong_thread = -1;
+        shiosylar::Channel<int> ping(0), pong(0);
+        shiosylar::IOManager iom(2, false, "bench_ping_pong");
+        std::vector<shiosylar::Scheduler::WorkerStats> workers = iom.getWorkerStats();
+        iom.schedule([&]() {
+            ping_thread = shiosylar::GetThreadId();
+            int v = 0;
+            uint64_t start = now_ns();
+            for(int i = 0; i < ROUND_TRIPS; ++i)
+            {
+                ping.send(i);
+                pong.recv(v);
+            }
+            used = now_ns() - start;
+            ping.close();
+            done.notify();
+        }, workers[0].threadId);
+        iom.schedule([&]() {
+            pong_thread = shiosylar::GetThreadId();
+            int v = 0;
+            while(ping.recv(v))
+                pong.send(v);
+        }, workers[1].threadId);
+        done.wait();
+        iom.stop();
+        distinct = distinct && ping_thread != pong_thread;
+        samples.push_back((double)used / ROUND_TRIPS);
+    }
+    result.add("round_trips", (uint64_t)ROUND_TRIPS);
+    result.add("distinct_threads", distinct);
+    add_samples(result, "ns_per_round_trip", samples);
+    return result;
+}
+
+// 工作线程空闲休眠时外部线程提交任务，从提交到任务开始执行的延迟
+static Result bench_tickle()
+{
+    Result result("iomanager_tickle_latency");
+    std::vector<uint64_t> latencies;
+    latencies.reserve(TICKLES);
+    {
+        shiosylar::IOManager iom(1, false, "bench_tickle");
+        shiosylar::Semaphore done;
+        for(int i = 0; i < TICKLES; ++i)
+        {
+            usleep(200); // 等工作线程回到epoll_wait中休眠
+            uint64_t start = now_ns();
+            iom.schedule([&latencies, &done, start]() {
+                latencies.push_back(now_ns() - start);
+                done.notify();
+            });
+            done.wait();
+        }
+        iom.stop();
+    }
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t sum = 0;
+    for(uint64_t v : latencies)
+        sum += v;
+    result.add("samples", (uint64_t)latencies.size());
+    result.add("mean_ns", (double)sum / latencies.size());
+    result.add("p50_ns", latencies[latencies.size() / 2]);
+    result.add("p99_ns", latencies[latencies.size() * 99 / 100]);
+    result.add("max_ns", latencies.back());
+    return result;
+}
+
+static void write_json(FILE* fp, const std::vector<Result>& results)
+{
+    fprintf(fp, "{\n");
+    fprintf(fp, "  \"benchmark\": \"bench_core\",\n");
+    fprintf(fp, "  \"timestamp\": %lu,\n", (unsigned long)time(nullptr));
+    fprintf(fp, "  \"fiber_context\": \"%s\",\n", shiosylar::FiberContextName());
+    fprintf(fp, "  \"cpus\": %ld,\n", sysconf(_SC_NPROCESSORS_ONLN));
+    fprintf(fp, "  \"repeats\": %d,\n", REPEATS);
+    fprintf(fp, "  \"results\": [\n");
+    for(size_t i = 0; i < results.size(); ++i)
+    {
+        fprintf(fp, "    {\"name\": \"%s\"", results[i].name.c_str());
+        for(auto& field : results[i].fields)
+            fprintf(fp, ", \"%s\": %s", field.first.c_str(), field.second.c_str());
+        fprintf(fp, "}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(fp, "  ]\n");
+    fprintf(fp, "}\n");
+}
+
+int main(int argc, char *argv[])
+{
+    LOG_NAME("system")->setLevel(shiosylar::LogLevel::ERROR);
+    LOG_ROOT()->setLevel(shiosylar::LogLevel::ERROR);
+
+    shiosylar::Fiber::GetThis(); // 创建主协程
+
+    std::vector<Result> results;
+    results.push_back(bench_create());
+    results.push_back(bench_switch());
+    results.push_back(bench_yield());
+    const size_t counts[] = {1, 2, 4, 8};
+    for(size_t threads : counts)
+        results.push_back(bench_throughput(threads));
+    results.push_back(bench_ping_pong());
+    results.push_back(bench_tickle());
+
+    FILE* fp = argc > 1 ? fopen(argv[1], "w") : stdout;
+    if(!fp)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+    write_json(fp, results);
+    if(fp != stdout)
+        fclose(fp);
+    return 0;
+}
@@ -0,0 +1,106 @@
+// IOManager回显测试
+// 每个连接一对socketpair，服务端协程读到数据原样写回，客户端协程发送后等待回显，循环若干轮
+// 统计每个IO任务(一次读就绪后恢复的协程)平均产生的唤醒次数和主动上下文切换次数
+
+#include "logger.h"
+#include "iomanager.h"
+#include "fd_manager.h"
+#include "hook.h"
+#include "util.h"
+
+#include <atomic>
+#include <stdio.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const int CONNECTIONS = 64;      // 连接数
+static const int ROUNDS = 2000;         // 每个连接的回显轮数
+static const int MSG_SIZE = 64;         // 每次发送的字节数
+
+static std::atomic<int> s_finished = {0};
+
+static void server(int fd)
+{
+    char buf[MSG_SIZE];
+    while(true)
+    {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if(n <= 0)
+            break;
+        if(write(fd, buf, n) != n)
+            break;
+    }
+    close(fd);
+}
+
+static void client(int fd)
+{
+    char buf[MSG_SIZE] = {0};
+    for(int i = 0; i < ROUNDS; ++i)
+    {
+        if(write(fd, buf, sizeof(buf)) != (ssize_t)sizeof(buf))
+            break;
+        size_t got = 0;
+        while(got < sizeof(buf))
+        {
+            ssize_t n = read(fd, buf + got, sizeof(buf) - got);
+            if(n <= 0)
+                break;
+            got += n;
+        }
+    }
+    close(fd);
+    ++s_finished;
+}
+
+static long voluntary_switches()
+{
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_nvcsw;
+}
+
+static void bench(size_t threads)
+{
+    s_finished = 0;
+    long csw = voluntary_switches();
+    uint64_t wakeups = 0;
+    uint64_t start = shiosylar::GetCurrentUS();
+    {
+        shiosylar::IOManager iom(threads, false, "echo");
+        for(int i = 0; i < CONNECTIONS; ++i)
+        {
+            int fds[2];
+            if(socketpair(AF_UNIX, SOCK_STREAM, 0, fds))
+                return;
+            // 交给FdManager管理，hook后的读写在未就绪时挂起协程
+            shiosylar::FdMgr::GetInstance()->get(fds[0], true);
+            shiosylar::FdMgr::GetInstance()->get(fds[1], true);
+            iom.schedule(std::bind(&server, fds[0]));
+            iom.schedule(std::bind(&client, fds[1]));
+        }
+        while(s_finished < CONNECTIONS)
+            usleep(1000);
+        wakeups = iom.getWakeupCount();
+    }
+    uint64_t used = shiosylar::GetCurrentUS() - start;
+    csw = voluntary_switches() - csw;
+
+    // 每轮回显服务端和客户端各有一次读就绪
+    double tasks = 2.0 * CONNECTIONS * ROUNDS;
+    printf("threads=%-3zu round-trips/s=%.0f wakeups/task=%.3f voluntary-csw/task=%.3f\n",
+           threads, CONNECTIONS * ROUNDS * 1000000.0 / (used ? used : 1),
+           wakeups / tasks, csw / tasks);
+}
+
+int main(int argc, char *argv[])
+{
+    LOG_NAME("system")->setLevel(shiosylar::LogLevel::ERROR);
+    LOG_ROOT()->setLevel(shiosylar::LogLevel::ERROR);
+
+    const size_t counts[] = {1, 4, 16};
+    for(size_t threads : counts)
+        bench(threads);
+    return 0;
+}
@@ -0,0 +1,162 @@
+// 协程切换测试
+// 主协程与子协程之间来回切换，统计每对切换(切入加切出)的耗时
+// 同时用glibc的swapcontext做同样的切换作为对照，区分库的开销和上下文切换本身的开销
+// 最后统计创建并销毁一个协程的耗时，栈从缓存中复用
+// 并检查开启自适应栈后，调度器复用的任务协程在同类任务之间保持同一个栈
+
+#include "config.h"
+#include "fiber.h"
+#include "logger.h"
+#include "mutex.h"
+#include "scheduler.h"
+#include "util.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ucontext.h>
+#include <vector>
+
+static const int ROUNDS = 5000000;     // 切换的对数
+
+static shiosylar::Fiber* s_fiber = nullptr;
+
+static void fiber_loop()
+{
+    for(int i = 0; i < ROUNDS; ++i)
+        s_fiber->back();
+}
+
+// 通过Fiber::call/back切换，返回每对切换的纳秒数
+static double bench_fiber()
+{
+    shiosylar::Fiber::GetThis(); // 创建主协程
+    shiosylar::Fiber::ptr fiber(new shiosylar::Fiber(&fiber_loop, 0, true));
+    s_fiber = fiber.get();
+    uint64_t start = shiosylar::GetCurrentUS();
+    for(int i = 0; i < ROUNDS; ++i)
+        fiber->call();
+    uint64_t used = shiosylar::GetCurrentUS() - start;
+    fiber->call(); // 让协程函数执行完
+    return used * 1000.0 / ROUNDS;
+}
+
+static const int CREATES = 1000000;    // 创建销毁的次数
+
+// 创建并销毁协程，返回每次的纳秒数
+static double bench_create()
+{
+    uint64_t start = shiosylar::GetCurrentUS();
+    for(int i = 0; i < CREATES; ++i)
+        shiosylar::Fiber::ptr fiber(new shiosylar::Fiber(&fiber_loop, 0, true));
+    uint64_t used = shiosylar::GetCurrentUS() - start;
+    return used * 1000.0 / CREATES;
+}
+
+static ucontext_t s_main_ctx;
+static ucontext_t s_child_ctx;
+
+static void ucontext_loop()
+{
+    for(int i = 0; i < ROUNDS; ++i)
+        swapcontext(&s_child_ctx, &s_main_ctx);
+}
+
+// 直接用swapcontext切换，返回每对切换的纳秒数
+static double bench_ucontext()
+{
+    const size_t stack_size = 128 * 1024;
+    void* stack = malloc(stack_size);
+    getcontext(&s_child_ctx);
+    s_child_ctx.uc_link = &s_main_ctx;
+    s_child_ctx.uc_stack.ss_sp = stack;
+    s_child_ctx.uc_stack.ss_size = stack_size;
+    makecontext(&s_child_ctx, &ucontext_loop, 0);
+    uint64_t start = shiosylar::GetCurrentUS();
+    for(int i = 0; i < ROUNDS; ++i)
+        swapcontext(&s_main_ctx, &s_child_ctx);
+    uint64_t used = shiosylar::GetCurrentUS() - start;
+    swapcontext(&s_main_ctx, &s_child_ctx);
+    free(stack);
+    return used * 1000.0 / ROUNDS;
+}
+
+static const int REUSES = 10000;      // 复用任务协程运行的任务数
+
+// 单线程调度器先运行一批同类任务让栈大小完成自适应，再运行REUSES个，记录每个任务所在协程的id和栈大小
+// 返回期间的栈分配次数，复用的协程不换栈时应当为0
+static uint64_t bench_reuse(bool& stable, uint32_t& stack_size)
+{
+    shiosylar::Config::Lookup<uint32_t>("fiber.stack_paint_sample")->setValue(1);
+    shiosylar::Config::Lookup<uint32_t>("fiber.stack_adapt_samples")->setValue(4);
+    shiosylar::Config::Lookup<bool>("fiber.stack_adaptive")->setValue(true);
+
+    std::vector<uint64_t> ids;
+    std::vector<uint32_t> sizes;
+    ids.reserve(REUSES);
+    sizes.reserve(REUSES);
+    bool record = false;
+    int runs = 0, target = 64;
+    shiosylar::Semaphore done;
+    // 同一类任务，由最后一个任务通知完成，中间不混入其他类型的任务
+    auto task = [&]() {
+        char buf[1024];
+        memset(buf, 0, sizeof(buf));
+        asm volatile("" : : "r"(buf) : "memory");
+        if(record)
+        {
+            shiosylar::Fiber::ptr cur = shiosylar::Fiber::GetThis();
+            ids.push_back(cur->getId());
+            sizes.push_back(cur->getStackSize());
+        }
+        if(++runs == target)
+            done.notify();
+    };
+
+    shiosylar::Scheduler sc(1, false, "bench_reuse");
+    sc.start();
+    for(int i = 0; i < target; ++i)
+        sc.schedule(task);
+    done.wait();
+
+    record = true;
+    runs = 0;
+    target = REUSES;
+    uint64_t allocs = shiosylar::Fiber::GetStackStats().allocs;
+    for(int i = 0; i < REUSES; ++i)
+        sc.schedule(task);
+    done.wait();
+    allocs = shiosylar::Fiber::GetStackStats().allocs - allocs;
+    sc.stop();
+
+    shiosylar::Config::Lookup<bool>("fiber.stack_adaptive")->setValue(false);
+    shiosylar::Config::Lookup<uint32_t>("fiber.stack_paint_sample")->setValue(0);
+
+    stable = ids.size() == (size_t)REUSES;
+    for(size_t i = 1; stable && i < ids.size(); ++i)
+        stable = ids[i] == ids[0] && sizes[i] == sizes[0];
+    stack_size = sizes.empty() ? 0 : sizes[0];
+    return allocs;
+}
+
+int main(int argc, char *argv[])
+{
+    LOG_NAME("system")->setLevel(shiosylar::LogLevel::ERROR);
+    LOG_ROOT()->setLevel(shiosylar::LogLevel::ERROR);
+
+    printf("rounds=%d fiber(%s) ns/switch pair=%.1f swapcontext ns/switch pair=%.1f\n", ROUNDS,
+           shiosylar::FiberContextName(), bench_fiber(), bench_ucontext());
+
+    double create = bench_create();
+    shiosylar::Fiber::StackStats stats = shiosylar::Fiber::GetStackStats();
+    printf("creates=%d ns/create+destroy=%.1f stack allocs=%lu hit rate=%.4f mapped=%lu object hit rate=%.4f\n",
+           CREATES, create, (unsigned long)stats.allocs, stats.hitRate(), (unsigned long)stats.mapped,
+           stats.objectAllocs ? (double)stats.objectHits / stats.objectAllocs : 0);
+
+    bool stable = false;
+    uint32_t stack_size = 0;
+    uint64_t allocs = bench_reuse(stable, stack_size);
+    printf("adaptive reuse tasks=%d stack size=%u stable=%s stack allocs=%lu\n", REUSES, stack_size,
+           stable ? "true" : "false", (unsigned long)allocs);
+    return stable && allocs == 0 ? 0 : 1;
+}
@@ -0,0 +1,133 @@
+// 并行算法测试
+// 校验和、编码、排序三种CPU密集的批处理，分别串行执行和在不同线程数的调度器上用并行算法执行
+// 输出耗时和相对串行的加速比，并检查并行结果与串行结果一致
+
+#include "logger.h"
+#include "parallel.h"
+#include "scheduler.h"
+#include "util.h"
+
+#include <algorithm>
+#include <random>
+#include <stdint.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+static const size_t DATA_SIZE = 64 << 20;   // 校验和与编码的数据量(字节)
+static const size_t BLOCK_SIZE = 4096;      // 校验和的块大小，每块单独计算后合并
+static const size_t SORT_SIZE = 4 << 20;    // 排序的元素个数
+
+// 一个块的FNV-1a校验和
+static uint64_t block_checksum(const std::vector<uint8_t>& data, size_t block)
+{
+    uint64_t hash = 14695981039346656037ULL;
+    size_t end = std::min(data.size(), (block + 1) * BLOCK_SIZE);
+    for(size_t i = block * BLOCK_SIZE; i < end; ++i)
+    {
+        hash ^= data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+// 把data[b, e)编码为十六进制写入out
+static void hex_encode(const std::vector<uint8_t>& data, std::string& out, size_t b, size_t e)
+{
+    static const char digits[] = "0123456789abcdef";
+    for(size_t i = b; i < e; ++i)
+    {
+        out[i * 2] = digits[data[i] >> 4];
+        out[i * 2 + 1] = digits[data[i] & 0xf];
+    }
+}
+
+struct Result
+{
+    uint64_t checksumUs;
+    uint64_t encodeUs;
+    uint64_t sortUs;
+    uint64_t checksum;
+    std::string encoded;
+    std::vector<uint64_t> sorted;
+};
+
+// scheduler为空时串行执行
+static void run(shiosylar::Scheduler* scheduler, const std::vector<uint8_t>& data,
+                const std::vector<uint64_t>& keys, Result& result)
+{
+    size_t blocks = (data.size() + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    auto xor_reduce = [](uint64_t a, uint64_t b) { return a ^ b; };
+    auto map = [&data](size_t block) { return block_checksum(data, block); };
+
+    uint64_t start = shiosylar::GetCurrentUS();
+    if(scheduler)
+        result.checksum = shiosylar::parallel_reduce(scheduler, 0, blocks, (uint64_t)0, map, xor_reduce);
+    else
+    {
+        result.checksum = 0;
+        for(size_t i = 0; i < blocks; ++i)
+            result.checksum ^= map(i);
+    }
+    result.checksumUs = shiosylar::GetCurrentUS() - start;
+
+    result.encoded.assign(data.size() * 2, 0);
+    start = shiosylar::GetCurrentUS();
+    if(scheduler)
+    {
+        shiosylar::parallel_for_range(scheduler, 0, data.size(), [&](size_t b, size_t e) {
+            hex_encode(data, result.encoded, b, e);
+        });
+    }
+    else
+        hex_encode(data, result.encoded, 0, data.size());
+    result.encodeUs = shiosylar::GetCurrentUS() - start;
+
+    result.sorted = keys;
+    start = shiosylar::GetCurrentUS();
+    if(scheduler)
+        shiosylar::parallel_sort(scheduler, result.sorted.begin(), result.sorted.end());
+    else
+        std::sort(result.sorted.begin(), result.sorted.end());
+    result.sortUs = shiosylar::GetCurrentUS() - start;
+}
+
+int main(int argc, char *argv[])
+{
+    LOG_NAME("system")->setLevel(shiosylar::LogLevel::ERROR);
+    LOG_ROOT()->setLevel(shiosylar::LogLevel::ERROR);
+
+    std::mt19937_64 rng(42);
+    std::vector<uint8_t> data(DATA_SIZE);
+    for(auto& b : data)
+        b = rng();
+    std::vector<uint64_t> keys(SORT_SIZE);
+    for(auto& k : keys)
+        k = rng();
+
+    Result serial;
+    run(nullptr, data, keys, serial);
+    printf("serial      checksum=%7.1fms encode=%7.1fms sort=%7.1fms\n",
+           serial.checksumUs / 1000.0, serial.encodeUs / 1000.0, serial.sortUs / 1000.0);
+
+    const size_t counts[] = {1, 2, 4, 8, 16};
+    for(size_t threads : counts)
+    {
+        Result par;
+        {
+            shiosylar::Scheduler sc(threads, false, "bench");
+            sc.start();
+            run(&sc, data, keys, par);
+            sc.stop();
+        }
+        bool same = par.checksum == serial.checksum && par.encoded == serial.encoded
+                    && par.sorted == serial.sorted;
+        printf("threads=%-3zu checksum=%7.1fms(x%.2f) encode=%7.1fms(x%.2f) sort=%7.1fms(x%.2f) %s\n",
+               threads,
+               par.checksumUs / 1000.0, (double)serial.checksumUs / par.checksumUs,
+               par.encodeUs / 1000.0, (double)serial.encodeUs / par.encodeUs,
+               par.sortUs / 1000.0, (double)serial.sortUs / par.sortUs,
+               same ? "ok" : "MISMATCH");
+    }
+    return 0;
+}
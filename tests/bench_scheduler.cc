@@ -0,0 +1,78 @@
+// 调度器吞吐量测试
+// 外部线程提交根任务，每个根任务在工作线程中再派生子任务，统计不同线程数下每秒完成的任务数
+// 子任务分为函数指针和捕获了几个指针加一个智能指针的lambda两种，后者用于观察任务对象的内存分配
+
+#include "logger.h"
+#include "scheduler.h"
+#include "util.h"
+
+#include <atomic>
+#include <memory>
+#include <stdio.h>
+#include <stdlib.h>
+
+static std::atomic<uint64_t> s_done = {0};
+
+static const int ROOT_TASKS = 20000;    // 外部线程提交的根任务数
+static const int CHILD_TASKS = 16;      // 每个根任务派生的子任务数
+
+static void child_task()
+{
+    ++s_done;
+}
+
+static void root_task()
+{
+    shiosylar::Scheduler* sc = shiosylar::Scheduler::GetThis();
+    for(int i = 0; i < CHILD_TASKS; ++i)
+        sc->schedule(&child_task);
+    ++s_done;
+}
+
+static void root_capture_task()
+{
+    shiosylar::Scheduler* sc = shiosylar::Scheduler::GetThis();
+    std::shared_ptr<int> payload = std::make_shared<int>(0);
+    std::atomic<uint64_t>* done = &s_done;
+    for(int i = 0; i < CHILD_TASKS; ++i)
+    {
+        sc->schedule([sc, done, payload, i]() {
+            if(sc && payload)
+                done->fetch_add(1 + *payload * i);
+        });
+    }
+    ++s_done;
+}
+
+// 返回每秒完成的任务数
+static double bench(size_t threads, void (*root)())
+{
+    s_done = 0;
+    uint64_t start = shiosylar::GetCurrentUS();
+    {
+        shiosylar::Scheduler sc(threads, false, "bench");
+        sc.start();
+        for(int i = 0; i < ROOT_TASKS; ++i)
+            sc.schedule(root);
+        sc.stop();
+    }
+    uint64_t used = shiosylar::GetCurrentUS() - start;
+    return s_done * 1000000.0 / (used ? used : 1);
+}
+
+int main(int argc, char *argv[])
+{
+    // 调度器在每次通知和空闲时都会打日志，压测时关闭
+    LOG_NAME("system")->setLevel(shiosylar::LogLevel::ERROR);
+    LOG_ROOT()->setLevel(shiosylar::LogLevel::ERROR);
+
+    const size_t counts[] = {1, 4, 16, 64};
+    for(size_t threads : counts)
+    {
+        double tps = bench(threads, &root_task);
+        double capture_tps = bench(threads, &root_capture_task);
+        printf("threads=%-3zu tasks=%d fnptr tasks/s=%.0f capture tasks/s=%.0f\n", threads,
+               ROOT_TASKS * (CHILD_TASKS + 1), tps, capture_tps);
+    }
+    return 0;
+}
@@ -0,0 +1,147 @@
+// 共享栈与私有栈的对比测试
+// 创建大量挂起的协程模拟空闲连接，比较每个协程增加的映射内存(地址空间)和常驻内存(实际提交的物理页)
+// 私有栈的物理页按需提交，常驻内存只有用到的那几页，所以两者的差距取决于协程挂起时的栈深，按几种栈深分别测量
+// 再轮流切入所有协程，比较每对切换(切入加切出)的耗时，共享栈的切换含换出和换入的拷贝
+// 用法: bench_shared_stack [协程数] [栈深字节数]，不指定栈深时依次测量512、4096、16384
+
+#include "fiber.h"
+#include "logger.h"
+#include "util.h"
+
+#include <alloca.h>
+#include <malloc.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <vector>
+
+static const int ROUNDS = 20;          // 轮流切换的轮数
+
+static shiosylar::Fiber* s_current = nullptr;
+static bool s_stop = false;
+static size_t s_depth = 512;           // 挂起时栈上读缓冲区的字节数
+
+// 一次测量的结果，均为每个协程的平均值
+struct Sample
+{
+    double mapped = 0;      // 增加的映射内存字节数
+    double resident = 0;    // 增加的常驻内存字节数
+    double saved = 0;       // 共享栈协程保存栈内容的堆内存字节数
+    double ns = 0;          // 每对切换的纳秒数
+};
+
+// 当前进程的映射内存和常驻内存字节数
+static void memory_bytes(size_t& mapped, size_t& resident)
+{
+    size_t size = 0, pages = 0;
+    FILE* fp = fopen("/proc/self/statm", "r");
+    if(fp)
+    {
+        if(fscanf(fp, "%zu %zu", &size, &pages) != 2)
+            size = pages = 0;
+        fclose(fp);
+    }
+    mapped = size * sysconf(_SC_PAGESIZE);
+    resident = pages * sysconf(_SC_PAGESIZE);
+}
+
+// 模拟连接处理，栈上有读缓冲区，在等待下一个请求时挂起
+static void __attribute__((noinline)) handle_request(int round)
+{
+    char* buf = (char*)alloca(s_depth);
+    memset(buf, round, s_depth);
+    asm volatile("" : : "r"(buf) : "memory");
+    s_current->back();
+}
+
+static void connection_loop()
+{
+    for(int round = 0; !s_stop; ++round)
+        handle_request(round);
+}
+
+// 创建count个挂起的协程，测量每个协程增加的内存和每对切换的纳秒数
+static Sample bench(bool shared, int count)
+{
+    Sample sample;
+    s_stop = false;
+    std::vector<shiosylar::Fiber::ptr> fibers;
+    fibers.reserve(count);
+
+    malloc_trim(0); // 归还上一次测量释放的堆内存，避免被这一次复用而少算
+    size_t mapped_before = 0, resident_before = 0;
+    memory_bytes(mapped_before, resident_before);
+    uint64_t saved_before = shiosylar::Fiber::GetStackStats().savedBytes;
+    for(int i = 0; i < count; ++i)
+    {
+        fibers.emplace_back(new shiosylar::Fiber(&connection_loop, 0, true, shared));
+        s_current = fibers.back().get();
+        s_current->call(); // 运行到第一次挂起
+    }
+    size_t mapped_after = 0, resident_after = 0;
+    memory_bytes(mapped_after, resident_after);
+    sample.mapped = ((double)mapped_after - mapped_before) / count;
+    sample.resident = ((double)resident_after - resident_before) / count;
+    sample.saved = ((double)shiosylar::Fiber::GetStackStats().savedBytes - saved_before) / count;
+
+    uint64_t start = shiosylar::GetCurrentUS();
+    for(int r = 0; r < ROUNDS; ++r)
+    {
+        for(auto& fiber : fibers)
+        {
+            s_current = fiber.get();
+            fiber->call();
+        }
+    }
+    uint64_t used = shiosylar::GetCurrentUS() - start;
+    sample.ns = used * 1000.0 / ((double)ROUNDS * count);
+
+    s_stop = true; // 让协程函数执行完
+    for(auto& fiber : fibers)
+    {
+        s_current = fiber.get();
+        fiber->call();
+    }
+    return sample;
+}
+
+static double ratio(double a, double b)
+{
+    return b > 0 ? a / b : 0;
+}
+
+int main(int argc, char *argv[])
+{
+    LOG_NAME("system")->setLevel(shiosylar::LogLevel::ERROR);
+    LOG_ROOT()->setLevel(shiosylar::LogLevel::ERROR);
+
+    int count = argc > 1 ? atoi(argv[1]) : 20000;
+    std::vector<size_t> depths = {512, 4096, 16384};
+    if(argc > 2)
+        depths.assign(1, (size_t)atol(argv[2]));
+    shiosylar::Fiber::GetThis(); // 创建主协程
+
+    printf("fibers=%d rounds=%d\n", count, ROUNDS);
+    printf("%-6s %-8s %14s %14s %14s %15s\n", "depth", "stack", "mapped/fiber", "resident/fiber",
+           "saved/fiber", "ns/switch pair");
+    for(size_t depth : depths)
+    {
+        s_depth = depth;
+        Sample shared = bench(true, count);
+        Sample priv = bench(false, count);
+        printf("%-6zu %-8s %14.0f %14.0f %14s %15.1f\n", depth, "private", priv.mapped, priv.resident,
+               "-", priv.ns);
+        printf("%-6zu %-8s %14.0f %14.0f %14.0f %15.1f\n", depth, "shared", shared.mapped, shared.resident,
+               shared.saved, shared.ns);
+        printf("%-6zu mapped ratio=%.1fx resident ratio=%.1fx switch cost ratio=%.1fx\n", depth,
+               ratio(priv.mapped, shared.mapped), ratio(priv.resident, shared.resident),
+               ratio(shared.ns, priv.ns));
+    }
+
+    shiosylar::Fiber::StackStats stats = shiosylar::Fiber::GetStackStats();
+    printf("shared saves=%lu restores=%lu avg copy=%.0f bytes\n", (unsigned long)stats.saves,
+           (unsigned long)stats.restores,
+           stats.saves + stats.restores ? (double)stats.copiedBytes / (stats.saves + stats.restores) : 0);
+    return 0;
+}